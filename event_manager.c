@@ -12,9 +12,13 @@
 #include "mqtt/http_manager.h"
 #include "hardware/hardware_manager.h"
 #include "hardware/display/display_driver.h"
+#include "hardware/temperature/temp_wake_stub.h"
 #include "utils/nvs_utils.h"
 #include "utils/fs_utils.h"
+#include "utils/deadline_scheduler.h"
 #include "esp_sleep.h"
+#include "esp_pm.h"
+#include "esp_attr.h"
 #include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_heap_caps.h"
@@ -30,21 +34,103 @@
 #define ADVERTISING_INTERVAL_MS (60 * 1000)
 #define PH_CONFIRMATION_TIMEOUT_MS (30 * 1000)
 #define CONNECTION_TIMEOUT_MS (15 * 1000)
+#define LINGER_MIN_MS CONFIG_MQTT_LINGER_MIN_MS
+#define LINGER_POLL_MS 100
 #define TIME_SYNC_TIMEOUT_MS (60 * 60 * 1000)
+#define DEADLINE_TIMER_MAX_MS (60 * 60 * 1000) // Re-checked at least this often
+#define CLOCK_STEP_THRESHOLD_MS 1000          // Smaller SNTP corrections leave deadlines alone
+#define DEFAULT_SLEEP_SEC (60 * 60)           // Nothing scheduled
+#define ADVERTISING_SLACK_SEC 15
+#define WAKE_ESTIMATE_HORIZON_SEC (24 * 60 * 60)
+
+// Sleep break-even model: a deep sleep costs a reboot at active current on top
+// of the deep-sleep current, a light sleep only the higher light-sleep current.
+// Below the break-even gap light sleep uses less charge.
+#define SLEEP_BOOT_TIME_MS CONFIG_SLEEP_BOOT_TIME_MS
+#define SLEEP_ACTIVE_CURRENT_UA (CONFIG_SLEEP_ACTIVE_CURRENT_MA * 1000ULL)
+#define SLEEP_LIGHT_CURRENT_UA CONFIG_SLEEP_LIGHT_CURRENT_UA
+#define SLEEP_DEEP_CURRENT_UA CONFIG_SLEEP_DEEP_CURRENT_UA
+#define LIGHT_SLEEP_MIN_FREQ_MHZ 40 // Crystal frequency; the CPU idles on XTAL between jobs
 #define EVENT_MANAGER_NVS_NAMESPACE "event_mgr"
 
 static const char *TAG = "event_manager";
 static EventGroupHandle_t s_event_group = NULL;
 
-static TimerHandle_t ble_timer = NULL;
-static TimerHandle_t publish_timer = NULL;
-static TimerHandle_t temp_reading_timer = NULL;
-static TimerHandle_t feeding_timer = NULL;
-static TimerHandle_t time_sync_timer = NULL;
 static uint32_t publish_interval_sec = 0;
 static uint32_t g_temp_reading_interval_sec = 0;
 static uint32_t g_feeding_interval_sec = 0;
 
+// Subsystems
+//
+// A cold boot or a button wake brings everything up. A timer wake only brings
+// up what the jobs due on that wake need; anything else is initialized on
+// demand by the task that first uses it.
+#define SUBSYSTEM_HARDWARE BIT0 // Display, buttons, sensors, feeder
+#define SUBSYSTEM_NETWORK BIT1  // Wi-Fi and SNTP
+#define SUBSYSTEM_BLE BIT2
+#define SUBSYSTEM_ALL (SUBSYSTEM_HARDWARE | SUBSYSTEM_NETWORK | SUBSYSTEM_BLE)
+
+static uint32_t s_subsystems_ready = 0;
+static SemaphoreHandle_t s_subsystem_mutex = NULL;
+
+// Scheduled jobs
+//
+// Every timed job is an absolute wall-clock deadline in one min-heap kept in
+// RTC memory, so the whole schedule survives deep sleep as a single record.
+// One FreeRTOS timer is armed for the earliest deadline and raises the event
+// bits of whatever is due. Periodic jobs are re-armed when dispatched, one
+// interval after their previous nominal deadline, so running early or late
+// within the window never shifts the schedule; periods missed while asleep are
+// skipped, not caught up. One-shot jobs are scheduled by whoever needs them.
+//
+// Each job also tolerates running up to `slack_sec` either side of its
+// deadline. Whenever jobs are dispatched, every job whose window has opened
+// runs along, and the sleep planner wakes at the latest moment the earliest
+// window allows, so jobs due within a few minutes of each other share a wake
+// (and one boot) instead of paying for one each.
+typedef enum
+{
+    JOB_TEMP = 0,
+    JOB_FEED,
+    JOB_PUBLISH,
+    JOB_TIME_SYNC,
+    JOB_BLE,
+    JOB_COUNT,
+} job_t;
+
+typedef struct
+{
+    const char *name;
+    EventBits_t bit;
+    const uint32_t *interval_sec; // NULL for one-shot jobs
+    uint32_t repeat_sec;          // One-shot jobs: usual time until they are scheduled again
+    uint32_t slack_sec;
+    uint32_t subsystems; // Needed to run the job
+} job_info_t;
+
+static const job_info_t s_jobs[JOB_COUNT] = {
+    [JOB_TEMP] = {"temp", EVENT_BIT_TEMP_SCHEDULED, &g_temp_reading_interval_sec, 0,
+                  CONFIG_SCHEDULE_TEMP_SLACK_SEC, SUBSYSTEM_HARDWARE},
+    [JOB_FEED] = {"feed", EVENT_BIT_FEED_SCHEDULED, &g_feeding_interval_sec, 0,
+                  CONFIG_SCHEDULE_FEED_SLACK_SEC, SUBSYSTEM_HARDWARE},
+    [JOB_PUBLISH] = {"publish", EVENT_BIT_PUBLISH_SCHEDULED, &publish_interval_sec, 0,
+                     CONFIG_SCHEDULE_PUBLISH_SLACK_SEC, SUBSYSTEM_NETWORK},
+    // After each successful sync
+    [JOB_TIME_SYNC] = {"time_sync", EVENT_BIT_TIME_SYNC, NULL, TIME_SYNC_TIMEOUT_MS / 1000,
+                       CONFIG_SCHEDULE_TIME_SYNC_SLACK_SEC, SUBSYSTEM_NETWORK},
+    // After each advertising window
+    [JOB_BLE] = {"ble", EVENT_BIT_BLE_ADVERTISING, NULL, ADVERTISING_INTERVAL_MS / 1000,
+                 ADVERTISING_SLACK_SEC, SUBSYSTEM_BLE},
+};
+
+static RTC_DATA_ATTR deadline_scheduler_t s_schedule;
+static portMUX_TYPE s_schedule_lock = portMUX_INITIALIZER_UNLOCKED;
+static TimerHandle_t s_deadline_timer = NULL;
+
+// Wall clock and uptime at the same moment, to tell how far SNTP stepped the clock
+static int64_t s_clock_ref_ms = 0;
+static int64_t s_clock_ref_us = 0;
+
 static float temp_lower = -INFINITY;
 static float temp_upper = INFINITY;
 static float ph_lower = -INFINITY;
@@ -58,6 +144,255 @@ static bool g_sntp_initialized = false; // Whether SNTP has been initialized
 static int32_t activity_counter = 0;
 static SemaphoreHandle_t activity_counter_mutex = NULL;
 
+static void clock_ref_update(void)
+{
+    s_clock_ref_ms = event_manager_get_current_timestamp_ms();
+    s_clock_ref_us = esp_timer_get_time();
+}
+
+// Re-arms the deadline timer for the earliest deadline. `wait` is the timer
+// command queue block time, 0 from the timer callback itself.
+static void arm_deadline_timer(TickType_t wait)
+{
+    if (s_deadline_timer == NULL)
+    {
+        return;
+    }
+
+    uint8_t job;
+    int64_t deadline_ms;
+    taskENTER_CRITICAL(&s_schedule_lock);
+    bool scheduled = deadline_scheduler_peek(&s_schedule, &job, &deadline_ms);
+    taskEXIT_CRITICAL(&s_schedule_lock);
+
+    if (!scheduled)
+    {
+        xTimerStop(s_deadline_timer, wait);
+        return;
+    }
+
+    int64_t delay_ms = deadline_ms - event_manager_get_current_timestamp_ms();
+    if (delay_ms > DEADLINE_TIMER_MAX_MS)
+    {
+        delay_ms = DEADLINE_TIMER_MAX_MS;
+    }
+    TickType_t delay_ticks = delay_ms > 0 ? pdMS_TO_TICKS(delay_ms) : 0;
+    xTimerChangePeriod(s_deadline_timer, delay_ticks > 0 ? delay_ticks : 1, wait);
+}
+
+static uint32_t job_period_sec(int job)
+{
+    return s_jobs[job].interval_sec != NULL ? *s_jobs[job].interval_sec : s_jobs[job].repeat_sec;
+}
+
+// A window wider than half the period would let a job run twice in a row
+static int64_t job_slack_ms(int job)
+{
+    uint32_t slack_sec = s_jobs[job].slack_sec;
+    uint32_t period_sec = job_period_sec(job);
+    if (period_sec > 0 && slack_sec > period_sec / 2)
+    {
+        slack_sec = period_sec / 2;
+    }
+    return (int64_t)slack_sec * 1000LL;
+}
+
+// Pops every job whose tolerance window has opened, re-arms the periodic ones
+// on their nominal period and raises their bits. Returns the bits raised.
+static EventBits_t dispatch_due_jobs(TickType_t wait)
+{
+    int64_t now_ms = event_manager_get_current_timestamp_ms();
+    EventBits_t due = 0;
+
+    taskENTER_CRITICAL(&s_schedule_lock);
+    uint32_t open = 0;
+    for (uint8_t i = 0; i < s_schedule.count; i++)
+    {
+        const deadline_entry_t *entry = &s_schedule.heap[i];
+        if (entry->deadline_ms - job_slack_ms(entry->job) <= now_ms)
+        {
+            open |= 1UL << entry->job;
+        }
+    }
+    for (int job = 0; job < JOB_COUNT; job++)
+    {
+        if (!(open & (1UL << job)))
+        {
+            continue;
+        }
+        due |= s_jobs[job].bit;
+        const uint32_t *interval_sec = s_jobs[job].interval_sec;
+        if (interval_sec != NULL && *interval_sec > 0)
+        {
+            int64_t period_ms = (int64_t)*interval_sec * 1000LL;
+            int64_t slack_ms = job_slack_ms(job);
+            int64_t next_ms = deadline_scheduler_get(&s_schedule, job) + period_ms;
+            if (next_ms - slack_ms <= now_ms)
+            {
+                // Skip to the first period whose window has not opened yet
+                next_ms += ((now_ms - (next_ms - slack_ms)) / period_ms + 1) * period_ms;
+            }
+            deadline_scheduler_set(&s_schedule, job, next_ms);
+        }
+        else
+        {
+            deadline_scheduler_cancel(&s_schedule, job);
+        }
+    }
+    taskEXIT_CRITICAL(&s_schedule_lock);
+
+    if (due != 0)
+    {
+        event_manager_set_bits(due);
+    }
+    arm_deadline_timer(wait);
+    return due;
+}
+
+static void deadline_timer_callback(TimerHandle_t xTimer)
+{
+    dispatch_due_jobs(0);
+}
+
+// Runs `job` `delay_sec` from now, replacing any deadline it already has
+static void schedule_job(job_t job, uint32_t delay_sec)
+{
+    int64_t deadline_ms = event_manager_get_current_timestamp_ms() + (int64_t)delay_sec * 1000LL;
+    taskENTER_CRITICAL(&s_schedule_lock);
+    deadline_scheduler_set(&s_schedule, job, deadline_ms);
+    taskEXIT_CRITICAL(&s_schedule_lock);
+    arm_deadline_timer(portMAX_DELAY);
+}
+
+static void cancel_job(job_t job)
+{
+    taskENTER_CRITICAL(&s_schedule_lock);
+    deadline_scheduler_cancel(&s_schedule, job);
+    taskEXIT_CRITICAL(&s_schedule_lock);
+    arm_deadline_timer(portMAX_DELAY);
+}
+
+// Seconds until `job` is due, rounded up; 0 if it is due or not scheduled
+static uint32_t job_remaining_sec(job_t job, int64_t now_ms)
+{
+    taskENTER_CRITICAL(&s_schedule_lock);
+    int64_t deadline_ms = deadline_scheduler_get(&s_schedule, job);
+    taskEXIT_CRITICAL(&s_schedule_lock);
+    if (deadline_ms < 0 || deadline_ms <= now_ms)
+    {
+        return 0;
+    }
+    return (uint32_t)((deadline_ms - now_ms + 999) / 1000);
+}
+
+// Latest wake that still runs the job whose window closes first, and how many
+// jobs that wake serves. Jobs in the `skip_jobs` mask are left out. False if
+// nothing is scheduled.
+static bool plan_wake(int64_t *wake_ms, uint8_t *job, int *job_count, uint32_t skip_jobs)
+{
+    bool planned = false;
+    taskENTER_CRITICAL(&s_schedule_lock);
+    for (uint8_t i = 0; i < s_schedule.count; i++)
+    {
+        const deadline_entry_t *entry = &s_schedule.heap[i];
+        if (skip_jobs & (1UL << entry->job))
+        {
+            continue;
+        }
+        int64_t close_ms = entry->deadline_ms + job_slack_ms(entry->job);
+        if (!planned || close_ms < *wake_ms)
+        {
+            *wake_ms = close_ms;
+            *job = entry->job;
+            planned = true;
+        }
+    }
+    *job_count = 0;
+    for (uint8_t i = 0; planned && i < s_schedule.count; i++)
+    {
+        const deadline_entry_t *entry = &s_schedule.heap[i];
+        if (!(skip_jobs & (1UL << entry->job)) && entry->deadline_ms - job_slack_ms(entry->job) <= *wake_ms)
+        {
+            (*job_count)++;
+        }
+    }
+    taskEXIT_CRITICAL(&s_schedule_lock);
+    return planned;
+}
+
+// Wakes over the next day if every job keeps recurring at its current period,
+// either on its own deadline or sharing wakes within the tolerance windows
+static uint32_t estimate_wakes_per_day(bool coalesce)
+{
+    int64_t now_ms = event_manager_get_current_timestamp_ms();
+    int64_t deadline_ms[JOB_COUNT];
+    int64_t period_ms[JOB_COUNT];
+    int64_t slack_ms[JOB_COUNT];
+
+    for (int job = 0; job < JOB_COUNT; job++)
+    {
+        taskENTER_CRITICAL(&s_schedule_lock);
+        deadline_ms[job] = deadline_scheduler_get(&s_schedule, job);
+        taskEXIT_CRITICAL(&s_schedule_lock);
+        period_ms[job] = (int64_t)job_period_sec(job) * 1000LL;
+        slack_ms[job] = coalesce ? job_slack_ms(job) : 0;
+        if (period_ms[job] == 0)
+        {
+            deadline_ms[job] = -1;
+        }
+        else if (deadline_ms[job] < 0)
+        {
+            deadline_ms[job] = now_ms + period_ms[job];
+        }
+    }
+
+    uint32_t wakes = 0;
+    int64_t end_ms = now_ms + WAKE_ESTIMATE_HORIZON_SEC * 1000LL;
+    for (;;)
+    {
+        int64_t wake_ms = -1;
+        for (int job = 0; job < JOB_COUNT; job++)
+        {
+            if (deadline_ms[job] >= 0 && (wake_ms < 0 || deadline_ms[job] + slack_ms[job] < wake_ms))
+            {
+                wake_ms = deadline_ms[job] + slack_ms[job];
+            }
+        }
+        if (wake_ms < 0 || wake_ms > end_ms)
+        {
+            break;
+        }
+
+        wakes++;
+        for (int job = 0; job < JOB_COUNT; job++)
+        {
+            if (deadline_ms[job] < 0 || deadline_ms[job] - slack_ms[job] > wake_ms)
+            {
+                continue;
+            }
+            if (s_jobs[job].interval_sec == NULL)
+            {
+                // One-shot jobs are scheduled again once they have run
+                deadline_ms[job] = wake_ms + period_ms[job];
+                continue;
+            }
+            // Periodic jobs stay on their nominal period, as in dispatch_due_jobs()
+            deadline_ms[job] += period_ms[job];
+            while (deadline_ms[job] - slack_ms[job] <= wake_ms)
+            {
+                deadline_ms[job] += period_ms[job];
+            }
+        }
+    }
+    return wakes;
+}
+
+static void log_wake_estimate(void)
+{
+    ESP_LOGI(TAG, "Estimated wakes per day: %lu one per deadline, %lu with tolerance windows",
+             (unsigned long)estimate_wakes_per_day(false), (unsigned long)estimate_wakes_per_day(true));
+}
+
 static void sntp_sync_time_cb(struct timeval *tv)
 {
     ESP_LOGI(TAG, "SNTP time synchronized: %ld", (long)tv->tv_sec);
@@ -66,6 +401,20 @@ static void sntp_sync_time_cb(struct timeval *tv)
     g_synced_time_ms = (int64_t)tv->tv_sec * 1000LL + (int64_t)tv->tv_usec / 1000LL;
     g_time_synced = true;
 
+    // Deadlines are wall-clock times: move them with the clock so a job due in
+    // ten minutes is still due in ten minutes, not decades ago
+    int64_t expected_ms = s_clock_ref_ms + (esp_timer_get_time() - s_clock_ref_us) / 1000LL;
+    int64_t step_ms = g_synced_time_ms - expected_ms;
+    if (step_ms > CLOCK_STEP_THRESHOLD_MS || step_ms < -CLOCK_STEP_THRESHOLD_MS)
+    {
+        taskENTER_CRITICAL(&s_schedule_lock);
+        deadline_scheduler_shift(&s_schedule, step_ms);
+        taskEXIT_CRITICAL(&s_schedule_lock);
+        ESP_LOGI(TAG, "Clock stepped by %lld ms, deadlines moved with it", (long long)step_ms);
+    }
+    clock_ref_update();
+    arm_deadline_timer(portMAX_DELAY);
+
     ESP_LOGI(TAG, "Updated time sync: synced_time_ms=%lld", (long long)g_synced_time_ms);
 
     event_manager_set_bits(EVENT_BIT_TIME_SYNC);
@@ -91,6 +440,56 @@ static void initialize_sntp(void)
     g_sntp_initialized = true;
 }
 
+// Initializes whichever of `subsystems` are not up yet
+static void subsystems_ensure(uint32_t subsystems)
+{
+    xSemaphoreTake(s_subsystem_mutex, portMAX_DELAY);
+    uint32_t missing = subsystems & ~s_subsystems_ready;
+    if (missing & SUBSYSTEM_HARDWARE)
+    {
+        hardware_manager_init();
+    }
+    if (missing & SUBSYSTEM_NETWORK)
+    {
+        wifi_manager_init();
+        initialize_sntp();
+    }
+    if (missing & SUBSYSTEM_BLE)
+    {
+        ble_manager_init();
+    }
+    if (missing != 0)
+    {
+        ESP_LOGI(TAG, "Initialized subsystems 0x%lx at %lld ms after boot", (unsigned long)missing,
+                 (long long)(esp_timer_get_time() / 1000));
+    }
+    s_subsystems_ready |= missing;
+    xSemaphoreGive(s_subsystem_mutex);
+}
+
+static bool subsystems_ready(uint32_t subsystems)
+{
+    return (s_subsystems_ready & subsystems) == subsystems;
+}
+
+bool event_manager_is_ble_ready(void)
+{
+    return subsystems_ready(SUBSYSTEM_BLE);
+}
+
+static uint32_t subsystems_for_jobs(EventBits_t bits)
+{
+    uint32_t subsystems = 0;
+    for (int job = 0; job < JOB_COUNT; job++)
+    {
+        if (bits & s_jobs[job].bit)
+        {
+            subsystems |= s_jobs[job].subsystems;
+        }
+    }
+    return subsystems;
+}
+
 typedef struct
 {
     TaskHandle_t task_handle;
@@ -163,31 +562,6 @@ uint32_t event_manager_get_passkey(void)
     return ble_manager_get_passkey();
 }
 
-static void publish_timer_callback(TimerHandle_t xTimer)
-{
-    event_manager_set_bits(EVENT_BIT_PUBLISH_SCHEDULED);
-}
-
-static void ble_connection_timer_callback(TimerHandle_t xTimer)
-{
-    event_manager_set_bits(EVENT_BIT_BLE_ADVERTISING);
-}
-
-static void temp_reading_timer_callback(TimerHandle_t xTimer)
-{
-    event_manager_set_bits(EVENT_BIT_TEMP_SCHEDULED);
-}
-
-static void feeding_timer_callback(TimerHandle_t xTimer)
-{
-    event_manager_set_bits(EVENT_BIT_FEED_SCHEDULED);
-}
-
-static void time_sync_timer_callback(TimerHandle_t xTimer)
-{
-    event_manager_set_bits(EVENT_BIT_TIME_SYNC);
-}
-
 static void load_intervals(void)
 {
     // Load intervals and last times from NVS
@@ -222,204 +596,59 @@ static void load_intervals(void)
              (unsigned long)g_temp_reading_interval_sec, (unsigned long)g_feeding_interval_sec,
              (unsigned long)publish_interval_sec);
 
-    typedef struct
+    // The schedule itself is kept in RTC memory. After a cold boot, or if the
+    // record is damaged, every periodic job starts a full interval from now.
+    taskENTER_CRITICAL(&s_schedule_lock);
+    bool restored = deadline_scheduler_valid(&s_schedule);
+    if (!restored)
     {
-        uint32_t temp_remaining;
-        uint32_t feed_remaining;
-        uint32_t publish_remaining;
-        uint32_t time_sync_remaining;
-    } timer_remaining_data_t;
-
-    timer_remaining_data_t timer_data;
-    size_t timer_data_size = sizeof(timer_data);
-    esp_err_t timer_load_err = nvs_load_blob(EVENT_MANAGER_NVS_NAMESPACE, "timer_remaining", &timer_data, &timer_data_size);
-
-    bool use_saved_timers = (timer_load_err == ESP_OK && timer_data_size == sizeof(timer_data));
-
-    if (use_saved_timers)
-    {
-        ESP_LOGI(TAG, "Loaded timer remaining values from NVS: temp=%lu sec, feed=%lu sec, publish=%lu sec",
-                 (unsigned long)timer_data.temp_remaining,
-                 (unsigned long)timer_data.feed_remaining,
-                 (unsigned long)timer_data.publish_remaining);
+        deadline_scheduler_init(&s_schedule);
     }
-
-    if (g_temp_reading_interval_sec > 0 && temp_reading_timer != NULL)
+    taskEXIT_CRITICAL(&s_schedule_lock);
+    if (restored)
     {
-        uint32_t remaining_sec = 0;
-        bool should_trigger = false;
-
-        if (use_saved_timers)
-        {
-            if (timer_data.temp_remaining == 0)
-            {
-                // Timer expired (remaining = 0) - trigger immediately
-                should_trigger = true;
-                remaining_sec = g_temp_reading_interval_sec;
-            }
-            else if (timer_data.temp_remaining > 0)
-            {
-                remaining_sec = timer_data.temp_remaining;
-                if (remaining_sec >= g_temp_reading_interval_sec)
-                {
-                    should_trigger = true;
-                    remaining_sec = g_temp_reading_interval_sec;
-                }
-            }
-        }
-        else
-        {
-            // No saved timer or invalid, set full interval
-            remaining_sec = g_temp_reading_interval_sec;
-        }
-
-        if (should_trigger)
-        {
-            ESP_LOGI(TAG, "Temp timer expired, triggering immediately");
-            TickType_t period_ticks = pdMS_TO_TICKS(remaining_sec * 1000);
-            xTimerChangePeriod(temp_reading_timer, period_ticks, portMAX_DELAY);
-            xTimerStart(temp_reading_timer, portMAX_DELAY);
-            event_manager_set_bits(EVENT_BIT_TEMP_SCHEDULED);
-        }
-        else
-        {
-            ESP_LOGI(TAG, "Setting temp timer to remaining time: %lu seconds", (unsigned long)remaining_sec);
-            xTimerChangePeriod(temp_reading_timer, pdMS_TO_TICKS(remaining_sec * 1000), 0);
-            xTimerStart(temp_reading_timer, 0);
-        }
+        ESP_LOGI(TAG, "Restored schedule from RTC memory");
     }
-
-    if (g_feeding_interval_sec > 0 && feeding_timer != NULL)
+    else
     {
-        uint32_t remaining_sec = 0;
-        bool should_trigger = false;
-
-        if (use_saved_timers && timer_data.feed_remaining > 0)
-        {
-            remaining_sec = timer_data.feed_remaining;
-            if (remaining_sec >= g_feeding_interval_sec)
-            {
-                should_trigger = true;
-                remaining_sec = g_feeding_interval_sec;
-            }
-        }
-        else
-        {
-            // No saved timer or invalid, set full interval
-            remaining_sec = g_feeding_interval_sec;
-        }
-
-        if (should_trigger)
-        {
-            ESP_LOGI(TAG, "Feed timer expired, triggering immediately");
-            TickType_t period_ticks = pdMS_TO_TICKS(remaining_sec * 1000);
-            xTimerChangePeriod(feeding_timer, period_ticks, portMAX_DELAY);
-            xTimerStart(feeding_timer, portMAX_DELAY);
-            event_manager_set_bits(EVENT_BIT_FEED_SCHEDULED);
-        }
-        else
-        {
-            ESP_LOGI(TAG, "Setting feed timer to remaining time: %lu seconds", (unsigned long)remaining_sec);
-            xTimerChangePeriod(feeding_timer, pdMS_TO_TICKS(remaining_sec * 1000), 0);
-            xTimerStart(feeding_timer, 0);
-        }
+        ESP_LOGI(TAG, "No saved schedule, starting a new one");
     }
 
-    // Set publish timer
-    if (publish_interval_sec > 0 && publish_timer != NULL)
+    int64_t now_ms = event_manager_get_current_timestamp_ms();
+    for (int job = 0; job < JOB_COUNT; job++)
     {
-        uint32_t remaining_sec = 0;
-        bool should_trigger = false;
-
-        if (use_saved_timers)
-        {
-            if (timer_data.publish_remaining == 0)
-            {
-                // Timer expired (remaining = 0) - trigger immediately
-                should_trigger = true;
-                remaining_sec = publish_interval_sec;
-            }
-            else if (timer_data.publish_remaining > 0)
-            {
-                remaining_sec = timer_data.publish_remaining;
-                if (remaining_sec >= publish_interval_sec)
-                {
-                    should_trigger = true;
-                    remaining_sec = publish_interval_sec;
-                }
-            }
-        }
-        else
+        const uint32_t *interval_sec = s_jobs[job].interval_sec;
+        if (interval_sec == NULL)
         {
-            // No saved timer or invalid, set full interval
-            remaining_sec = publish_interval_sec;
+            continue;
         }
 
-        if (should_trigger)
+        taskENTER_CRITICAL(&s_schedule_lock);
+        int64_t deadline_ms = deadline_scheduler_get(&s_schedule, job);
+        if (*interval_sec == 0)
         {
-            ESP_LOGI(TAG, "Publish timer expired, triggering immediately");
-            TickType_t period_ticks = pdMS_TO_TICKS(remaining_sec * 1000);
-            xTimerChangePeriod(publish_timer, period_ticks, portMAX_DELAY);
-            xTimerStart(publish_timer, portMAX_DELAY);
-            event_manager_set_bits(EVENT_BIT_PUBLISH_SCHEDULED);
+            deadline_scheduler_cancel(&s_schedule, job);
         }
-        else
+        else if (deadline_ms < 0 || deadline_ms - now_ms > (int64_t)*interval_sec * 1000LL)
         {
-            ESP_LOGI(TAG, "Setting publish timer to remaining time: %lu seconds", (unsigned long)remaining_sec);
-            xTimerChangePeriod(publish_timer, pdMS_TO_TICKS(remaining_sec * 1000), 0);
-            xTimerStart(publish_timer, 0);
+            // Not scheduled yet, or further out than a whole interval
+            deadline_scheduler_set(&s_schedule, job, now_ms + (int64_t)*interval_sec * 1000LL);
         }
+        taskEXIT_CRITICAL(&s_schedule_lock);
     }
 
-    // Set time sync timer - only restore from NVS if time is already synced
-    // Otherwise, timer will be started after successful sync
-    if (time_sync_timer != NULL && g_time_synced)
+    for (int job = 0; job < JOB_COUNT; job++)
     {
-        uint32_t remaining_sec = 0;
-        bool should_trigger = false;
-
-        if (use_saved_timers)
-        {
-            if (timer_data.time_sync_remaining == 0)
-            {
-                // Timer expired (remaining = 0) - trigger immediately
-                should_trigger = true;
-                remaining_sec = TIME_SYNC_TIMEOUT_MS / 1000;
-            }
-            else if (timer_data.time_sync_remaining > 0 && timer_data.time_sync_remaining <= (TIME_SYNC_TIMEOUT_MS / 1000))
-            {
-                // Valid remaining time - use it
-                remaining_sec = timer_data.time_sync_remaining;
-            }
-            else
-            {
-                // Invalid value (greater than 24h) - reset to full interval
-                ESP_LOGW(TAG, "Invalid time_sync_remaining value (%lu sec), resetting to %lu sec",
-                         (unsigned long)timer_data.time_sync_remaining, (unsigned long)(TIME_SYNC_TIMEOUT_MS / 1000));
-                remaining_sec = TIME_SYNC_TIMEOUT_MS / 1000;
-            }
-        }
-        else
-        {
-            // No saved timer or invalid, set full interval
-            remaining_sec = TIME_SYNC_TIMEOUT_MS / 1000;
-        }
-
-        if (should_trigger)
-        {
-            ESP_LOGI(TAG, "Time sync timer expired, triggering immediately");
-            TickType_t period_ticks = pdMS_TO_TICKS(remaining_sec * 1000);
-            xTimerChangePeriod(time_sync_timer, period_ticks, portMAX_DELAY);
-            xTimerStart(time_sync_timer, portMAX_DELAY);
-            event_manager_set_bits(EVENT_BIT_TIME_SYNC);
-        }
-        else
+        taskENTER_CRITICAL(&s_schedule_lock);
+        int64_t deadline_ms = deadline_scheduler_get(&s_schedule, job);
+        taskEXIT_CRITICAL(&s_schedule_lock);
+        if (deadline_ms >= 0)
         {
-            ESP_LOGI(TAG, "Setting time sync timer to remaining time: %lu seconds", (unsigned long)remaining_sec);
-            xTimerChangePeriod(time_sync_timer, pdMS_TO_TICKS(remaining_sec * 1000), 0);
-            xTimerStart(time_sync_timer, 0);
+            ESP_LOGI(TAG, "Job %s due in %lld s", s_jobs[job].name, (long long)((deadline_ms - now_ms) / 1000));
         }
     }
+
+    log_wake_estimate();
 }
 
 void event_manager_set_temp_lower(float threshold)
@@ -473,16 +702,15 @@ void event_manager_set_feeding_interval(uint32_t feed_interval_seconds)
 
     if (feed_interval_seconds == 0)
     {
-        xTimerStop(feeding_timer, portMAX_DELAY);
-        ESP_LOGI(TAG, "Feeding timer stopped");
+        cancel_job(JOB_FEED);
+        ESP_LOGI(TAG, "Feeding stopped");
     }
     else
     {
-        TickType_t period_ticks = pdMS_TO_TICKS(feed_interval_seconds * 1000);
-        xTimerChangePeriod(feeding_timer, period_ticks, portMAX_DELAY);
-        xTimerStart(feeding_timer, portMAX_DELAY);
-        ESP_LOGI(TAG, "Feeding timer set to %lu seconds (auto-reload)", (unsigned long)feed_interval_seconds);
+        schedule_job(JOB_FEED, feed_interval_seconds);
+        ESP_LOGI(TAG, "Feeding every %lu seconds", (unsigned long)feed_interval_seconds);
     }
+    log_wake_estimate();
 }
 
 void event_manager_set_temp_reading_interval(uint32_t temp_interval_seconds)
@@ -490,24 +718,17 @@ void event_manager_set_temp_reading_interval(uint32_t temp_interval_seconds)
     g_temp_reading_interval_sec = temp_interval_seconds;
     nvs_save_blob(EVENT_MANAGER_NVS_NAMESPACE, "temp_int", &g_temp_reading_interval_sec, sizeof(uint32_t));
 
-    if (temp_reading_timer == NULL)
-    {
-        ESP_LOGE(TAG, "Temperature reading timer not initialized");
-        return;
-    }
-
     if (temp_interval_seconds == 0)
     {
-        xTimerStop(temp_reading_timer, portMAX_DELAY);
-        ESP_LOGI(TAG, "Temperature reading timer stopped");
+        cancel_job(JOB_TEMP);
+        ESP_LOGI(TAG, "Temperature readings stopped");
     }
     else
     {
-        TickType_t period_ticks = pdMS_TO_TICKS(temp_interval_seconds * 1000);
-        xTimerChangePeriod(temp_reading_timer, period_ticks, portMAX_DELAY);
-        xTimerStart(temp_reading_timer, portMAX_DELAY);
-        ESP_LOGI(TAG, "Temperature reading timer set to %lu seconds (auto-reload)", (unsigned long)temp_interval_seconds);
+        schedule_job(JOB_TEMP, temp_interval_seconds);
+        ESP_LOGI(TAG, "Temperature reading every %lu seconds", (unsigned long)temp_interval_seconds);
     }
+    log_wake_estimate();
 }
 
 void event_manager_set_publish_interval(int publish_frequency)
@@ -515,24 +736,17 @@ void event_manager_set_publish_interval(int publish_frequency)
     publish_interval_sec = publish_frequency >= 0 ? (uint32_t)publish_frequency : 0;
     nvs_save_blob(EVENT_MANAGER_NVS_NAMESPACE, "publish_int", &publish_interval_sec, sizeof(uint32_t));
 
-    if (publish_timer == NULL)
-    {
-        ESP_LOGE(TAG, "Publish timer not initialized");
-        return;
-    }
-
     if (publish_interval_sec == 0)
     {
-        xTimerStop(publish_timer, portMAX_DELAY);
-        ESP_LOGI(TAG, "Publish timer disabled (never)");
+        cancel_job(JOB_PUBLISH);
+        ESP_LOGI(TAG, "Scheduled publishing disabled (never)");
     }
     else
     {
-        TickType_t period_ticks = pdMS_TO_TICKS(publish_interval_sec * 1000);
-        xTimerChangePeriod(publish_timer, period_ticks, portMAX_DELAY);
-        xTimerStart(publish_timer, portMAX_DELAY);
-        ESP_LOGI(TAG, "Publish timer set to %lu seconds (auto-reload)", (unsigned long)publish_interval_sec);
+        schedule_job(JOB_PUBLISH, publish_interval_sec);
+        ESP_LOGI(TAG, "Publishing every %lu seconds", (unsigned long)publish_interval_sec);
     }
+    log_wake_estimate();
 }
 
 uint32_t event_manager_get_feeding_interval(void)
@@ -550,157 +764,6 @@ uint32_t event_manager_get_publish_interval(void)
     return publish_interval_sec;
 }
 
-uint32_t event_manager_get_temp_timer_remaining_sec(void)
-{
-    if (temp_reading_timer == NULL || g_temp_reading_interval_sec == 0)
-    {
-        return 0;
-    }
-
-    if (xTimerIsTimerActive(temp_reading_timer) == pdTRUE)
-    {
-        TickType_t expiry_time = xTimerGetExpiryTime(temp_reading_timer);
-        TickType_t current_ticks = xTaskGetTickCount();
-
-        TickType_t remaining_ticks;
-        if (expiry_time > current_ticks)
-        {
-            remaining_ticks = expiry_time - current_ticks;
-        }
-        else
-        {
-            return 0;
-        }
-
-        uint32_t remaining_ms = (uint32_t)(remaining_ticks * portTICK_PERIOD_MS);
-        return remaining_ms / 1000;
-    }
-
-    return 0;
-}
-
-uint32_t event_manager_get_feed_timer_remaining_sec(void)
-{
-    if (feeding_timer == NULL || g_feeding_interval_sec == 0)
-    {
-        return 0;
-    }
-
-    if (xTimerIsTimerActive(feeding_timer) == pdTRUE)
-    {
-        TickType_t expiry_time = xTimerGetExpiryTime(feeding_timer);
-        TickType_t current_ticks = xTaskGetTickCount();
-
-        TickType_t remaining_ticks;
-        if (expiry_time > current_ticks)
-        {
-            remaining_ticks = expiry_time - current_ticks;
-        }
-        else
-        {
-            return 0;
-        }
-
-        uint32_t remaining_ms = (uint32_t)(remaining_ticks * portTICK_PERIOD_MS);
-        return remaining_ms / 1000;
-    }
-
-    return 0;
-}
-
-static uint32_t get_publish_timer_remaining_sec(void)
-{
-    if (publish_timer == NULL || publish_interval_sec == 0)
-    {
-        return 0;
-    }
-
-    if (xTimerIsTimerActive(publish_timer) == pdTRUE)
-    {
-        TickType_t expiry_time = xTimerGetExpiryTime(publish_timer);
-        TickType_t current_ticks = xTaskGetTickCount();
-
-        TickType_t remaining_ticks;
-        if (expiry_time > current_ticks)
-        {
-            remaining_ticks = expiry_time - current_ticks;
-        }
-        else
-        {
-            return 0;
-        }
-
-        uint32_t remaining_ms = (uint32_t)(remaining_ticks * portTICK_PERIOD_MS);
-        return remaining_ms / 1000;
-    }
-
-    return 0;
-}
-
-static uint32_t get_ble_timer_remaining_sec(void)
-{
-    if (ble_timer == NULL)
-    {
-        return 0;
-    }
-
-    if (xTimerIsTimerActive(ble_timer) == pdFALSE)
-    {
-        return 0;
-    }
-
-    TickType_t expiry_time = xTimerGetExpiryTime(ble_timer);
-    TickType_t current_time = xTaskGetTickCount();
-
-    // Handle timer overflow
-    TickType_t remaining_ticks;
-    if (expiry_time > current_time)
-    {
-        remaining_ticks = expiry_time - current_time;
-    }
-    else
-    {
-        // Timer has already expired or will expire very soon
-        return 0;
-    }
-
-    // Convert ticks to seconds (portTICK_PERIOD_MS is in milliseconds)
-    uint32_t remaining_ms = (uint32_t)(remaining_ticks * portTICK_PERIOD_MS);
-    return remaining_ms / 1000;
-}
-
-static uint32_t get_time_sync_timer_remaining_sec(void)
-{
-    if (time_sync_timer == NULL)
-    {
-        return 0;
-    }
-
-    if (xTimerIsTimerActive(time_sync_timer) == pdFALSE)
-    {
-        return 0;
-    }
-
-    TickType_t expiry_time = xTimerGetExpiryTime(time_sync_timer);
-    TickType_t current_time = xTaskGetTickCount();
-
-    // Handle timer overflow
-    TickType_t remaining_ticks;
-    if (expiry_time > current_time)
-    {
-        remaining_ticks = expiry_time - current_time;
-    }
-    else
-    {
-        // Timer has already expired or will expire very soon
-        return 0;
-    }
-
-    // Convert ticks to seconds (portTICK_PERIOD_MS is in milliseconds)
-    uint32_t remaining_ms = (uint32_t)(remaining_ticks * portTICK_PERIOD_MS);
-    return remaining_ms / 1000;
-}
-
 static void activity_counter_increment(void)
 {
     if (activity_counter_mutex != NULL && xSemaphoreTake(activity_counter_mutex, portMAX_DELAY) == pdTRUE)
@@ -770,6 +833,7 @@ void event_manager_advertising_task(void *pvParameters)
         EventBits_t bits = event_manager_wait_bits(EVENT_BIT_BLE_ADVERTISING, false, false, portMAX_DELAY);
         if (bits & EVENT_BIT_BLE_ADVERTISING)
         {
+            subsystems_ensure(SUBSYSTEM_BLE);
             ble_start_advertising();
             activity_counter_increment();
 
@@ -792,11 +856,7 @@ void event_manager_advertising_task(void *pvParameters)
             ble_stop_advertising();
             activity_counter_decrement();
 
-            if (ble_timer != NULL)
-            {
-                xTimerReset(ble_timer, portMAX_DELAY);
-                xTimerStart(ble_timer, portMAX_DELAY);
-            }
+            schedule_job(JOB_BLE, ADVERTISING_INTERVAL_MS / 1000);
 
             event_manager_clear_bits(EVENT_BIT_BLE_ADVERTISING);
             event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
@@ -813,6 +873,7 @@ static void event_manager_provisioning_task(void *pvParameters)
         if (bits & EVENT_BIT_PAIRING_MODE_ON)
         {
             ESP_LOGI(TAG, "Pairing mode on");
+            subsystems_ensure(SUBSYSTEM_HARDWARE | SUBSYSTEM_BLE);
             ble_start_advertising();
             activity_counter_increment();
             hardware_manager_display_event("pairing_screen", NAN);
@@ -858,6 +919,31 @@ static void event_manager_provisioning_task(void *pvParameters)
     }
 }
 
+// Queues an alert and an early publish if `temp` is outside the thresholds.
+// Returns the bits raised.
+static EventBits_t check_temp_thresholds(float temp)
+{
+    const char *event = NULL;
+    if (temp < temp_lower)
+    {
+        event = "temp_below";
+    }
+    else if (temp > temp_upper)
+    {
+        event = "temp_above";
+    }
+    if (event == NULL)
+    {
+        return 0;
+    }
+
+    char value_str[32];
+    snprintf(value_str, sizeof(value_str), "%.2f", temp);
+    mqtt_manager_enqueue_log(event, value_str);
+    event_manager_set_bits(EVENT_BIT_PUBLISH_SCHEDULED);
+    return EVENT_BIT_PUBLISH_SCHEDULED;
+}
+
 static void event_manager_action_task(void *pvParameters)
 {
     (void)pvParameters;
@@ -874,6 +960,7 @@ static void event_manager_action_task(void *pvParameters)
             portMAX_DELAY);
 
         activity_counter_increment();
+        subsystems_ensure(SUBSYSTEM_HARDWARE);
 
         if (bits & EVENT_BIT_TEMP_SCHEDULED)
         {
@@ -882,35 +969,18 @@ static void event_manager_action_task(void *pvParameters)
             if (!isnan(temp))
             {
                 mqtt_manager_enqueue_temperature(temp);
-                ble_manager_notify_temperature(temp);
-
-                if (temp < temp_lower)
+                if (subsystems_ready(SUBSYSTEM_BLE))
                 {
-                    char value_str[32];
-                    snprintf(value_str, sizeof(value_str), "%.2f", temp);
-                    mqtt_manager_enqueue_log("temp_below", value_str);
-                    event_manager_set_bits(EVENT_BIT_PUBLISH_SCHEDULED);
-                }
-                else if (temp > temp_upper)
-                {
-                    char value_str[32];
-                    snprintf(value_str, sizeof(value_str), "%.2f", temp);
-                    mqtt_manager_enqueue_log("temp_above", value_str);
-                    event_manager_set_bits(EVENT_BIT_PUBLISH_SCHEDULED);
+                    ble_manager_notify_temperature(temp);
                 }
+
+                check_temp_thresholds(temp);
             }
             else
             {
                 mqtt_manager_enqueue_log("hardware_error", "temperature_read_failed");
             }
             event_manager_clear_bits(EVENT_BIT_TEMP_SCHEDULED);
-
-            if (temp_reading_timer != NULL && g_temp_reading_interval_sec > 0)
-            {
-                TickType_t period_ticks = pdMS_TO_TICKS(g_temp_reading_interval_sec * 1000);
-                xTimerChangePeriod(temp_reading_timer, period_ticks, portMAX_DELAY);
-                xTimerStart(temp_reading_timer, portMAX_DELAY);
-            }
         }
 
         if (bits & EVENT_BIT_PH_SCHEDULED)
@@ -941,7 +1011,10 @@ static void event_manager_action_task(void *pvParameters)
                 // Round pH to 2 decimal places
                 float ph_rounded = roundf(ph_value * 100.0f) / 100.0f;
                 mqtt_manager_enqueue_ph(ph_rounded);
-                ble_manager_notify_ph(ph_value);
+                if (subsystems_ready(SUBSYSTEM_BLE))
+                {
+                    ble_manager_notify_ph(ph_value);
+                }
 
                 // Check if threshold is exceeded
                 if (ph_rounded < ph_lower)
@@ -982,15 +1055,12 @@ static void event_manager_action_task(void *pvParameters)
             if (!feed_successful)
                 event_manager_set_bits(EVENT_BIT_PUBLISH_SCHEDULED);
 
-            ble_manager_notify_feed(feed_successful);
-
-            event_manager_clear_bits(EVENT_BIT_FEED_SCHEDULED);
-            if (temp_reading_timer != NULL && g_temp_reading_interval_sec > 0)
+            if (subsystems_ready(SUBSYSTEM_BLE))
             {
-                TickType_t period_ticks = pdMS_TO_TICKS(g_feeding_interval_sec * 1000);
-                xTimerChangePeriod(feeding_timer, period_ticks, portMAX_DELAY);
-                xTimerStart(feeding_timer, portMAX_DELAY);
+                ble_manager_notify_feed(feed_successful);
             }
+
+            event_manager_clear_bits(EVENT_BIT_FEED_SCHEDULED);
         }
 
         vTaskDelay(pdMS_TO_TICKS(2000));
@@ -1020,234 +1090,396 @@ void event_manager_display_task(void *pvParameters)
         }
         else if (bits & EVENT_BIT_DISPLAY_CONFIRM)
         {
-            hardware_manager_display_confirm();
+            hardware_manager_display_confirm();
+        }
+    }
+}
+
+// Network jobs
+//
+// Publishing, time sync and OTA all need Wi-Fi. Whatever is pending when the
+// connection task wakes is collected into one session that brings Wi-Fi up once,
+// runs SNTP alongside the MQTT connect and publish, and stops the radio after
+// the last job. Jobs raised during the session (e.g. OTA from a shadow command)
+// join it instead of reconnecting.
+#define NETWORK_JOB_BITS (EVENT_BIT_PUBLISH_SCHEDULED | EVENT_BIT_OTA_UPDATE | EVENT_BIT_TIME_SYNC)
+#define SNTP_WAIT_TIMEOUT_MS (30 * 1000)
+#define VALID_TIME_THRESHOLD 1609459200 // 2021-01-01 00:00:00
+
+static void session_publish(void)
+{
+    mqtt_manager_start();
+
+    EventBits_t bits = event_manager_wait_bits(EVENT_BIT_MQTT_STATUS, false, false, pdMS_TO_TICKS(CONNECTION_TIMEOUT_MS));
+    if (!(bits & EVENT_BIT_WIFI_STATUS) || !(bits & EVENT_BIT_MQTT_STATUS))
+    {
+        ESP_LOGW(TAG, "Publish failed - not connected to MQTT");
+        mqtt_manager_stop();
+        return;
+    }
+
+    ESP_LOGI(TAG, "Connection successful");
+    mqtt_manager_publish();
+
+    // Linger for commands only until the connection goes idle: everything
+    // acknowledged and the shadow fetched, with each delta buying some more
+    // time. CONNECTION_TIMEOUT_MS caps it if the broker stops answering.
+    int64_t linger_start_us = esp_timer_get_time();
+    int64_t linger_ms = 0;
+    while (linger_ms < CONNECTION_TIMEOUT_MS)
+    {
+        vTaskDelay(pdMS_TO_TICKS(LINGER_POLL_MS));
+        linger_ms = (esp_timer_get_time() - linger_start_us) / 1000;
+        bits = event_manager_get_bits();
+        if (!(bits & EVENT_BIT_WIFI_STATUS))
+        {
+            ESP_LOGW(TAG, "WiFi disconnected during wait period, stopping early");
+            break;
+        }
+        if (bits & EVENT_BIT_OTA_UPDATE)
+        {
+            ESP_LOGI(TAG, "OTA update triggered, stopping early");
+            break;
+        }
+        if (linger_ms >= LINGER_MIN_MS && mqtt_manager_is_idle())
+        {
+            break;
+        }
+    }
+
+    ESP_LOGI(TAG, "No longer receiving commands, closing connection after %lld ms", (long long)linger_ms);
+    mqtt_manager_stop();
+}
+
+// Waits for the SNTP sync started earlier in the session, if it has not
+// completed yet, and schedules the next sync on success
+static void session_finish_time_sync(void)
+{
+    if (g_time_synced)
+    {
+        ESP_LOGI(TAG, "Time already synchronized");
+    }
+    else
+    {
+        EventBits_t bits = event_manager_wait_bits(EVENT_BIT_TIME_SYNC, false, false, pdMS_TO_TICKS(SNTP_WAIT_TIMEOUT_MS));
+        if (bits & EVENT_BIT_TIME_SYNC)
+        {
+            ESP_LOGI(TAG, "Time synchronized successfully");
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Time sync timed out");
         }
     }
+
+    // Always a full interval after a successful sync, regardless of any earlier deadline
+    if (g_time_synced)
+    {
+        schedule_job(JOB_TIME_SYNC, TIME_SYNC_TIMEOUT_MS / 1000);
+    }
 }
 
-// Connection task
-void event_manager_connection_task(void *pvParameters)
+// Downloads and installs the firmware. Only returns if the update failed;
+// on success the device restarts into the new image.
+static void session_ota(void)
 {
-    (void)pvParameters;
+    ESP_LOGI(TAG, "WiFi ready, starting firmware update...");
+    event_manager_clear_bits(EVENT_BIT_OTA_UPDATE);
 
-    while (1)
+    const char *firmware_url = command_service_get_firmware_url();
+    if (firmware_url == NULL || strlen(firmware_url) == 0)
     {
-        EventBits_t bits = event_manager_wait_bits(EVENT_BIT_PUBLISH_SCHEDULED | EVENT_BIT_OTA_UPDATE | EVENT_BIT_TIME_SYNC, false, false, portMAX_DELAY);
-        if (bits & EVENT_BIT_PUBLISH_SCHEDULED)
-        {
-            ESP_LOGI(TAG, "Publish scheduled");
-            // Clear the bit immediately to prevent re-triggering during processing
-            event_manager_clear_bits(EVENT_BIT_PUBLISH_SCHEDULED);
-            activity_counter_increment();
+        ESP_LOGE(TAG, "No firmware URL available");
+        return;
+    }
 
-            wifi_manager_start();
+    ESP_LOGI(TAG, "Firmware download URL: %s", firmware_url);
 
-            bits = event_manager_wait_bits(EVENT_BIT_WIFI_STATUS, false, false, pdMS_TO_TICKS(CONNECTION_TIMEOUT_MS));
-            if (!(bits & EVENT_BIT_WIFI_STATUS))
-            {
-                ESP_LOGW(TAG, "Publish failed - not connected to WiFi");
-                activity_counter_decrement();
-                wifi_manager_stop();
-                continue;
-            }
+    ble_stop_advertising();
+    mqtt_manager_stop();
+    // No scheduled jobs while the image is written
+    xTimerStop(s_deadline_timer, portMAX_DELAY);
 
-            mqtt_manager_start();
+    vTaskDelay(pdMS_TO_TICKS(1000));
+    esp_err_t err = http_manager_perform_ota_update(firmware_url);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "OTA update failed: %s", esp_err_to_name(err));
+        dispatch_due_jobs(portMAX_DELAY);
+        return;
+    }
 
-            bits = event_manager_wait_bits(EVENT_BIT_MQTT_STATUS, false, false, pdMS_TO_TICKS(CONNECTION_TIMEOUT_MS));
-            if (!(bits & EVENT_BIT_WIFI_STATUS) || !(bits & EVENT_BIT_MQTT_STATUS))
-            {
-                ESP_LOGW(TAG, "Publish failed - not connected to MQTT");
-                activity_counter_decrement();
-                mqtt_manager_stop();
-                wifi_manager_stop();
-                event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
-                continue;
-            }
+    uint8_t pending_flag = 1;
+    esp_err_t nvs_err = nvs_save_blob("firmware", "pending_ota", &pending_flag, sizeof(pending_flag));
+    if (nvs_err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to save pending OTA flag to NVS: %s", esp_err_to_name(nvs_err));
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Saved pending OTA flag to NVS (will be confirmed after verification)");
+    }
 
-            ESP_LOGI(TAG, "Connection successful");
-            mqtt_manager_publish();
+    wifi_manager_stop();
+    // RTC memory does not survive a software reset
+    mqtt_manager_flush_staged();
+    vTaskDelay(pdMS_TO_TICKS(2000));
+    esp_restart();
+}
 
-            for (int i = 0; i < CONNECTION_TIMEOUT_MS / 1000; i++)
-            {
-                vTaskDelay(pdMS_TO_TICKS(1000));
-                bits = event_manager_get_bits();
-                if (!(bits & EVENT_BIT_WIFI_STATUS))
-                {
-                    ESP_LOGW(TAG, "WiFi disconnected during wait period, stopping early");
-                    break;
-                }
-                if (bits & EVENT_BIT_OTA_UPDATE)
-                {
-                    ESP_LOGI(TAG, "OTA update triggered, stopping early");
-                    continue;
-                }
-            }
+// Connection task
+void event_manager_connection_task(void *pvParameters)
+{
+    (void)pvParameters;
 
-            ESP_LOGI(TAG, "No longer receiving commands, closing connection");
+    while (1)
+    {
+        EventBits_t jobs = event_manager_wait_bits(NETWORK_JOB_BITS, false, false, portMAX_DELAY) & NETWORK_JOB_BITS;
+        // Clear the request bits immediately to prevent re-triggering during processing.
+        // The OTA bit stays set until the update starts, so a failed connect retries it.
+        event_manager_clear_bits(jobs & (EVENT_BIT_PUBLISH_SCHEDULED | EVENT_BIT_TIME_SYNC));
+        ESP_LOGI(TAG, "Network session: publish=%d time_sync=%d ota=%d",
+                 (jobs & EVENT_BIT_PUBLISH_SCHEDULED) != 0, (jobs & EVENT_BIT_TIME_SYNC) != 0,
+                 (jobs & EVENT_BIT_OTA_UPDATE) != 0);
+        activity_counter_increment();
 
-            mqtt_manager_stop();
+        subsystems_ensure(SUBSYSTEM_NETWORK);
+        wifi_manager_start();
 
-            // Only stop WiFi if it's still connected (avoid race condition with auto-reconnect)
-            bits = event_manager_get_bits();
-            if (bits & EVENT_BIT_WIFI_STATUS)
-            {
-                wifi_manager_stop();
-            }
-            else
-            {
-                ESP_LOGI(TAG, "WiFi already disconnected, skipping stop");
-            }
-            if (publish_timer != NULL && publish_interval_sec > 0)
-            {
-                TickType_t period_ticks = pdMS_TO_TICKS(publish_interval_sec * 1000);
-                xTimerChangePeriod(publish_timer, period_ticks, portMAX_DELAY);
-                xTimerStart(publish_timer, portMAX_DELAY);
-            }
+        EventBits_t bits = event_manager_wait_bits(EVENT_BIT_WIFI_STATUS, false, false, pdMS_TO_TICKS(CONNECTION_TIMEOUT_MS));
+        if (!(bits & EVENT_BIT_WIFI_STATUS))
+        {
+            ESP_LOGW(TAG, "Network session failed - not connected to WiFi");
+            event_manager_clear_bits(EVENT_BIT_OTA_UPDATE);
             activity_counter_decrement();
+            wifi_manager_stop();
+            event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
+            continue;
         }
-        else if (bits & EVENT_BIT_TIME_SYNC)
+
+        if (jobs & EVENT_BIT_TIME_SYNC)
         {
-            ESP_LOGI(TAG, "Time sync requested");
+            // The sync callback reports completion through the same bit
             event_manager_clear_bits(EVENT_BIT_TIME_SYNC);
-            activity_counter_increment();
-
-            wifi_manager_start();
+            initialize_sntp();
 
-            bits = event_manager_wait_bits(EVENT_BIT_WIFI_STATUS, false, false, pdMS_TO_TICKS(CONNECTION_TIMEOUT_MS));
-            if (!(bits & EVENT_BIT_WIFI_STATUS))
+            // Certificate checks need a sane clock, so only a clock that is
+            // already roughly right lets SNTP run alongside the MQTT connect
+            if (!g_time_synced && time(NULL) < VALID_TIME_THRESHOLD && (jobs & EVENT_BIT_PUBLISH_SCHEDULED))
             {
-                ESP_LOGW(TAG, "Time sync failed - not connected to WiFi");
-                activity_counter_decrement();
-                wifi_manager_stop();
-                continue;
+                ESP_LOGI(TAG, "Clock not set, waiting for SNTP before connecting to MQTT");
+                session_finish_time_sync();
+                jobs &= ~EVENT_BIT_TIME_SYNC;
             }
+        }
 
-            initialize_sntp();
+        if (jobs & EVENT_BIT_PUBLISH_SCHEDULED)
+        {
+            session_publish();
+        }
 
-            // Check if time is already synced before waiting
-            if (g_time_synced)
-            {
-                ESP_LOGI(TAG, "Time already synchronized");
-            }
-            else
-            {
-                // Wait for SNTP sync with timeout (30 seconds)
-                bits = event_manager_wait_bits(EVENT_BIT_TIME_SYNC, true, false, pdMS_TO_TICKS(portMAX_DELAY));
-                if (bits & EVENT_BIT_TIME_SYNC)
-                {
-                    ESP_LOGI(TAG, "Time synchronized successfully");
-                }
-            }
+        if (jobs & EVENT_BIT_TIME_SYNC)
+        {
+            session_finish_time_sync();
+        }
+        // A sync that completed during the session is not a new request
+        event_manager_clear_bits(EVENT_BIT_TIME_SYNC);
 
-            // Start time sync timer after synchronization (if timer exists and time is synced)
-            // Always reset to full 24 hours after successful sync, regardless of any saved value
-            if (g_time_synced && time_sync_timer != NULL)
-            {
-                // Stop timer first to ensure clean restart
-                xTimerStop(time_sync_timer, portMAX_DELAY);
-                TickType_t period_ticks = pdMS_TO_TICKS(TIME_SYNC_TIMEOUT_MS);
-                xTimerChangePeriod(time_sync_timer, period_ticks, portMAX_DELAY);
-                xTimerStart(time_sync_timer, portMAX_DELAY);
-            }
+        // Requested up front or by a command received while publishing
+        if (event_manager_get_bits() & EVENT_BIT_OTA_UPDATE)
+        {
+            session_ota();
+        }
 
+        // Only stop WiFi if it's still connected (avoid race condition with auto-reconnect)
+        bits = event_manager_get_bits();
+        if (bits & EVENT_BIT_WIFI_STATUS)
+        {
             wifi_manager_stop();
-            activity_counter_decrement();
         }
-        else if (bits & EVENT_BIT_OTA_UPDATE)
+        else
         {
-            ESP_LOGI(TAG, "OTA update triggered");
-            activity_counter_increment();
+            ESP_LOGI(TAG, "WiFi already disconnected, skipping stop");
+        }
+        activity_counter_decrement();
 
-            wifi_manager_start();
+        event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
+    }
+}
 
-            bits = event_manager_wait_bits(EVENT_BIT_WIFI_STATUS, false, false, pdMS_TO_TICKS(CONNECTION_TIMEOUT_MS));
+// Gap below which light sleep uses less charge than a deep sleep and reboot,
+// 0 if light sleep never pays off
+static uint64_t sleep_break_even_ms(void)
+{
+    if (SLEEP_LIGHT_CURRENT_UA <= SLEEP_DEEP_CURRENT_UA)
+    {
+        return 0;
+    }
+    return (uint64_t)SLEEP_BOOT_TIME_MS * SLEEP_ACTIVE_CURRENT_UA / (SLEEP_LIGHT_CURRENT_UA - SLEEP_DEEP_CURRENT_UA);
+}
 
-            if (!(bits & EVENT_BIT_WIFI_STATUS))
-            {
-                ESP_LOGE(TAG, "OTA update failed - WiFi=%d",
-                         (bits & EVENT_BIT_WIFI_STATUS) != 0);
-                activity_counter_decrement();
-                wifi_manager_stop();
-                event_manager_clear_bits(EVENT_BIT_OTA_UPDATE);
-                event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
-                continue;
-            }
+static bool choose_light_sleep(uint64_t gap_ms)
+{
+    // Charge over the gap in uA*s
+    uint64_t light_uas = gap_ms * SLEEP_LIGHT_CURRENT_UA / 1000;
+    uint64_t deep_uas = (gap_ms * SLEEP_DEEP_CURRENT_UA + (uint64_t)SLEEP_BOOT_TIME_MS * SLEEP_ACTIVE_CURRENT_UA) / 1000;
+    bool light = light_uas < deep_uas;
+    ESP_LOGI(TAG, "Gap %llu ms: light sleep %llu uAs, deep sleep %llu uAs with reboot (break-even %llu ms) -> %s sleep",
+             (unsigned long long)gap_ms, (unsigned long long)light_uas, (unsigned long long)deep_uas,
+             (unsigned long long)sleep_break_even_ms(), light ? "light" : "deep");
+    return light;
+}
 
-            ESP_LOGI(TAG, "WiFi ready, starting firmware update...");
+// Sleeps through a short gap without rebooting
+static void light_sleep(uint64_t duration_us)
+{
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    // Automatic light sleep: with every task blocked the idle task puts the chip
+    // to sleep until the next timer, so the deadline timer wakes it for the job.
+    // Enabled on first use and left on; drivers hold PM locks while they need
+    // the clocks.
+    static bool s_auto_light_sleep = false;
+    if (!s_auto_light_sleep)
+    {
+        esp_pm_config_t pm_config = {
+            .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+            .min_freq_mhz = LIGHT_SLEEP_MIN_FREQ_MHZ,
+            .light_sleep_enable = true,
+        };
+        gpio_wakeup_enable(GPIO_CONFIRM_BUTTON, GPIO_INTR_LOW_LEVEL);
+        esp_sleep_enable_gpio_wakeup();
+        esp_err_t err = esp_pm_configure(&pm_config);
+        if (err != ESP_OK)
+        {
+            ESP_LOGW(TAG, "Failed to enable automatic light sleep: %s", esp_err_to_name(err));
+        }
+        s_auto_light_sleep = err == ESP_OK;
+    }
+    if (s_auto_light_sleep)
+    {
+        return;
+    }
+#endif
 
-            const char *firmware_url = command_service_get_firmware_url();
-            if (firmware_url == NULL || strlen(firmware_url) == 0)
-            {
-                ESP_LOGE(TAG, "No firmware URL available");
-                wifi_manager_stop();
-                activity_counter_decrement();
-                event_manager_clear_bits(EVENT_BIT_OTA_UPDATE);
-                event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
-                continue;
-            }
+    // Without tickless idle, sleep explicitly until the deadline or the button
+    esp_sleep_enable_timer_wakeup(duration_us);
+    gpio_wakeup_enable(GPIO_CONFIRM_BUTTON, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    esp_err_t err = esp_light_sleep_start();
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Light sleep rejected: %s", esp_err_to_name(err));
+        vTaskDelay(pdMS_TO_TICKS(duration_us / 1000));
+    }
 
-            ESP_LOGI(TAG, "Firmware download URL: %s", firmware_url);
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO)
+    {
+        // Same as a button wake from deep sleep
+        ESP_LOGI(TAG, "Woke up from light sleep - button pressed (GPIO %d)", GPIO_CONFIRM_BUTTON);
+        subsystems_ensure(SUBSYSTEM_HARDWARE);
+        hardware_manager_display_wake();
+        hardware_manager_display_update();
+        event_manager_set_bits(EVENT_BIT_BLE_ADVERTISING);
+        return;
+    }
 
-            ble_stop_advertising();
-            mqtt_manager_stop();
-            // stop all timers
+    // Nothing else asks for sleep if no job is due yet (e.g. woke slightly early)
+    dispatch_due_jobs(portMAX_DELAY);
+    event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
+}
 
-            if (temp_reading_timer != NULL)
-            {
-                xTimerStop(temp_reading_timer, portMAX_DELAY);
-                xTimerDelete(temp_reading_timer, portMAX_DELAY);
-                temp_reading_timer = NULL;
-            }
-            if (feeding_timer != NULL)
-            {
-                xTimerStop(feeding_timer, portMAX_DELAY);
-                xTimerDelete(feeding_timer, portMAX_DELAY);
-                feeding_timer = NULL;
-            }
-            if (publish_timer != NULL)
-            {
-                xTimerStop(publish_timer, portMAX_DELAY);
-                xTimerDelete(publish_timer, portMAX_DELAY);
-                publish_timer = NULL;
-            }
-            if (ble_timer != NULL)
-            {
-                xTimerStop(ble_timer, portMAX_DELAY);
-                xTimerDelete(ble_timer, portMAX_DELAY);
-                ble_timer = NULL;
-            }
+#ifdef CONFIG_TEMP_WAKE_STUB
+// Readings the wake stub may take from `wake_ms` on: as many as still let the
+// full boot one period after the last of them meet every other job's window.
+// Periodic advertising is left out and waits for that boot, or a button wake.
+static uint32_t temp_wake_stub_budget(int64_t wake_ms)
+{
+    int64_t period_ms = (int64_t)g_temp_reading_interval_sec * 1000LL;
+    uint32_t samples = CONFIG_TEMP_WAKE_STUB_SAMPLES;
+    taskENTER_CRITICAL(&s_schedule_lock);
+    for (uint8_t i = 0; i < s_schedule.count; i++)
+    {
+        const deadline_entry_t *entry = &s_schedule.heap[i];
+        if (entry->job == JOB_TEMP || entry->job == JOB_BLE)
+        {
+            continue;
+        }
+        int64_t close_ms = entry->deadline_ms + job_slack_ms(entry->job);
+        int64_t fit = close_ms > wake_ms ? (close_ms - wake_ms) / period_ms : 0;
+        if (fit < samples)
+        {
+            samples = (uint32_t)fit;
+        }
+    }
+    taskEXIT_CRITICAL(&s_schedule_lock);
+    return samples;
+}
 
-            vTaskDelay(pdMS_TO_TICKS(1000));
-            esp_err_t err = http_manager_perform_ota_update(firmware_url);
-            if (err != ESP_OK)
-            {
-                ESP_LOGE(TAG, "OTA update failed: %s", esp_err_to_name(err));
-                wifi_manager_stop();
-                activity_counter_decrement();
-                event_manager_clear_bits(EVENT_BIT_OTA_UPDATE);
-                event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
-                continue;
-            }
+// Replaces the wake plan with one for the wake stub if it can serve the next
+// wake: with advertising suspended that wake only reads the temperature, is
+// far enough out for deep sleep and leaves the stub at least one reading.
+// Returns the readings the stub may take, 0 to keep the plan as it is.
+static uint32_t plan_temp_wake_stub(int64_t now_ms, int64_t *wake_ms, uint8_t *job, int *job_count)
+{
+    if (g_temp_reading_interval_sec == 0)
+    {
+        return 0;
+    }
 
-            uint8_t pending_flag = 1;
-            esp_err_t nvs_err = nvs_save_blob("firmware", "pending_ota", &pending_flag, sizeof(pending_flag));
-            if (nvs_err != ESP_OK)
-            {
-                ESP_LOGW(TAG, "Failed to save pending OTA flag to NVS: %s", esp_err_to_name(nvs_err));
-            }
-            else
-            {
-                ESP_LOGI(TAG, "Saved pending OTA flag to NVS (will be confirmed after verification)");
-            }
+    int64_t stub_wake_ms = 0;
+    uint8_t stub_job;
+    int stub_jobs = 0;
+    if (!plan_wake(&stub_wake_ms, &stub_job, &stub_jobs, 1UL << JOB_BLE) || stub_job != JOB_TEMP ||
+        stub_jobs != 1 || stub_wake_ms - now_ms < (int64_t)sleep_break_even_ms())
+    {
+        return 0;
+    }
 
-            wifi_manager_stop();
-            vTaskDelay(pdMS_TO_TICKS(2000));
-            esp_restart();
-        }
+    uint32_t samples = temp_wake_stub_budget(stub_wake_ms);
+    if (samples > 0)
+    {
+        *wake_ms = stub_wake_ms;
+        *job = stub_job;
+        *job_count = stub_jobs;
+    }
+    return samples;
+}
 
-        event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
+static void arm_temp_wake_stub(uint32_t samples, int64_t wake_ms)
+{
+    temp_wake_stub_arm(g_temp_reading_interval_sec, samples, wake_ms, temp_lower, temp_upper);
+    ESP_LOGI(TAG, "Wake stub takes up to %lu temperature readings, %lu s apart; advertising waits for the next boot",
+             (unsigned long)samples, (unsigned long)g_temp_reading_interval_sec);
+}
+
+// Queues the readings the wake stub took and moves the temperature job to one
+// period after the last of them. Returns the bits raised.
+static EventBits_t drain_temp_wake_stub(void)
+{
+    size_t count = temp_wake_stub_count();
+    temp_wake_sample_t sample = {0};
+    for (size_t i = 0; i < count; i++)
+    {
+        temp_wake_stub_get(i, &sample);
+        mqtt_manager_enqueue_temperature_at(sample.celsius, sample.timestamp_ms);
+    }
+    temp_wake_stub_clear();
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    ESP_LOGI(TAG, "Wake stub took %u temperature readings, last %.2f°C", (unsigned)count, sample.celsius);
+    if (g_temp_reading_interval_sec > 0)
+    {
+        taskENTER_CRITICAL(&s_schedule_lock);
+        deadline_scheduler_set(&s_schedule, JOB_TEMP,
+                               sample.timestamp_ms + (int64_t)g_temp_reading_interval_sec * 1000LL);
+        taskEXIT_CRITICAL(&s_schedule_lock);
     }
+    return check_temp_thresholds(sample.celsius);
 }
+#endif
 
 // Sleep task
 void event_manager_sleep_task(void *pvParameters)
@@ -1265,165 +1497,58 @@ void event_manager_sleep_task(void *pvParameters)
                 continue;
             }
 
-            uint32_t temp_remaining = event_manager_get_temp_timer_remaining_sec();
-            uint32_t feed_remaining = event_manager_get_feed_timer_remaining_sec();
-            uint32_t ble_remaining = get_ble_timer_remaining_sec();
-            uint32_t publish_remaining = get_publish_timer_remaining_sec();
-            uint32_t time_sync_remaining = get_time_sync_timer_remaining_sec();
-
-            ESP_LOGI(TAG, "Timer remaining times - Temp: %lu sec, Feed: %lu sec, BLE: %lu sec, Publish: %lu sec",
-                     (unsigned long)temp_remaining,
-                     (unsigned long)feed_remaining,
-                     (unsigned long)ble_remaining,
-                     (unsigned long)publish_remaining);
-
-            // Check if all timers are 0 (expired) - if so, don't sleep, let tasks execute
-            bool all_timers_expired = true;
-            if ((g_temp_reading_interval_sec > 0 && temp_remaining > 0) ||
-                (g_feeding_interval_sec > 0 && feed_remaining > 0) ||
-                (publish_interval_sec > 0 && publish_remaining > 0) ||
-                ble_remaining > 0)
+            int64_t now_ms = event_manager_get_current_timestamp_ms();
+            for (int job = 0; job < JOB_COUNT; job++)
             {
-                all_timers_expired = false;
+                uint32_t remaining_sec = job_remaining_sec(job, now_ms);
+                if (remaining_sec > 0)
+                {
+                    ESP_LOGI(TAG, "Job %s due in %lu sec", s_jobs[job].name, (unsigned long)remaining_sec);
+                }
             }
 
-            if (all_timers_expired)
+            uint8_t next_job;
+            int64_t next_deadline_ms;
+            taskENTER_CRITICAL(&s_schedule_lock);
+            bool scheduled = deadline_scheduler_peek(&s_schedule, &next_job, &next_deadline_ms);
+            taskEXIT_CRITICAL(&s_schedule_lock);
+
+            // A due job is about to be raised by the deadline timer - don't sleep, let it execute
+            if (scheduled && next_deadline_ms <= now_ms)
             {
-                ESP_LOGI(TAG, "All timers expired (0) - skipping sleep to allow tasks to execute");
-                // Don't enter sleep, wait a bit for tasks to execute, then check again
-                vTaskDelay(pdMS_TO_TICKS(1000)); // Wait 1 second
+                ESP_LOGI(TAG, "Job %s is due - skipping sleep to allow it to execute", s_jobs[next_job].name);
+                vTaskDelay(pdMS_TO_TICKS(1000));
                 continue;
             }
 
-            uint32_t shortest_remaining = UINT32_MAX;
-
-            if (temp_remaining > 0 && temp_remaining < shortest_remaining)
-            {
-                shortest_remaining = temp_remaining;
-            }
-            if (feed_remaining > 0 && feed_remaining < shortest_remaining)
-            {
-                shortest_remaining = feed_remaining;
-            }
-            if (ble_remaining > 0 && ble_remaining < shortest_remaining)
-            {
-                shortest_remaining = ble_remaining;
-            }
-            if (publish_remaining > 0 && publish_remaining < shortest_remaining)
-            {
-                shortest_remaining = publish_remaining;
-            }
+            int64_t wake_ms = 0;
+            int wake_jobs = 0;
+            scheduled = plan_wake(&wake_ms, &next_job, &wake_jobs, 0);
+#ifdef CONFIG_TEMP_WAKE_STUB
+            uint32_t stub_samples = scheduled ? plan_temp_wake_stub(now_ms, &wake_ms, &next_job, &wake_jobs) : 0;
+#endif
 
             uint64_t sleep_duration_us;
             uint32_t sleep_duration_sec;
-            if (shortest_remaining != UINT32_MAX && shortest_remaining > 0)
-            {
-                sleep_duration_us = (uint64_t)shortest_remaining * 1000000ULL;
-                sleep_duration_sec = shortest_remaining;
-                ESP_LOGI(TAG, "Using shortest timer: %lu seconds", (unsigned long)shortest_remaining);
-            }
-            else
-            {
-                sleep_duration_us = 60ULL * 60ULL * 1000000ULL; // 1 hour
-                sleep_duration_sec = 60 * 60;                   // 1 hour in seconds
-                ESP_LOGI(TAG, "No active timers, defaulting to 1 hour (%lld microseconds)",
-                         (long long)sleep_duration_us);
-            }
-
-            typedef struct
-            {
-                uint32_t temp_remaining;
-                uint32_t feed_remaining;
-                uint32_t publish_remaining;
-                uint32_t time_sync_remaining;
-            } timer_remaining_data_t;
-
-            timer_remaining_data_t timer_data = {0};
-
-            // Calculate remaining time after sleep for each timer
-            // If timer is configured but expired (0), save full interval so it triggers after sleep
-            // If timer has remaining time, subtract sleep duration
-            if (g_temp_reading_interval_sec > 0)
-            {
-                if (temp_remaining == 0)
-                {
-                    // Timer expired or not active - save full interval so it triggers after sleep
-                    timer_data.temp_remaining = g_temp_reading_interval_sec;
-                }
-                else if (temp_remaining > sleep_duration_sec)
-                {
-                    timer_data.temp_remaining = temp_remaining - sleep_duration_sec;
-                }
-                else
-                {
-                    // Timer will expire during sleep - save 0 to trigger immediately on wake
-                    timer_data.temp_remaining = 0;
-                }
-            }
-
-            if (g_feeding_interval_sec > 0)
-            {
-                if (feed_remaining == 0)
-                {
-                    // Timer expired or not active - save full interval so it triggers after sleep
-                    timer_data.feed_remaining = g_feeding_interval_sec;
-                }
-                else if (feed_remaining > sleep_duration_sec)
-                {
-                    timer_data.feed_remaining = feed_remaining - sleep_duration_sec;
-                }
-                else
-                {
-                    // Timer will expire during sleep - save 0 to trigger immediately on wake
-                    timer_data.feed_remaining = 0;
-                }
-            }
-
-            if (publish_interval_sec > 0)
+            if (scheduled)
             {
-                if (publish_remaining == 0)
-                {
-                    // Timer expired or not active - save full interval so it triggers after sleep
-                    timer_data.publish_remaining = publish_interval_sec;
-                }
-                else if (publish_remaining > sleep_duration_sec)
-                {
-                    timer_data.publish_remaining = publish_remaining - sleep_duration_sec;
-                }
-                else
-                {
-                    // Timer will expire during sleep - save 0 to trigger immediately on wake
-                    timer_data.publish_remaining = 0;
-                }
-            }
+                sleep_duration_us = (uint64_t)(wake_ms - now_ms) * 1000ULL;
+                sleep_duration_sec = (uint32_t)((wake_ms - now_ms + 999) / 1000);
+                ESP_LOGI(TAG, "Sleeping %lu seconds, until the window of job %s closes (%d jobs in that wake)",
+                         (unsigned long)sleep_duration_sec, s_jobs[next_job].name, wake_jobs);
 
-            // Save time sync timer remaining time
-            if (time_sync_remaining > 0)
-            {
-                if (time_sync_remaining > sleep_duration_sec)
-                {
-                    timer_data.time_sync_remaining = time_sync_remaining - sleep_duration_sec;
-                }
-                else
+                if (choose_light_sleep(sleep_duration_us / 1000))
                 {
-                    // Timer will expire during sleep - save 0 to trigger immediately on wake
-                    timer_data.time_sync_remaining = 0;
+                    light_sleep(sleep_duration_us);
+                    continue;
                 }
             }
             else
             {
-                // Timer expired or not active - save full interval so it triggers after sleep
-                timer_data.time_sync_remaining = TIME_SYNC_TIMEOUT_MS / 1000;
-            }
-
-            esp_err_t nvs_err = nvs_save_blob(EVENT_MANAGER_NVS_NAMESPACE, "timer_remaining", &timer_data, sizeof(timer_data));
-            if (nvs_err != ESP_OK)
-            {
-                ESP_LOGW(TAG, "Failed to save timer remaining values before sleep: %s", esp_err_to_name(nvs_err));
-            }
-            else
-            {
-                ESP_LOGI(TAG, "Saved timer remaining values to NVS before sleep");
+                sleep_duration_us = (uint64_t)DEFAULT_SLEEP_SEC * 1000000ULL;
+                sleep_duration_sec = DEFAULT_SLEEP_SEC;
+                ESP_LOGI(TAG, "No scheduled jobs, defaulting to 1 hour (%lld microseconds)",
+                         (long long)sleep_duration_us);
             }
 
             // Save time sync data before sleep: current time + sleep duration
@@ -1443,7 +1568,7 @@ void event_manager_sleep_task(void *pvParameters)
                     time_sync_data_t sync_data = {
                         .synced_time_ms = time_after_sleep_ms};
 
-                    nvs_err = nvs_save_blob(EVENT_MANAGER_NVS_NAMESPACE, "time_sync", &sync_data, sizeof(sync_data));
+                    esp_err_t nvs_err = nvs_save_blob(EVENT_MANAGER_NVS_NAMESPACE, "time_sync", &sync_data, sizeof(sync_data));
                     if (nvs_err != ESP_OK)
                     {
                         ESP_LOGW(TAG, "Failed to save time sync data before sleep: %s", esp_err_to_name(nvs_err));
@@ -1460,10 +1585,23 @@ void event_manager_sleep_task(void *pvParameters)
                 }
             }
 
+#ifdef CONFIG_TEMP_WAKE_STUB
+            if (stub_samples > 0)
+            {
+                arm_temp_wake_stub(stub_samples, wake_ms);
+            }
+            else
+            {
+                temp_wake_stub_clear();
+            }
+#endif
+
             esp_sleep_enable_timer_wakeup(sleep_duration_us);
             esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON); // Keep RTC peripherals powered
             esp_sleep_enable_ext0_wakeup(GPIO_CONFIRM_BUTTON, 0);            // 0 = wake on LOW (button pressed)
 
+            ESP_LOGI(TAG, "Entering deep sleep after %lld ms awake (subsystems 0x%lx)",
+                     (long long)(esp_timer_get_time() / 1000), (unsigned long)s_subsystems_ready);
             vTaskDelay(pdMS_TO_TICKS(500));
             esp_deep_sleep_start();
         }
@@ -1478,12 +1616,16 @@ void event_manager_init(void)
     {
         ESP_LOGE(TAG, "Failed to create activity counter mutex");
     }
+    s_subsystem_mutex = xSemaphoreCreateMutex();
     num_notifications = 0;
 
-    hardware_manager_init();
-    wifi_manager_init();
-    ble_manager_init();
-    initialize_sntp();
+    esp_sleep_wakeup_cause_t wake_reason = esp_sleep_get_wakeup_cause();
+    bool timer_wake = wake_reason == ESP_SLEEP_WAKEUP_TIMER;
+    if (!timer_wake)
+    {
+        subsystems_ensure(SUBSYSTEM_ALL);
+    }
+    // Readings are queued on every wake; the client itself is set up on first connect
     mqtt_manager_init();
 
     // Don't load time from NVS here - will attempt sync first, then fall back if sync fails
@@ -1528,8 +1670,6 @@ void event_manager_init(void)
     ESP_LOGI(TAG, "Loaded thresholds from NVS: temp=[%.2f, %.2f], ph=[%.2f, %.2f]",
              temp_lower, temp_upper, ph_lower, ph_upper);
 
-    esp_sleep_wakeup_cause_t wake_reason = esp_sleep_get_wakeup_cause();
-
     if (wake_reason == ESP_SLEEP_WAKEUP_UNDEFINED)
     {
         ESP_LOGI(TAG, "Normal boot (not from deep sleep)");
@@ -1582,11 +1722,40 @@ void event_manager_init(void)
         hardware_manager_display_wake();
         hardware_manager_display_update();
     }
-    else if (wake_reason == ESP_SLEEP_WAKEUP_TIMER)
+    else if (timer_wake)
     {
         ESP_LOGI(TAG, "Woke up from deep sleep - timer expired (display will remain off)");
     }
 
+    s_deadline_timer = xTimerCreate(
+        "deadline_timer",
+        pdMS_TO_TICKS(1000), // Re-armed for the earliest deadline
+        pdFALSE,
+        NULL,
+        deadline_timer_callback);
+
+    if (s_deadline_timer == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create deadline timer");
+    }
+
+    clock_ref_update();
+    load_intervals();
+    EventBits_t stub_bits = 0;
+#ifdef CONFIG_TEMP_WAKE_STUB
+    stub_bits = drain_temp_wake_stub();
+#endif
+
+    // Anything that came due while asleep, or whose window has opened, runs now
+    EventBits_t due = dispatch_due_jobs(portMAX_DELAY) | stub_bits;
+    if (timer_wake)
+    {
+        uint32_t needed = subsystems_for_jobs(due);
+        ESP_LOGI(TAG, "Timer wake for jobs 0x%lx, bringing up subsystems 0x%lx", (unsigned long)due,
+                 (unsigned long)needed);
+        subsystems_ensure(needed);
+    }
+
     xTaskCreate(
         event_manager_advertising_task,
         "adv_coordinator",
@@ -1635,52 +1804,15 @@ void event_manager_init(void)
         2,
         NULL);
 
-    publish_timer = xTimerCreate(
-        "publish_timer",
-        pdMS_TO_TICKS(1000), // Initial period (will be changed by setter)
-        pdTRUE,              // Auto-reload: timer will reset itself when it expires
-        NULL,                // Timer ID (not used)
-        publish_timer_callback);
-
-    temp_reading_timer = xTimerCreate(
-        "temp_reading_timer",
-        pdMS_TO_TICKS(1000), // Initial period (will be changed by setter)
-        pdTRUE,              // Auto-reload: timer will reset itself when it expires
-        NULL,                // Timer ID (not used)
-        temp_reading_timer_callback);
-
-    feeding_timer = xTimerCreate(
-        "feeding_timer",
-        pdMS_TO_TICKS(1000), // Initial period (will be changed by setter)
-        pdTRUE,              // Auto-reload: timer will reset itself when it expires
-        NULL,                // Timer ID (not used)
-        feeding_timer_callback);
-
-    ble_timer = xTimerCreate(
-        "ble_connection_timer",
-        pdMS_TO_TICKS(ADVERTISING_INTERVAL_MS),
-        pdFALSE,
-        NULL,
-        ble_connection_timer_callback);
-
-    time_sync_timer = xTimerCreate(
-        "time_sync_timer",
-        pdMS_TO_TICKS(TIME_SYNC_TIMEOUT_MS),
-        pdFALSE,
-        NULL,
-        time_sync_timer_callback);
-
-    if (publish_timer == NULL || temp_reading_timer == NULL || feeding_timer == NULL)
+    if (!timer_wake)
     {
-        ESP_LOGE(TAG, "Failed to create timers");
+        event_manager_set_bits(EVENT_BIT_BLE_ADVERTISING);
     }
-    else
+    else if (due == 0)
     {
-        ESP_LOGI(TAG, "All timers created successfully");
+        // Woke a little before any window opened; plan the next wake
+        event_manager_set_bits(EVENT_BIT_DEEP_SLEEP);
     }
 
-    load_intervals();
-    event_manager_set_bits(EVENT_BIT_BLE_ADVERTISING);
-
     ESP_LOGI(TAG, "Event manager initialized");
 }
\ No newline at end of file
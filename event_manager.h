@@ -4,6 +4,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
+#include <stdbool.h>
 #include <time.h>
 
 // BLE events
@@ -68,5 +69,7 @@ void event_manager_activity_counter_increment(void);
 void event_manager_activity_counter_decrement(void);
 
 int64_t event_manager_get_current_timestamp_ms(void);
+// False on a timer wake that did not need BLE; notifies must be skipped then
+bool event_manager_is_ble_ready(void);
 
 #endif // EVENT_MANAGER_H
@@ -0,0 +1,246 @@
+#include "temp_wake_stub.h"
+
+#ifdef CONFIG_TEMP_WAKE_STUB
+
+#include "hardware_manager.h"
+#include "esp_attr.h"
+#include "esp_rom_sys.h"
+#include "esp_sleep.h"
+#include "esp_wake_stub.h"
+#include "soc/gpio_reg.h"
+#include "soc/gpio_sig_map.h"
+#include "soc/io_mux_reg.h"
+#include "soc/rtc.h"
+#include <math.h>
+
+// The stub runs before the application is loaded: no drivers, no flash, only
+// ROM functions, RTC memory and registers. The pin is therefore fixed here.
+#define STUB_PIN 4
+#define STUB_PIN_MASK BIT(STUB_PIN)
+#define STUB_PIN_MUX PERIPHS_IO_MUX_GPIO4_U
+#define STUB_PIN_REG GPIO_PIN4_REG
+#define STUB_PIN_PAD_DRIVER GPIO_PIN4_PAD_DRIVER
+#define STUB_PIN_OUT_SEL_REG GPIO_FUNC4_OUT_SEL_CFG_REG
+#define STUB_CONVERSION_US 750000 // 12-bit conversion, spent asleep
+
+_Static_assert(GPIO_TEMP_SENSOR == STUB_PIN, "temp_wake_stub.c drives the DS18B20 on GPIO 4");
+
+typedef enum
+{
+	STUB_IDLE = 0, // Boot the application on the next wake
+	STUB_CONVERT,  // Start a conversion and sleep while it runs
+	STUB_READ,	   // Read the finished conversion
+} stub_phase_t;
+
+typedef struct
+{
+	uint8_t phase;
+	uint32_t wakes_left; // Readings still allowed before the application boots
+	uint32_t period_us;
+	int16_t lower_raw; // Thresholds in sensor units of 1/16 °C
+	int16_t upper_raw;
+	int64_t first_ms;
+	uint16_t count;
+	int16_t samples[CONFIG_TEMP_WAKE_STUB_SAMPLES];
+} stub_state_t;
+
+static RTC_DATA_ATTR stub_state_t s_stub;
+
+// Deep sleep resets the digital pad configuration, so the open-drain, pulled-up
+// line the driver sets up is rebuilt on every stub wake
+static void RTC_IRAM_ATTR stub_pin_setup(void)
+{
+	PIN_FUNC_SELECT(STUB_PIN_MUX, PIN_FUNC_GPIO);
+	PIN_INPUT_ENABLE(STUB_PIN_MUX);
+	PIN_PULLUP_EN(STUB_PIN_MUX);
+	REG_WRITE(STUB_PIN_OUT_SEL_REG, SIG_GPIO_OUT_IDX);
+	REG_SET_BIT(STUB_PIN_REG, STUB_PIN_PAD_DRIVER);
+	REG_WRITE(GPIO_OUT_W1TC_REG, STUB_PIN_MASK);
+	REG_WRITE(GPIO_ENABLE_W1TC_REG, STUB_PIN_MASK);
+}
+
+// Same bus timing as temp_sensor_driver.c; the output latch stays low, so
+// enabling the driver pulls the line down
+static void RTC_IRAM_ATTR stub_ow_drive_low(void)
+{
+	REG_WRITE(GPIO_ENABLE_W1TS_REG, STUB_PIN_MASK);
+}
+
+static void RTC_IRAM_ATTR stub_ow_release(void)
+{
+	REG_WRITE(GPIO_ENABLE_W1TC_REG, STUB_PIN_MASK);
+}
+
+static int RTC_IRAM_ATTR stub_ow_read_level(void)
+{
+	return (REG_READ(GPIO_IN_REG) >> STUB_PIN) & 0x01;
+}
+
+static bool RTC_IRAM_ATTR stub_ow_reset(void)
+{
+	stub_ow_drive_low();
+	esp_rom_delay_us(480);
+	stub_ow_release();
+	esp_rom_delay_us(70);
+	int presence = !stub_ow_read_level();
+	esp_rom_delay_us(410);
+	return presence;
+}
+
+static void RTC_IRAM_ATTR stub_ow_write_byte(uint8_t v)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		stub_ow_drive_low();
+		if ((v >> i) & 0x01)
+		{
+			esp_rom_delay_us(6);
+			stub_ow_release();
+			esp_rom_delay_us(64);
+		}
+		else
+		{
+			esp_rom_delay_us(60);
+			stub_ow_release();
+			esp_rom_delay_us(10);
+		}
+	}
+}
+
+static uint8_t RTC_IRAM_ATTR stub_ow_read_byte(void)
+{
+	uint8_t v = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		stub_ow_drive_low();
+		esp_rom_delay_us(6);
+		stub_ow_release();
+		esp_rom_delay_us(9);
+		if (stub_ow_read_level())
+			v |= (1 << i);
+		esp_rom_delay_us(55);
+	}
+	return v;
+}
+
+static void RTC_IRAM_ATTR stub_sleep(uint32_t duration_us)
+{
+	esp_wake_stub_set_wakeup_time(duration_us);
+	esp_wake_stub_sleep(&esp_wake_deep_sleep);
+}
+
+// Returning boots the application
+void RTC_IRAM_ATTR esp_wake_deep_sleep(void)
+{
+	esp_default_wake_deep_sleep();
+
+	// Button and other wakes always need the application
+	if (s_stub.phase == STUB_IDLE || !(esp_wake_stub_get_wakeup_cause() & RTC_TIMER_TRIG_EN))
+	{
+		s_stub.phase = STUB_IDLE;
+		return;
+	}
+
+	if (s_stub.phase == STUB_CONVERT)
+	{
+		if (s_stub.wakes_left == 0 || s_stub.count >= CONFIG_TEMP_WAKE_STUB_SAMPLES)
+		{
+			s_stub.phase = STUB_IDLE;
+			return;
+		}
+		stub_pin_setup();
+		if (!stub_ow_reset())
+		{
+			// The application reports the missing sensor
+			s_stub.phase = STUB_IDLE;
+			return;
+		}
+		stub_ow_write_byte(0xCC); // SKIP ROM
+		stub_ow_write_byte(0x44); // CONVERT T
+		s_stub.phase = STUB_READ;
+		stub_sleep(STUB_CONVERSION_US);
+		return;
+	}
+
+	stub_pin_setup();
+	if (!stub_ow_reset())
+	{
+		s_stub.phase = STUB_IDLE;
+		return;
+	}
+	stub_ow_write_byte(0xCC); // SKIP ROM
+	stub_ow_write_byte(0xBE); // READ SCRATCHPAD
+	uint8_t temp_l = stub_ow_read_byte();
+	uint8_t temp_h = stub_ow_read_byte();
+	// A reset ends the scratchpad read early
+	stub_ow_reset();
+
+	int16_t raw = (int16_t)((temp_h << 8) | temp_l);
+	s_stub.samples[s_stub.count++] = raw;
+	s_stub.wakes_left--;
+
+	if (raw < s_stub.lower_raw || raw > s_stub.upper_raw || s_stub.count >= CONFIG_TEMP_WAKE_STUB_SAMPLES)
+	{
+		s_stub.phase = STUB_IDLE;
+		return;
+	}
+	s_stub.phase = STUB_CONVERT;
+	stub_sleep(s_stub.period_us - STUB_CONVERSION_US);
+}
+
+// For integer readings `raw < ceil(16 * lower)` is `temp < lower` and
+// `raw > floor(16 * upper)` is `temp > upper`
+static int16_t threshold_to_raw(float celsius, bool round_up)
+{
+	float scaled = round_up ? ceilf(celsius * 16.0f) : floorf(celsius * 16.0f);
+	if (isnan(scaled))
+	{
+		return round_up ? INT16_MIN : INT16_MAX;
+	}
+	if (scaled <= INT16_MIN)
+	{
+		return INT16_MIN;
+	}
+	if (scaled >= INT16_MAX)
+	{
+		return INT16_MAX;
+	}
+	return (int16_t)scaled;
+}
+
+void temp_wake_stub_arm(uint32_t period_sec, uint32_t samples, int64_t first_ms, float lower, float upper)
+{
+	s_stub.phase = STUB_IDLE;
+	s_stub.count = 0;
+	// The conversion has to fit between two readings
+	if (samples == 0 || (uint64_t)period_sec * 1000000ULL <= STUB_CONVERSION_US ||
+		(uint64_t)period_sec * 1000000ULL > UINT32_MAX)
+	{
+		return;
+	}
+	s_stub.wakes_left = samples;
+	s_stub.period_us = period_sec * 1000000UL;
+	s_stub.first_ms = first_ms;
+	s_stub.lower_raw = threshold_to_raw(lower, true);
+	s_stub.upper_raw = threshold_to_raw(upper, false);
+	s_stub.phase = STUB_CONVERT;
+}
+
+size_t temp_wake_stub_count(void)
+{
+	return s_stub.count < CONFIG_TEMP_WAKE_STUB_SAMPLES ? s_stub.count : CONFIG_TEMP_WAKE_STUB_SAMPLES;
+}
+
+void temp_wake_stub_get(size_t index, temp_wake_sample_t *sample)
+{
+	sample->timestamp_ms = s_stub.first_ms + (int64_t)index * (s_stub.period_us / 1000);
+	sample->celsius = (float)s_stub.samples[index] * 0.0625f;
+}
+
+void temp_wake_stub_clear(void)
+{
+	s_stub.phase = STUB_IDLE;
+	s_stub.count = 0;
+}
+
+#endif // CONFIG_TEMP_WAKE_STUB
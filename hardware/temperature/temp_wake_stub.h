@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Deep sleep wake stub for the DS18B20 (CONFIG_TEMP_WAKE_STUB). While armed,
+// timer wakes read the sensor from RTC memory and go straight back to sleep;
+// the application only boots once a reading crosses a threshold, the sample
+// buffer is full, the allowed number of readings is used up or the wake was
+// not the timer.
+
+typedef struct
+{
+	int64_t timestamp_ms;
+	float celsius;
+} temp_wake_sample_t;
+
+// Arms the stub for the coming deep sleep: it takes up to `samples` readings
+// `period_sec` apart, the first one at `first_ms`, and boots the application
+// at the wake after the last. Samples not yet collected are dropped.
+void temp_wake_stub_arm(uint32_t period_sec, uint32_t samples, int64_t first_ms, float lower, float upper);
+// Readings the stub took since it was armed, oldest first
+size_t temp_wake_stub_count(void);
+void temp_wake_stub_get(size_t index, temp_wake_sample_t *sample);
+// Drops the readings and disarms the stub
+void temp_wake_stub_clear(void);
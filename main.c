@@ -13,6 +13,7 @@
 #include "event_manager.h"
 #include "utils/fs_utils.h"
 #include "utils/nvs_utils.h"
+#include "mqtt/mqtt_manager.h"
 
 static const char *TAG = "main";
 
@@ -62,5 +63,12 @@ void app_main(void)
         ESP_LOGE(TAG, "Failed to initialize filesystem: %s", esp_err_to_name(ret));
     }
 
+#ifdef CONFIG_FS_UTILS_MQTT_LOG_BENCHMARK
+    fs_utils_benchmark_mqtt_log();
+#endif
+#ifdef CONFIG_MQTT_SHADOW_WRITER_BENCHMARK
+    mqtt_manager_benchmark_shadow_update();
+#endif
+
     event_manager_init();
 }
@@ -249,7 +249,42 @@ class IoTApp:
     def on_message(self, client, userdata, msg):
         try:
             payload = msg.payload.decode()
-            topic = msg.topic
+            # Readings queued while offline arrive batched as a JSON array
+            for item in self.unpack_payload(payload):
+                self.handle_reading(msg.topic, item)
+        except Exception as e:
+            print(f"Error parsing message: {e}")
+
+    def unpack_payload(self, payload):
+        """Split a batched payload into individual readings"""
+        if not payload.lstrip().startswith('['):
+            return [payload]
+        try:
+            items = json.loads(payload)
+        except ValueError:
+            return [payload]
+        if not isinstance(items, list):
+            return [payload]
+        return [self.format_item(item) for item in items]
+
+    def format_item(self, item):
+        """Convert a JSON reading ({"value": ..., "timestamp": ms}) to the CSV payload format"""
+        if not isinstance(item, dict):
+            return str(item)
+        value = item.get("value")
+        timestamp = item.get("timestamp")
+        if timestamp is None:
+            return json.dumps(item)
+        timestamp = int(timestamp) // 1000
+        if item.get("event") == "summary":
+            # Compacted samples: report the mean at the middle of the covered span
+            timestamp += int(item.get("duration", 0)) // 2
+        if isinstance(value, bool):
+            return f"{timestamp},{'success' if value else 'failure'}"
+        return f"{value},{timestamp}"
+
+    def handle_reading(self, topic, payload):
+        try:
             # Topic format: user_id/mac/data/type
             parts = topic.split('/')
             
@@ -339,7 +374,7 @@ class IoTApp:
             logger.info(f"{timestamp_str} - MQTT Message - Topic: {topic}, Payload: {payload}")
                     
         except Exception as e:
-            print(f"Error parsing message: {e}")
+            print(f"Error parsing reading: {e}")
 
     def update_status(self, text):
         self.root.after(0, lambda: self.status_var.set(text))
@@ -2,23 +2,30 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "esp_system.h"
 #include "esp_mac.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_attr.h"
 #include "esp_crt_bundle.h"
 #include "mqtt_client.h"
 #include "esp_timer.h"
 #include "nvs.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "freertos/semphr.h"
 #include <math.h>
 
 #include "event_manager.h"
 #include "mqtt_manager.h"
 #include "utils/fs_utils.h"
 #include "utils/nvs_utils.h"
+#include "utils/json_writer.h"
 #include "cJSON.h"
+#include "shadow_parser.h"
 #include "ble/telemetry_service.h"
 
 #define AWS_IOT_ENDPOINT "aqbxwrwwgdb49-ats.iot.eu-north-1.amazonaws.com"
@@ -34,106 +41,340 @@ static char thing_name[64] = {0};
 static char shadow_get_topic[256] = {0};
 static char shadow_update_topic[256] = {0};
 
-// Dynamic buffer for chunked MQTT messages (allocated only when needed)
-static char *s_chunk_buffer = NULL;
-static size_t s_chunk_buffer_size = 0;
-static size_t s_chunk_buffer_len = 0;
-static size_t s_chunk_total_len = 0;  // Store total expected length
-static char s_chunk_topic[256] = {0}; // Store topic for chunked messages
+// Shadow documents are parsed as their chunks arrive; only the command fields
+// below are kept, so a document of any size is handled in constant memory
+typedef enum
+{
+    SHADOW_DOC_NONE = 0,
+    SHADOW_DOC_DELTA,
+    SHADOW_DOC_UPDATE_ACCEPTED,
+    SHADOW_DOC_GET_ACCEPTED,
+} shadow_doc_t;
+
+typedef enum
+{
+    SHADOW_SETTING_TEMP_FREQUENCY = 0,
+    SHADOW_SETTING_FEED_FREQUENCY,
+    SHADOW_SETTING_WAKE_FREQUENCY,
+    SHADOW_SETTING_TEMP_FORCE,
+    SHADOW_SETTING_FEED_FORCE,
+    SHADOW_SETTING_PH_FORCE,
+    SHADOW_SETTING_TEMP_LOWER,
+    SHADOW_SETTING_TEMP_UPPER,
+    SHADOW_SETTING_PH_LOWER,
+    SHADOW_SETTING_PH_UPPER,
+    SHADOW_SETTING_COUNT,
+} shadow_setting_t;
 
 typedef struct
 {
-    int msg_id;
-    char log_id[37];
-    time_t timestamp;
-} pending_message_t;
+    const char *name;
+    shadow_value_type_t type;
+} shadow_setting_desc_t;
+
+static const shadow_setting_desc_t s_shadow_settings[SHADOW_SETTING_COUNT] = {
+    [SHADOW_SETTING_TEMP_FREQUENCY] = {"temp_frequency", SHADOW_VALUE_NUMBER},
+    [SHADOW_SETTING_FEED_FREQUENCY] = {"feed_frequency", SHADOW_VALUE_NUMBER},
+    [SHADOW_SETTING_WAKE_FREQUENCY] = {"wake_frequency", SHADOW_VALUE_NUMBER},
+    [SHADOW_SETTING_TEMP_FORCE] = {"temp_force", SHADOW_VALUE_BOOL},
+    [SHADOW_SETTING_FEED_FORCE] = {"feed_force", SHADOW_VALUE_BOOL},
+    [SHADOW_SETTING_PH_FORCE] = {"ph_force", SHADOW_VALUE_BOOL},
+    [SHADOW_SETTING_TEMP_LOWER] = {"temp_lower", SHADOW_VALUE_NUMBER},
+    [SHADOW_SETTING_TEMP_UPPER] = {"temp_upper", SHADOW_VALUE_NUMBER},
+    [SHADOW_SETTING_PH_LOWER] = {"ph_lower", SHADOW_VALUE_NUMBER},
+    [SHADOW_SETTING_PH_UPPER] = {"ph_upper", SHADOW_VALUE_NUMBER},
+};
+
+#define MAX_SHADOW_COMMANDS 8
+
+// A shadow update with every setting, MAX_SHADOW_COMMANDS full-length command
+// names and every statistic at its widest is ~1350 bytes. Only command names
+// full of escaped characters could overflow this; such an update is dropped.
+#define SHADOW_UPDATE_MAX_BYTES 1536
+
+// Commands collected from one document; applied only once all of it has parsed
+typedef struct
+{
+    uint32_t present; // Bit per shadow_setting_t
+    double value[SHADOW_SETTING_COUNT];
+    char commands[MAX_SHADOW_COMMANDS][SHADOW_PARSER_NAME_MAX]; // Cleared in desired after applying
+    size_t command_count;
+} shadow_commands_t;
+
+// Subscribed topics and their handlers. Full topic strings are built once, and
+// an incoming topic is matched by its length and FNV-1a hash before the final
+// compare, so routing costs one pass over the topic.
+#define MAX_TOPIC_ROUTES 8
+#define TOPIC_MAX_LEN 128
 
-void mqtt_manager_enqueue_temperature(float temperature);
-void mqtt_manager_enqueue_ph(float ph);
-void mqtt_manager_enqueue_feed(bool success);
-void mqtt_manager_enqueue_log(const char *event, const char *value);
+typedef struct
+{
+    char topic[TOPIC_MAX_LEN];
+    uint16_t len;
+    uint8_t qos;
+    uint32_t hash;
+    mqtt_manager_topic_handler_t handler;
+} topic_route_t;
+
+static topic_route_t s_routes[MAX_TOPIC_ROUTES];
+static size_t s_route_count = 0;
+static const topic_route_t *s_rx_route = NULL; // Route of the message being received
+
+static shadow_parser_t s_shadow_parser;
+static shadow_commands_t s_shadow_commands;
+
+// Shadow state last applied, kept in NVS. A wake whose shadow version has not
+// moved, or whose desired commands hash to what was already applied, neither
+// calls the setters (each writes NVS and resets timers) nor reports back.
+#define MQTT_NVS_NAMESPACE "mqtt"
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
 
-static void add_timestamp_to_json(char *buffer, size_t buffer_size, const char *message)
+typedef struct
 {
-    // Print current system time when adding timestamp
-    time_t current_time = time(NULL);
-    struct tm timeinfo;
-    localtime_r(&current_time, &timeinfo);
-    char time_str[64];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &timeinfo);
-    ESP_LOGI(TAG, "Current system time when adding timestamp: %s (timestamp: %ld)", time_str, (long)current_time);
+    int64_t version; // Shadow version after our last update, -1 if unknown
+    uint32_t digest; // FNV-1a of the last applied settings, 0 if none
+} shadow_sync_t;
+
+static shadow_sync_t s_shadow_sync = {.version = -1};
+static bool s_shadow_sync_loaded = false;
+static bool s_shadow_update_pending = false; // Our update awaits its accepted echo
+static shadow_doc_t s_rx_doc = SHADOW_DOC_NONE;
+static size_t s_rx_total = 0;
+static size_t s_rx_remaining = 0;
+
+// Queued messages published but not yet acknowledged, in publish order.
+// Journal entries are only committed once every earlier entry is acknowledged.
+#define MAX_PENDING_MESSAGES 16
+#define MAX_UNMATCHED_ACKS 4
+#define PENDING_SLOT_WAIT_MS 5000
+
+// Consecutive queued messages for the same topic are published as one JSON array.
+// Each batch is a contiguous run of sequences, so one msg_id still commits a prefix.
+#define BATCH_MAX_BYTES CONFIG_MQTT_BATCH_MAX_BYTES
 
-    if (strstr(message, "\"timestamp\"") != NULL)
-    {
-        strncpy(buffer, message, buffer_size - 1);
-        buffer[buffer_size - 1] = '\0';
-        return;
-    }
+typedef struct
+{
+    int msg_id;
+    uint8_t log_class; // Journal the publish was drained from
+    uint32_t sequence; // Last sequence covered by this publish
+    time_t timestamp;
+    bool acked;
+} pending_message_t;
 
-    const char *last_brace = strrchr(message, '}');
-    if (last_brace == NULL)
-    {
-        strncpy(buffer, message, buffer_size - 1);
-        buffer[buffer_size - 1] = '\0';
-        return;
-    }
+static pending_message_t s_pending[MAX_PENDING_MESSAGES];
+static size_t s_pending_count = 0;
+// PUBACKs that arrived before the publishing task recorded their msg_id
+static int s_unmatched_acks[MAX_UNMATCHED_ACKS];
+static size_t s_unmatched_ack_count = 0;
+static SemaphoreHandle_t s_pending_mutex = NULL;
+
+static char s_batch_buffer[BATCH_MAX_BYTES > 0 ? BATCH_MAX_BYTES : 1];
+
+// Brokers are tried in order on every connect. An optional LAN broker
+// (CONFIG_MQTT_LOCAL_BROKER_URI, plain MQTT only) comes first: a local hub
+// answers within milliseconds and skips the TLS handshake altogether. It never
+// sees the AWS device credentials. AWS IoT is always the last resort. An endpoint whose connect
+// fails before CONNACK is skipped for an exponentially growing backoff, and
+// its health and connect times are kept in RTC memory across deep sleep.
+typedef enum
+{
+    BROKER_LOCAL = 0,
+    BROKER_CLOUD,
+    BROKER_COUNT,
+} broker_id_t;
 
-    size_t prefix_len = last_brace - message;
-    if (prefix_len >= buffer_size - 50)
-    {
-        strncpy(buffer, message, buffer_size - 1);
-        buffer[buffer_size - 1] = '\0';
-        return;
-    }
+static const char *const s_broker_names[BROKER_COUNT] = {"local", "cloud"};
 
-    memcpy(buffer, message, prefix_len);
-    buffer[prefix_len] = '\0';
+#define LOCAL_BROKER_URI CONFIG_MQTT_LOCAL_BROKER_URI
+#define LOCAL_BROKER_TIMEOUT_MS CONFIG_MQTT_LOCAL_BROKER_TIMEOUT_MS
+#define CLOUD_NETWORK_TIMEOUT_MS 10000 // esp-mqtt's default
+#define BROKER_BACKOFF_BASE_S 60
+#define BROKER_BACKOFF_MAX_S 3600
 
-    if (prefix_len > 1 && buffer[prefix_len - 1] != '{' && buffer[prefix_len - 1] != ',')
-    {
-        strcat(buffer, ",");
-    }
+typedef struct
+{
+    uint8_t failures; // Consecutive connects that failed before CONNACK
+    time_t retry_at;  // Skipped until this wall-clock time while failing
+    uint32_t connects;
+    uint32_t total_ms; // Start to CONNACK, summed
+} broker_health_t;
+
+// The AWS IoT endpoint's IPv4 address is cached in RTC memory, so a wake within
+// BROKER_ADDR_TTL_S of the last lookup connects without DNS. TLS still sends
+// SNI for, and verifies the certificate against, the endpoint name
+// (broker.verification.common_name), so the handshake is the same either way.
+// If a connection by address fails before its first CONNACK, the cache is
+// dropped and the client reconnects by hostname.
+#define BROKER_ADDR_TTL_S CONFIG_MQTT_BROKER_ADDR_CACHE_TTL
+#define BROKER_CACHE_MAGIC 0x42524B32
+
+typedef enum
+{
+    CONNECT_PATH_CACHED = 0, // Address from the RTC cache
+    CONNECT_PATH_RESOLVED,   // Looked up before connecting, then cached
+    CONNECT_PATH_HOSTNAME,   // Left to the client; cache disabled or lookup failed
+    CONNECT_PATH_COUNT,
+} connect_path_t;
 
-    char timestamp_str[32];
-    snprintf(timestamp_str, sizeof(timestamp_str), "\"timestamp\":%lld", (long long)current_time * 1000);
-    strcat(buffer, timestamp_str);
+static const char *const s_connect_path_names[CONNECT_PATH_COUNT] = {"cached", "resolved", "hostname"};
 
-    strcat(buffer, "}");
-}
+typedef struct
+{
+    uint32_t magic;
+    uint32_t addr;       // IPv4 in network byte order, 0 if none
+    time_t resolved_at;  // Wall-clock time of the lookup
+    uint32_t connects[CONNECT_PATH_COUNT]; // AWS IoT connects by path
+    uint32_t total_ms[CONNECT_PATH_COUNT]; // Start to CONNACK, summed per path
+    uint32_t last_ms;
+    uint8_t last_path;
+    uint8_t last_broker;
+    broker_health_t health[BROKER_COUNT];
+} broker_cache_t;
+
+static RTC_DATA_ATTR broker_cache_t s_broker;
+static char s_broker_uri[128];
+static esp_mqtt_client_config_t s_cloud_cfg; // Provisioned TLS config for AWS IoT
+static bool s_local_usable = false;          // LAN broker URI set and plain MQTT
+static bool s_local_cfg_active = false;
+static bool s_provisioned = false;
+static broker_id_t s_broker_id = BROKER_CLOUD;
+static connect_path_t s_connect_path = CONNECT_PATH_HOSTNAME;
+static bool s_connect_pending = false;
+static bool s_attempt_failed = false; // Error and disconnect both report one failed attempt
+static int64_t s_connect_start_us = 0;
+static uint32_t s_resolve_ms = 0;
+
+// With a persistent session the broker keeps the shadow subscriptions between
+// wakes, so a reconnect that finds its session only has to request the shadow.
+// On a fresh session the request goes out as soon as the broker acknowledges
+// the subscription that carries its answer.
+#ifdef CONFIG_MQTT_PERSISTENT_SESSION
+#define PERSISTENT_SESSION true
+#else
+#define PERSISTENT_SESSION false
+#endif
+
+static int s_last_sub_msg_id = -1; // SUBACK that triggers the shadow get
+
+// Connection idleness, for ending the post-publish linger early: the shadow get
+// has been answered and no delta arrived within LINGER_DELTA_MS
+#define LINGER_DELTA_MS CONFIG_MQTT_LINGER_DELTA_MS
+
+static volatile bool s_shadow_synced = false;
+static volatile int64_t s_last_delta_us = 0;
+
+// Readings taken while offline are staged in RTC slow memory, which survives deep
+// sleep, and reach the flash journal in bulk once the ring is nearly full or a
+// publish session starts. Alerts and feed results skip staging and go straight
+// to the flash alert journal.
+#define STAGING_CAPACITY CONFIG_MQTT_RTC_STAGING_SIZE
+#define STAGING_SLOTS (STAGING_CAPACITY > 0 ? STAGING_CAPACITY : 1)
+#define STAGING_FLUSH_AT (STAGING_CAPACITY - STAGING_CAPACITY / 4)
+#define STAGING_MAGIC 0x53544733
 
-static void build_topics(void)
+typedef struct
 {
-    if (client_id[0] == '\0')
-    {
-        ESP_LOGE(TAG, "Cannot build topics: client_id not set");
-        return;
-    }
+    uint32_t magic;
+    uint16_t head;
+    uint16_t count;
+    uint32_t dropped; // Readings lost because the ring was full
+    fs_utils_mqtt_log_entry_t records[STAGING_SLOTS];
+} staging_ring_t;
+
+static RTC_DATA_ATTR staging_ring_t s_staging;
+static SemaphoreHandle_t s_staging_mutex = NULL;
+
+// Queued records are kept in binary form and only serialized when published.
+// Payloads: JSON with event, value, and timestamp - max ~112 chars; summaries of
+// compacted samples also carry min, max, count and duration - max ~150 chars
+#define RECORD_JSON_SIZE 160
+
+// Delivery policy for each fs_utils_record_type_t. Routine samples can stream
+// at QoS 0: they are committed from the journal as soon as they are handed to
+// the client, with no PUBACK round-trip or outbox copy. Alerts and feed results
+// keep at-least-once delivery.
+typedef struct
+{
+    const char *suffix; // Topic below the client id
+    uint8_t qos;
+    bool retain;
+    bool persist; // Queued while offline; otherwise dropped when not connected
+} topic_policy_t;
 
-    strncpy(thing_name, client_id, sizeof(thing_name) - 1);
-    thing_name[sizeof(thing_name) - 1] = '\0';
+static const topic_policy_t s_topic_policy[FS_UTILS_RECORD_TYPE_COUNT] = {
+    [FS_UTILS_RECORD_TEMP] = {"temp", CONFIG_MQTT_ROUTINE_QOS, false, true},
+    [FS_UTILS_RECORD_PH] = {"ph", CONFIG_MQTT_ROUTINE_QOS, false, true},
+    [FS_UTILS_RECORD_FEED] = {"feed", 1, false, true},
+    [FS_UTILS_RECORD_LOG] = {"log", 1, false, true},
+};
 
-    snprintf(shadow_get_topic, sizeof(shadow_get_topic),
-             "$aws/things/%s/shadow/get", thing_name);
-    snprintf(shadow_update_topic, sizeof(shadow_update_topic),
-             "$aws/things/%s/shadow/update", thing_name);
+#define SHADOW_QOS 1
 
-    ESP_LOGI(TAG, "Topics built: thing_name=%s", thing_name);
-}
+void mqtt_manager_enqueue_temperature(float temperature);
+void mqtt_manager_enqueue_ph(float ph);
+void mqtt_manager_enqueue_feed(bool success);
+void mqtt_manager_enqueue_log(const char *event, const char *value);
 
-static void build_shadow_topic(char *buf, size_t buf_size, const char *base_topic, const char *suffix)
+// Serializes a queued record to its JSON wire format
+static void format_record(char *buffer, size_t buffer_size, const fs_utils_mqtt_log_entry_t *record)
 {
-    if (suffix != NULL && suffix[0] != '\0')
+    json_writer_t writer;
+    json_writer_init(&writer, buffer, buffer_size);
+    json_writer_begin_object(&writer, NULL);
+
+    switch (record->type)
     {
-        snprintf(buf, buf_size, "%s/%s", base_topic, suffix);
+    case FS_UTILS_RECORD_TEMP:
+    case FS_UTILS_RECORD_PH:
+        if (record->flags & FS_UTILS_RECORD_FLAG_SUMMARY)
+        {
+            json_writer_string(&writer, "event", "summary");
+            json_writer_number(&writer, "value", record->value, JSON_WRITER_FLOAT_DIGITS);
+            json_writer_number(&writer, "min", record->min, JSON_WRITER_FLOAT_DIGITS);
+            json_writer_number(&writer, "max", record->max, JSON_WRITER_FLOAT_DIGITS);
+            json_writer_int(&writer, "count", record->code);
+            json_writer_int(&writer, "duration", record->span_s);
+        }
+        else
+        {
+            json_writer_string(&writer, "event", "measurement");
+            json_writer_number(&writer, "value", record->value, JSON_WRITER_FLOAT_DIGITS);
+        }
+        break;
+    case FS_UTILS_RECORD_FEED:
+        json_writer_string(&writer, "event", "action");
+        json_writer_bool(&writer, "value", record->flags & FS_UTILS_RECORD_FLAG_SUCCESS);
+        break;
+    case FS_UTILS_RECORD_LOG:
+        json_writer_string(&writer, "event", fs_utils_log_event_name(record));
+        if (record->flags & FS_UTILS_RECORD_FLAG_HAS_VALUE)
+        {
+            char value[16];
+            snprintf(value, sizeof(value), "%.2f", record->value);
+            json_writer_string(&writer, "value", value);
+        }
+        else
+        {
+            json_writer_string(&writer, "value", fs_utils_log_value_name(record));
+        }
+        break;
+    default:
+        json_writer_end_object(&writer);
+        json_writer_finish(&writer);
+        return;
     }
-    else
+
+    json_writer_int(&writer, "timestamp", record->timestamp_ms);
+    json_writer_end_object(&writer);
+    if (json_writer_finish(&writer) < 0)
     {
-        strncpy(buf, base_topic, buf_size - 1);
-        buf[buf_size - 1] = '\0';
+        ESP_LOGE(TAG, "Record does not fit in %zu bytes", buffer_size);
+        snprintf(buffer, buffer_size, "{}");
     }
 }
 
-static void publish(const char *topic, const char *message)
+static int publish(const char *topic, const char *message, int qos, bool retain)
 {
     static char target_topic[256];
     const char *final_message;
@@ -157,7 +398,7 @@ static void publish(const char *topic, const char *message)
     if (!is_connected)
     {
         ESP_LOGI(TAG, "Not connected, cannot publish");
-        return;
+        return -1;
     }
 
     // Print current system time before publish (skip message content for shadow topics)
@@ -177,7 +418,7 @@ static void publish(const char *topic, const char *message)
         ESP_LOGI(TAG, "Publishing message - Topic: %s, Message: %s", target_topic, final_message);
     }
 
-    int msg_id = esp_mqtt_client_publish(g_client, target_topic, final_message, 0, 1, 0);
+    int msg_id = esp_mqtt_client_publish(g_client, target_topic, final_message, 0, qos, retain);
     if (msg_id < 0)
     {
         ESP_LOGE(TAG, "Failed to publish message");
@@ -186,521 +427,1495 @@ static void publish(const char *topic, const char *message)
     {
         ESP_LOGI(TAG, "Published message to topic %s", target_topic);
     }
+    return msg_id;
 }
 
-static void publish_queued(void)
+static void pending_reset(void)
 {
-    char *topics = NULL;
-    int *qos = NULL;
-    char *payloads = NULL;
-    time_t *timestamps = NULL;
-    char **log_ids = NULL;
-    size_t count = 0;
+    if (s_pending_mutex == NULL || xSemaphoreTake(s_pending_mutex, portMAX_DELAY) != pdTRUE)
+    {
+        return;
+    }
+    if (s_pending_count > 0)
+    {
+        ESP_LOGW(TAG, "Dropping %zu unacknowledged messages, they stay queued for the next connection", s_pending_count);
+    }
+    s_pending_count = 0;
+    s_unmatched_ack_count = 0;
+    xSemaphoreGive(s_pending_mutex);
+}
 
-    // Small delay to ensure filesystem has synced any recent writes
-    vTaskDelay(pdMS_TO_TICKS(100));
+static size_t pending_get_count(void)
+{
+    size_t count = 0;
+    if (s_pending_mutex != NULL && xSemaphoreTake(s_pending_mutex, portMAX_DELAY) == pdTRUE)
+    {
+        count = s_pending_count;
+        xSemaphoreGive(s_pending_mutex);
+    }
+    return count;
+}
 
-    // Check available heap memory before loading messages
-    size_t free_heap = esp_get_free_heap_size();
-    size_t min_free_heap = esp_get_minimum_free_heap_size();
-    ESP_LOGI(TAG, "Free heap before loading messages: %zu bytes, minimum ever: %zu bytes", free_heap, min_free_heap);
+// Pops acknowledged messages off the front of the pending list and records, per
+// class, the sequence its journal can be committed up to (0 if nothing moved).
+// Caller must hold s_pending_mutex.
+static void pending_pop_acked(uint32_t commit_until[FS_UTILS_MQTT_LOG_CLASS_COUNT])
+{
+    memset(commit_until, 0, FS_UTILS_MQTT_LOG_CLASS_COUNT * sizeof(commit_until[0]));
 
-    // Get message count to estimate memory needs
-    size_t message_count = fs_utils_get_mqtt_log_count();
-    if (message_count > 0)
+    size_t popped = 0;
+    while (popped < s_pending_count && s_pending[popped].acked)
     {
-        ESP_LOGI(TAG, "Found %zu queued messages", message_count);
+        commit_until[s_pending[popped].log_class] = s_pending[popped].sequence + 1;
+        popped++;
     }
 
-    esp_err_t err = fs_utils_load_mqtt_logs(&topics, &qos, &payloads, &timestamps, &log_ids, &count);
+    memmove(s_pending, s_pending + popped, (s_pending_count - popped) * sizeof(s_pending[0]));
+    s_pending_count -= popped;
+}
 
-    if (err != ESP_OK || count == 0)
+static void pending_commit(const uint32_t commit_until[FS_UTILS_MQTT_LOG_CLASS_COUNT])
+{
+    for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
     {
-        if (err != ESP_OK)
+        if (commit_until[log_class] != 0)
         {
-            ESP_LOGW(TAG, "Failed to load queued messages from filesystem: %s", esp_err_to_name(err));
-            if (err == ESP_ERR_NO_MEM)
-            {
-                size_t current_free_heap = (size_t)esp_get_free_heap_size();
-                ESP_LOGE(TAG, "Out of memory - free heap: %zu bytes. Messages will remain in filesystem for next attempt.", current_free_heap);
-            }
+            fs_utils_mqtt_log_commit_until(log_class, commit_until[log_class]);
         }
-        else
+    }
+}
+
+static void pending_add(int msg_id, fs_utils_mqtt_log_class_t log_class, uint32_t sequence, bool acked)
+{
+    if (s_pending_mutex == NULL || xSemaphoreTake(s_pending_mutex, portMAX_DELAY) != pdTRUE)
+    {
+        return;
+    }
+
+    if (s_pending_count == MAX_PENDING_MESSAGES)
+    {
+        // Left uncommitted, so it is simply resent on the next connection
+        xSemaphoreGive(s_pending_mutex);
+        return;
+    }
+
+    pending_message_t *pending = &s_pending[s_pending_count++];
+    pending->msg_id = msg_id;
+    pending->log_class = log_class;
+    pending->sequence = sequence;
+    pending->timestamp = time(NULL);
+    pending->acked = acked;
+
+    for (size_t i = 0; !acked && i < s_unmatched_ack_count; i++)
+    {
+        if (s_unmatched_acks[i] == msg_id)
         {
-            ESP_LOGI(TAG, "No queued messages to publish from filesystem");
+            pending->acked = true;
+            s_unmatched_acks[i] = s_unmatched_acks[--s_unmatched_ack_count];
+            break;
         }
+    }
+
+    uint32_t commit_until[FS_UTILS_MQTT_LOG_CLASS_COUNT];
+    pending_pop_acked(commit_until);
+    xSemaphoreGive(s_pending_mutex);
+
+    pending_commit(commit_until);
+}
+
+static void pending_ack(int msg_id)
+{
+    if (s_pending_mutex == NULL || xSemaphoreTake(s_pending_mutex, portMAX_DELAY) != pdTRUE)
+    {
         return;
     }
 
-    ESP_LOGI(TAG, "Publishing %zu queued messages from filesystem", count);
+    bool found = false;
+    for (size_t i = 0; i < s_pending_count; i++)
+    {
+        if (s_pending[i].msg_id == msg_id && !s_pending[i].acked)
+        {
+            s_pending[i].acked = true;
+            found = true;
+            break;
+        }
+    }
 
-    for (size_t i = 0; i < count; i++)
+    // Not a queued message yet: either a direct publish, or a PUBACK that beat
+    // pending_add. Remember a few in case it is the latter.
+    if (!found)
     {
-        // Print current system time before each publish
-        time_t current_time = time(NULL);
-        struct tm timeinfo;
-        localtime_r(&current_time, &timeinfo);
-        char time_str[64];
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &timeinfo);
-        ESP_LOGI(TAG, "Current system time before publish: %s (timestamp: %ld)", time_str, (long)current_time);
+        if (s_unmatched_ack_count == MAX_UNMATCHED_ACKS)
+        {
+            memmove(s_unmatched_acks, s_unmatched_acks + 1, (MAX_UNMATCHED_ACKS - 1) * sizeof(s_unmatched_acks[0]));
+            s_unmatched_ack_count--;
+        }
+        s_unmatched_acks[s_unmatched_ack_count++] = msg_id;
+    }
 
-        char *full_topic = topics + i * FS_UTILS_TOPIC_SIZE;
-        char *topic_suffix = strchr(full_topic, '/');
-        if (topic_suffix == NULL)
+    uint32_t commit_until[FS_UTILS_MQTT_LOG_CLASS_COUNT];
+    pending_pop_acked(commit_until);
+    xSemaphoreGive(s_pending_mutex);
+
+    pending_commit(commit_until);
+}
+
+// Waits until the pending list has room for another message
+static bool pending_wait_for_slot(void)
+{
+    for (int waited_ms = 0; waited_ms < PENDING_SLOT_WAIT_MS; waited_ms += 50)
+    {
+        EventBits_t bits = event_manager_get_bits();
+        if (!(bits & EVENT_BIT_MQTT_STATUS))
         {
-            ESP_LOGW(TAG, "Topic has no '/', using as-is: %s", full_topic);
-            topic_suffix = full_topic;
+            return false;
         }
-        else
+        if (pending_get_count() < MAX_PENDING_MESSAGES)
         {
-            topic_suffix++;
+            return true;
         }
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+    return false;
+}
 
-        // Use the publish function
-        publish(topic_suffix, payloads + i * FS_UTILS_PAYLOAD_SIZE);
+// Reads the next queued record, skipping any with an unknown type. Skipped
+// records are committed along with the next acknowledged batch.
+static bool queued_next(fs_utils_mqtt_log_cursor_t *cursor, fs_utils_mqtt_log_entry_t *entry)
+{
+    while (fs_utils_mqtt_log_next(cursor, entry) == ESP_OK)
+    {
+        if (entry->type < FS_UTILS_RECORD_TYPE_COUNT)
+        {
+            return true;
+        }
+        ESP_LOGW(TAG, "Skipping queued record seq=%lu with unknown type %u", (unsigned long)entry->sequence, entry->type);
     }
+    return false;
+}
 
-    // Clear the entire log file after publishing all queued messages
-    fs_utils_clear_mqtt_logs();
-    ESP_LOGI(TAG, "Cleared all queued messages from log after publishing");
+// Appends a payload to the batch as the next array element. Returns false if it
+// would not fit, leaving the batch untouched.
+static bool batch_append(size_t *len, const char *payload)
+{
+    size_t payload_len = strlen(payload);
+    // Separator (or opening bracket), payload, closing bracket and terminator
+    if (*len + 1 + payload_len + 2 > sizeof(s_batch_buffer))
+    {
+        return false;
+    }
 
-    // log_ids no longer allocated (ID removed from logs)
-    if (topics != NULL)
-        free(topics);
-    if (qos != NULL)
-        free(qos);
-    if (payloads != NULL)
-        free(payloads);
-    if (timestamps != NULL)
-        free(timestamps);
+    s_batch_buffer[*len] = (*len == 0) ? '[' : ',';
+    memcpy(s_batch_buffer + *len + 1, payload, payload_len);
+    *len += 1 + payload_len;
+    s_batch_buffer[*len] = '\0';
+    return true;
 }
 
-static void publish_shadow_update(cJSON *commands)
+// Drains one priority class of the offline queue. Returns false if publishing
+// stopped early, in which case lower classes should wait for the next connection.
+static bool publish_queued_class(fs_utils_mqtt_log_class_t log_class)
 {
-    if (shadow_update_topic[0] == '\0' || g_client == NULL)
+    const char *class_name = log_class == FS_UTILS_MQTT_LOG_ALERT ? "alert" : "routine";
+
+    fs_utils_mqtt_log_cursor_t cursor;
+    esp_err_t err = fs_utils_mqtt_log_open(&cursor, log_class);
+    if (err == ESP_ERR_NOT_FOUND)
     {
-        ESP_LOGW(TAG, "Cannot publish shadow update: shadow_update_topic not built or client not set");
-        return;
+        ESP_LOGI(TAG, "No queued %s messages to publish from filesystem", class_name);
+        return true;
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to open queued %s messages: %s", class_name, esp_err_to_name(err));
+        return false;
     }
 
-    // Create shadow update JSON
-    cJSON *update_json = cJSON_CreateObject();
-    cJSON *state_obj = cJSON_CreateObject();
-    cJSON *reported_obj = cJSON_CreateObject();
-    cJSON *desired_obj = cJSON_CreateObject();
-    cJSON *desired_commands_obj = cJSON_CreateObject();
-
-    // Iterate through each command in commands
-    cJSON *command_item = commands->child;
-    while (command_item != NULL)
+    ESP_LOGI(TAG, "Publishing %lu queued %s messages from filesystem (free heap: %lu bytes)",
+             (unsigned long)cursor.remaining, class_name, (unsigned long)esp_get_free_heap_size());
+
+    // Records are read one at a time, serialized and packed into s_batch_buffer,
+    // plus one record of lookahead. Batches are committed from the
+    // MQTT_EVENT_PUBLISHED handler; anything unacknowledged is resent next time.
+    fs_utils_mqtt_log_entry_t entry;
+    char message[RECORD_JSON_SIZE];
+    size_t published = 0;
+    size_t batches = 0;
+    bool completed = true;
+    bool have_entry = queued_next(&cursor, &entry);
+    while (have_entry)
     {
-        if (cJSON_IsObject(command_item))
+        if (!pending_wait_for_slot())
+        {
+            ESP_LOGW(TAG, "Broker stopped acknowledging, leaving the rest queued");
+            completed = false;
+            break;
+        }
+
+        uint8_t type = entry.type;
+        uint32_t last_sequence = entry.sequence;
+        size_t count = 1;
+        size_t len = 0;
+        format_record(message, sizeof(message), &entry);
+
+        // Batching disabled or a record larger than the budget goes out on its own
+        const char *payload = message;
+        if (batch_append(&len, message))
         {
-            // Extract values from command and add to reported
-            cJSON *field = command_item->child;
-            while (field != NULL)
+            while ((have_entry = queued_next(&cursor, &entry)))
             {
-                if (cJSON_IsString(field))
-                {
-                    cJSON_AddStringToObject(reported_obj, field->string, field->valuestring);
-                }
-                else if (cJSON_IsNumber(field))
-                {
-                    cJSON_AddNumberToObject(reported_obj, field->string, field->valuedouble);
-                }
-                else if (cJSON_IsBool(field))
+                if (entry.type != type)
                 {
-                    cJSON_AddBoolToObject(reported_obj, field->string, cJSON_IsTrue(field));
+                    break;
                 }
-                else if (cJSON_IsNull(field))
+                format_record(message, sizeof(message), &entry);
+                if (!batch_append(&len, message))
                 {
-                    cJSON_AddNullToObject(reported_obj, field->string);
+                    break;
                 }
-
-                field = field->next;
+                last_sequence = entry.sequence;
+                count++;
             }
 
-            // Set the command key to null in desired.commands
-            cJSON_AddNullToObject(desired_commands_obj, command_item->string);
+            if (count > 1)
+            {
+                s_batch_buffer[len++] = ']';
+                s_batch_buffer[len] = '\0';
+                payload = s_batch_buffer;
+            }
+            else
+            {
+                // A lone record goes out in its original, unwrapped form
+                payload = s_batch_buffer + 1;
+            }
+        }
+        else
+        {
+            have_entry = queued_next(&cursor, &entry);
         }
 
-        command_item = command_item->next;
+        const topic_policy_t *policy = &s_topic_policy[type];
+        int msg_id = publish(policy->suffix, payload, policy->qos, policy->retain);
+        if (msg_id < 0)
+        {
+            ESP_LOGW(TAG, "Failed to publish queued message seq=%lu, leaving the rest queued", (unsigned long)last_sequence);
+            completed = false;
+            break;
+        }
+        // QoS 0 gets no PUBACK; it is committed once everything ahead of it is
+        pending_add(msg_id, log_class, last_sequence, policy->qos == 0);
+        published += count;
+        batches++;
     }
 
-    // Add commands to desired
-    cJSON_AddItemToObject(desired_obj, "commands", desired_commands_obj);
-    cJSON_AddItemToObject(state_obj, "reported", reported_obj);
-    cJSON_AddItemToObject(state_obj, "desired", desired_obj);
-    cJSON_AddItemToObject(update_json, "state", state_obj);
+    fs_utils_mqtt_log_close(&cursor);
+    ESP_LOGI(TAG, "Published %zu queued %s messages in %zu publishes, %zu awaiting acknowledgement",
+             published, class_name, batches, pending_get_count());
+    return completed;
+}
 
-    // Convert to string
-    char *json_string = cJSON_Print(update_json);
-    if (json_string == NULL)
+// Alerts and feed results go out first, so their latency after an outage does
+// not depend on how many routine samples piled up behind them
+static void publish_queued(void)
+{
+    // Small delay to ensure filesystem has synced any recent writes
+    vTaskDelay(pdMS_TO_TICKS(100));
+
+    for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
     {
-        ESP_LOGE(TAG, "Failed to create shadow update JSON string");
-        cJSON_Delete(update_json);
-        return;
+        if (!publish_queued_class(log_class))
+        {
+            break;
+        }
     }
-
-    publish(shadow_update_topic, json_string);
-    free(json_string);
-    cJSON_Delete(update_json);
 }
 
-static void process_shadow_delta(const char *json_data, int len)
+static void broker_cache_init(void)
 {
-    if (len <= 0)
+    if (s_broker.magic != BROKER_CACHE_MAGIC)
     {
-        return;
+        memset(&s_broker, 0, sizeof(s_broker));
+        s_broker.magic = BROKER_CACHE_MAGIC;
+        s_broker.last_broker = BROKER_CLOUD;
     }
 
-    ESP_LOGI(TAG, "Processing shadow delta (length: %d)", len);
-
-    cJSON *json = cJSON_ParseWithLength(json_data, len);
-    if (json == NULL)
+    // The AWS credentials and root CA are not meant for the hub, and there is
+    // nothing else to do TLS with
+    s_local_usable = strncmp(LOCAL_BROKER_URI, "mqtt://", 7) == 0;
+    if (LOCAL_BROKER_URI[0] != '\0' && !s_local_usable)
     {
-        ESP_LOGW(TAG, "Failed to parse shadow delta JSON");
-        return;
+        ESP_LOGW(TAG, "LAN broker %s ignored: only mqtt:// is supported", LOCAL_BROKER_URI);
     }
+}
 
-    cJSON *state = cJSON_GetObjectItem(json, "state");
-    if (state == NULL)
+static bool broker_configured(broker_id_t id)
+{
+    if (id == BROKER_LOCAL)
     {
-        ESP_LOGW(TAG, "No 'state' object in shadow delta");
-        cJSON_Delete(json);
-        return;
+        return s_provisioned && s_local_usable;
     }
+    return true;
+}
 
-    // Check for commands structure: state.commands
-    cJSON *commands = cJSON_GetObjectItem(state, "commands");
-    if (commands == NULL || !cJSON_IsObject(commands))
+// First configured endpoint from `from` on that is not backing off. The cloud
+// is used regardless once nothing else is left.
+static broker_id_t broker_pick(int from)
+{
+    time_t now = time(NULL);
+    for (int id = from; id < BROKER_CLOUD; id++)
     {
-        ESP_LOGW(TAG, "No 'commands' object in shadow delta state");
-        cJSON_Delete(json);
-        return;
+        const broker_health_t *health = &s_broker.health[id];
+        // A clock that stepped backwards (e.g. first SNTP sync) also ends the backoff
+        bool backing_off = health->failures > 0 && now < health->retry_at &&
+                           health->retry_at - now <= BROKER_BACKOFF_MAX_S;
+        if (broker_configured(id) && !backing_off)
+        {
+            return id;
+        }
     }
+    return BROKER_CLOUD;
+}
 
-    bool state_updated = false;
+// Only AWS IoT serves the device shadow; elsewhere there is no get to wait for
+static bool broker_has_shadow(void)
+{
+    return s_broker_id == BROKER_CLOUD && shadow_get_topic[0] != '\0';
+}
+
+static esp_err_t broker_resolve(void)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *result = NULL;
 
-    // Iterate through each command in commands
-    cJSON *command_item = commands->child;
-    while (command_item != NULL)
+    int64_t start_us = esp_timer_get_time();
+    int err = getaddrinfo(AWS_IOT_ENDPOINT, NULL, &hints, &result);
+    s_resolve_ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+    if (err != 0 || result == NULL)
     {
-        if (cJSON_IsObject(command_item))
-        {
-            // Process each field in the command
-            cJSON *field = command_item->child;
-            while (field != NULL)
-            {
-                // Parse temp_frequency
-                if (strcmp(field->string, "temp_frequency") == 0 && cJSON_IsNumber(field))
-                {
-                    int value = field->valueint;
-                    if (value >= 0)
-                    {
-                        temp_frequency = value;
-                        event_manager_set_temp_reading_interval(value);
-                        ESP_LOGI(TAG, "Shadow delta: temp_frequency = %d", value);
-                        state_updated = true;
-                    }
-                    else
-                    {
-                        ESP_LOGW(TAG, "Invalid temperature interval: %d (must be >= 0)", value);
-                    }
-                }
-                // Parse feed_frequency
-                else if (strcmp(field->string, "feed_frequency") == 0 && cJSON_IsNumber(field))
-                {
-                    int value = field->valueint;
-                    if (value >= 0)
-                    {
-                        feed_frequency = value;
-                        event_manager_set_feeding_interval(value);
-                        ESP_LOGI(TAG, "Shadow delta: feed_frequency = %d", value);
-                        state_updated = true;
-                    }
-                    else
-                    {
-                        ESP_LOGW(TAG, "Invalid feeding interval: %d (must be >= 0)", value);
-                    }
-                }
-                // Parse wake_frequency
-                else if (strcmp(field->string, "wake_frequency") == 0 && cJSON_IsNumber(field))
-                {
-                    int value = field->valueint;
-                    if (value >= 0)
-                    {
-                        wake_frequency = value;
-                        event_manager_set_publish_interval(value);
-                        ESP_LOGI(TAG, "Shadow delta: wake_frequency = %d", value);
-                        state_updated = true;
-                    }
-                    else
-                    {
-                        ESP_LOGW(TAG, "Invalid wake interval: %d (must be >= 0)", value);
-                    }
-                }
+        ESP_LOGW(TAG, "Failed to resolve %s (%d)", AWS_IOT_ENDPOINT, err);
+        return ESP_FAIL;
+    }
 
-                else if (strcmp(field->string, "temp_force") == 0 && cJSON_IsTrue(field))
-                {
-                    event_manager_set_bits(EVENT_BIT_TEMP_SCHEDULED);
-                    ESP_LOGI(TAG, "Shadow delta: temp_force = true");
-                    state_updated = true;
-                }
-                else if (strcmp(field->string, "feed_force") == 0 && cJSON_IsTrue(field))
-                {
-                    event_manager_set_bits(EVENT_BIT_FEED_SCHEDULED);
-                    ESP_LOGI(TAG, "Shadow delta: feed_force = true");
-                    state_updated = true;
-                }
-                else if (strcmp(field->string, "ph_force") == 0 && cJSON_IsTrue(field))
-                {
-                    event_manager_set_bits(EVENT_BIT_PH_SCHEDULED);
-                    ESP_LOGI(TAG, "Shadow delta: ph_force = true");
-                    state_updated = true;
-                }
-                else if (strcmp(field->string, "temp_lower") == 0 && cJSON_IsNumber(field))
-                {
-                    event_manager_set_temp_lower((float)field->valuedouble);
-                    ESP_LOGI(TAG, "Shadow delta: temp_lower = %.2f", (float)field->valuedouble);
-                    state_updated = true;
-                }
-                else if (strcmp(field->string, "temp_upper") == 0 && cJSON_IsNumber(field))
-                {
-                    event_manager_set_temp_upper((float)field->valuedouble);
-                    ESP_LOGI(TAG, "Shadow delta: temp_upper = %.2f", (float)field->valuedouble);
-                    state_updated = true;
-                }
-                else if (strcmp(field->string, "ph_lower") == 0 && cJSON_IsNumber(field))
-                {
-                    event_manager_set_ph_lower((float)field->valuedouble);
-                    ESP_LOGI(TAG, "Shadow delta: ph_lower = %.2f", (float)field->valuedouble);
-                    state_updated = true;
-                }
-                else if (strcmp(field->string, "ph_upper") == 0 && cJSON_IsNumber(field))
-                {
-                    event_manager_set_ph_upper((float)field->valuedouble);
-                    ESP_LOGI(TAG, "Shadow delta: ph_upper = %.2f", (float)field->valuedouble);
-                    state_updated = true;
-                }
+    s_broker.addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr.s_addr;
+    s_broker.resolved_at = time(NULL);
+    freeaddrinfo(result);
+    return ESP_OK;
+}
 
-                field = field->next;
-            }
+static void broker_use_local(void)
+{
+    esp_mqtt_client_config_t cfg = s_cloud_cfg;
+    cfg.broker.address.uri = LOCAL_BROKER_URI;
+    // The device certificate, key and AWS root CA stay with AWS IoT
+    memset(&cfg.credentials.authentication, 0, sizeof(cfg.credentials.authentication));
+    memset(&cfg.broker.verification, 0, sizeof(cfg.broker.verification));
+    cfg.network.timeout_ms = LOCAL_BROKER_TIMEOUT_MS;
+    esp_mqtt_set_config(g_client, &cfg);
+    s_local_cfg_active = true;
+    snprintf(s_broker_uri, sizeof(s_broker_uri), "%s", LOCAL_BROKER_URI);
+}
+
+// Picks the AWS IoT address for this connection and points the client at it
+static void broker_use_cloud(void)
+{
+    if (s_local_cfg_active)
+    {
+        esp_mqtt_set_config(g_client, &s_cloud_cfg);
+        s_local_cfg_active = false;
+    }
+
+    time_t now = time(NULL);
+    s_connect_path = CONNECT_PATH_HOSTNAME;
+    if (s_provisioned && BROKER_ADDR_TTL_S > 0)
+    {
+        // A clock that stepped backwards (e.g. first SNTP sync) also expires it
+        if (s_broker.addr != 0 && now >= s_broker.resolved_at && now - s_broker.resolved_at < BROKER_ADDR_TTL_S)
+        {
+            s_connect_path = CONNECT_PATH_CACHED;
+        }
+        else if (broker_resolve() == ESP_OK)
+        {
+            s_connect_path = CONNECT_PATH_RESOLVED;
         }
+    }
 
-        command_item = command_item->next;
+    if (s_connect_path == CONNECT_PATH_HOSTNAME)
+    {
+        snprintf(s_broker_uri, sizeof(s_broker_uri), "mqtts://%s:8883", AWS_IOT_ENDPOINT);
+    }
+    else
+    {
+        char addr[INET_ADDRSTRLEN];
+        struct in_addr in = {.s_addr = s_broker.addr};
+        inet_ntop(AF_INET, &in, addr, sizeof(addr));
+        snprintf(s_broker_uri, sizeof(s_broker_uri), "mqtts://%s:8883", addr);
+    }
+    esp_mqtt_client_set_uri(g_client, s_broker_uri);
+}
+
+static void broker_use(broker_id_t id)
+{
+    s_broker_id = id;
+    s_resolve_ms = 0;
+    if (id == BROKER_LOCAL)
+    {
+        broker_use_local();
+    }
+    else
+    {
+        broker_use_cloud();
+    }
+}
+
+// Picks the broker for this connection
+static void broker_select_uri(void)
+{
+    broker_use(broker_pick(BROKER_LOCAL));
+}
+
+// A connect that fails before CONNACK counts against the endpoint. The LAN
+// broker then backs off and the client moves on to the next endpoint; a
+// connection to AWS IoT by cached address may mean the endpoint moved, so the
+// address is forgotten and the reconnect uses the hostname.
+static void broker_fall_back(void)
+{
+    if (!s_connect_pending || s_attempt_failed)
+    {
+        return;
+    }
+    s_attempt_failed = true;
+
+    broker_health_t *health = &s_broker.health[s_broker_id];
+    if (health->failures < UINT8_MAX)
+    {
+        health->failures++;
+    }
+    uint32_t backoff_s = BROKER_BACKOFF_BASE_S << (health->failures < 7 ? health->failures - 1 : 6);
+    if (backoff_s > BROKER_BACKOFF_MAX_S)
+    {
+        backoff_s = BROKER_BACKOFF_MAX_S;
+    }
+    health->retry_at = time(NULL) + backoff_s;
+
+    if (s_broker_id != BROKER_CLOUD)
+    {
+        ESP_LOGW(TAG, "Broker %s unreachable, skipping it for %lu s", s_broker_uri, (unsigned long)backoff_s);
+        broker_use(broker_pick(s_broker_id + 1));
+        // Time the new endpoint on its own, and wait for its shadow if it has one
+        s_connect_start_us = esp_timer_get_time();
+        s_shadow_synced = !broker_has_shadow();
+        esp_mqtt_client_reconnect(g_client);
+        return;
+    }
+
+    if (s_connect_path == CONNECT_PATH_HOSTNAME)
+    {
+        return;
+    }
+
+    ESP_LOGW(TAG, "Connecting by address %s failed, falling back to hostname", s_broker_uri);
+    s_broker.addr = 0;
+    s_connect_path = CONNECT_PATH_HOSTNAME;
+    snprintf(s_broker_uri, sizeof(s_broker_uri), "mqtts://%s:8883", AWS_IOT_ENDPOINT);
+    esp_mqtt_client_set_uri(g_client, s_broker_uri);
+}
+
+static void broker_record_connect(void)
+{
+    if (!s_connect_pending)
+    {
+        return;
+    }
+    s_connect_pending = false;
+
+    uint32_t elapsed_ms = (uint32_t)((esp_timer_get_time() - s_connect_start_us) / 1000);
+    broker_health_t *health = &s_broker.health[s_broker_id];
+    health->failures = 0;
+    health->connects++;
+    health->total_ms += elapsed_ms;
+    s_broker.last_ms = elapsed_ms;
+    s_broker.last_broker = s_broker_id;
+
+    if (s_broker_id != BROKER_CLOUD)
+    {
+        ESP_LOGI(TAG, "Connected to %s broker in %lu ms", s_broker_names[s_broker_id], (unsigned long)elapsed_ms);
+        return;
+    }
+
+    s_broker.connects[s_connect_path]++;
+    s_broker.total_ms[s_connect_path] += elapsed_ms;
+    s_broker.last_path = s_connect_path;
+    ESP_LOGI(TAG, "Connected via %s address in %lu ms (lookup %lu ms)", s_connect_path_names[s_connect_path],
+             (unsigned long)elapsed_ms, (unsigned long)s_resolve_ms);
+}
+
+// Connect timing per broker and, for AWS IoT, per address path, reported
+// alongside the queue stats
+static void add_connect_stats(json_writer_t *writer)
+{
+    json_writer_begin_object(writer, "connect");
+    json_writer_string(writer, "broker", s_broker_names[s_broker.last_broker]);
+    json_writer_string(writer, "path", s_connect_path_names[s_broker.last_path]);
+    json_writer_int(writer, "last_ms", s_broker.last_ms);
+    for (int path = 0; path < CONNECT_PATH_COUNT; path++)
+    {
+        if (s_broker.connects[path] == 0)
+        {
+            continue;
+        }
+        json_writer_begin_object(writer, s_connect_path_names[path]);
+        json_writer_int(writer, "count", s_broker.connects[path]);
+        json_writer_int(writer, "avg_ms", s_broker.total_ms[path] / s_broker.connects[path]);
+        json_writer_end_object(writer);
+    }
+    json_writer_begin_object(writer, "brokers");
+    for (int id = 0; id < BROKER_COUNT; id++)
+    {
+        const broker_health_t *health = &s_broker.health[id];
+        if (!broker_configured(id))
+        {
+            continue;
+        }
+        json_writer_begin_object(writer, s_broker_names[id]);
+        json_writer_int(writer, "count", health->connects);
+        json_writer_int(writer, "avg_ms", health->connects > 0 ? health->total_ms / health->connects : 0);
+        json_writer_int(writer, "failures", health->failures);
+        json_writer_end_object(writer);
+    }
+    json_writer_end_object(writer);
+    json_writer_end_object(writer);
+}
+
+// Queue health for the shadow's reported state; the alert class is nested as
+// "alerts", routine stats stay at the top level
+static void add_queue_stats(json_writer_t *writer)
+{
+    json_writer_begin_object(writer, "queue");
+    for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
+    {
+        fs_utils_mqtt_log_stats_t stats;
+        if (fs_utils_get_mqtt_log_stats(log_class, &stats) != ESP_OK)
+        {
+            continue;
+        }
+
+        if (log_class == FS_UTILS_MQTT_LOG_ALERT)
+        {
+            json_writer_begin_object(writer, "alerts");
+        }
+        json_writer_int(writer, "depth", stats.depth);
+        json_writer_int(writer, "capacity", stats.capacity);
+        json_writer_int(writer, "bytes", stats.bytes);
+        json_writer_int(writer, "dropped", stats.dropped);
+        json_writer_int(writer, "compacted", stats.compacted);
+        json_writer_int(writer, "oldest", stats.oldest_timestamp_ms);
+        json_writer_int(writer, "newest", stats.newest_timestamp_ms);
+        if (log_class == FS_UTILS_MQTT_LOG_ALERT)
+        {
+            json_writer_end_object(writer);
+        }
+    }
+    json_writer_int(writer, "staged", s_staging.count);
+    json_writer_int(writer, "staged_dropped", s_staging.dropped);
+    json_writer_end_object(writer);
+}
+
+// Serializes the reported settings and the cleared desired commands. Returns
+// the payload length, or -1 if it does not fit.
+static int build_shadow_update(char *buf, size_t size, const shadow_commands_t *commands)
+{
+    json_writer_t writer;
+    json_writer_init(&writer, buf, size);
+    json_writer_begin_object(&writer, NULL);
+    json_writer_begin_object(&writer, "state");
+
+    // Report every setting that was applied
+    json_writer_begin_object(&writer, "reported");
+    for (int setting = 0; setting < SHADOW_SETTING_COUNT; setting++)
+    {
+        if (!(commands->present & (1UL << setting)))
+        {
+            continue;
+        }
+        if (s_shadow_settings[setting].type == SHADOW_VALUE_BOOL)
+        {
+            json_writer_bool(&writer, s_shadow_settings[setting].name, commands->value[setting] != 0);
+        }
+        else
+        {
+            json_writer_number(&writer, s_shadow_settings[setting].name, commands->value[setting],
+                               JSON_WRITER_DOUBLE_DIGITS);
+        }
+    }
+    add_queue_stats(&writer);
+    add_connect_stats(&writer);
+    json_writer_end_object(&writer);
+
+    // Set each command key to null in desired.commands
+    json_writer_begin_object(&writer, "desired");
+    json_writer_begin_object(&writer, "commands");
+    for (size_t i = 0; i < commands->command_count; i++)
+    {
+        json_writer_null(&writer, commands->commands[i]);
+    }
+    json_writer_end_object(&writer);
+    json_writer_end_object(&writer);
+
+    json_writer_end_object(&writer);
+    json_writer_end_object(&writer);
+    return json_writer_finish(&writer);
+}
+
+static void publish_shadow_update(const shadow_commands_t *commands)
+{
+    if (shadow_update_topic[0] == '\0' || g_client == NULL)
+    {
+        ESP_LOGW(TAG, "Cannot publish shadow update: shadow_update_topic not built or client not set");
+        return;
+    }
+
+    // Only used from the MQTT event task
+    static char update_json[SHADOW_UPDATE_MAX_BYTES];
+    if (build_shadow_update(update_json, sizeof(update_json), commands) < 0)
+    {
+        ESP_LOGE(TAG, "Shadow update exceeds %d bytes", SHADOW_UPDATE_MAX_BYTES);
+        return;
+    }
+
+    publish(shadow_update_topic, update_json, SHADOW_QOS, false);
+    s_shadow_update_pending = true;
+}
+
+// Parser callback: remembers each command object and the settings we understand
+static void shadow_collect(const shadow_field_t *field, void *ctx)
+{
+    shadow_commands_t *commands = ctx;
+
+    if (field->field == NULL)
+    {
+        if (commands->command_count < MAX_SHADOW_COMMANDS)
+        {
+            strcpy(commands->commands[commands->command_count++], field->command);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Too many shadow commands, not clearing '%s'", field->command);
+        }
+        return;
+    }
+
+    for (int setting = 0; setting < SHADOW_SETTING_COUNT; setting++)
+    {
+        if (strcmp(field->field, s_shadow_settings[setting].name) != 0 ||
+            field->type != s_shadow_settings[setting].type)
+        {
+            continue;
+        }
+        if (field->type == SHADOW_VALUE_BOOL)
+        {
+            // Force commands only act when set
+            if (!field->boolean)
+            {
+                return;
+            }
+            commands->value[setting] = 1;
+        }
+        else
+        {
+            commands->value[setting] = field->number;
+        }
+        commands->present |= 1UL << setting;
+        return;
+    }
+}
+
+// Applies the collected settings; rejected ones are dropped from `present` so
+// they are not reported back
+static void shadow_apply(shadow_commands_t *commands)
+{
+    for (int setting = 0; setting < SHADOW_SETTING_COUNT; setting++)
+    {
+        if (!(commands->present & (1UL << setting)))
+        {
+            continue;
+        }
+
+        double number = commands->value[setting];
+        int value = (int)number;
+        bool applied = true;
+
+        switch (setting)
+        {
+        case SHADOW_SETTING_TEMP_FREQUENCY:
+            if (value >= 0)
+            {
+                temp_frequency = value;
+                event_manager_set_temp_reading_interval(value);
+                ESP_LOGI(TAG, "Shadow delta: temp_frequency = %d", value);
+            }
+            else
+            {
+                ESP_LOGW(TAG, "Invalid temperature interval: %d (must be >= 0)", value);
+                applied = false;
+            }
+            break;
+        case SHADOW_SETTING_FEED_FREQUENCY:
+            if (value >= 0)
+            {
+                feed_frequency = value;
+                event_manager_set_feeding_interval(value);
+                ESP_LOGI(TAG, "Shadow delta: feed_frequency = %d", value);
+            }
+            else
+            {
+                ESP_LOGW(TAG, "Invalid feeding interval: %d (must be >= 0)", value);
+                applied = false;
+            }
+            break;
+        case SHADOW_SETTING_WAKE_FREQUENCY:
+            if (value >= 0)
+            {
+                wake_frequency = value;
+                event_manager_set_publish_interval(value);
+                ESP_LOGI(TAG, "Shadow delta: wake_frequency = %d", value);
+            }
+            else
+            {
+                ESP_LOGW(TAG, "Invalid wake interval: %d (must be >= 0)", value);
+                applied = false;
+            }
+            break;
+        case SHADOW_SETTING_TEMP_FORCE:
+            event_manager_set_bits(EVENT_BIT_TEMP_SCHEDULED);
+            ESP_LOGI(TAG, "Shadow delta: temp_force = true");
+            break;
+        case SHADOW_SETTING_FEED_FORCE:
+            event_manager_set_bits(EVENT_BIT_FEED_SCHEDULED);
+            ESP_LOGI(TAG, "Shadow delta: feed_force = true");
+            break;
+        case SHADOW_SETTING_PH_FORCE:
+            event_manager_set_bits(EVENT_BIT_PH_SCHEDULED);
+            ESP_LOGI(TAG, "Shadow delta: ph_force = true");
+            break;
+        case SHADOW_SETTING_TEMP_LOWER:
+            event_manager_set_temp_lower((float)number);
+            ESP_LOGI(TAG, "Shadow delta: temp_lower = %.2f", (float)number);
+            break;
+        case SHADOW_SETTING_TEMP_UPPER:
+            event_manager_set_temp_upper((float)number);
+            ESP_LOGI(TAG, "Shadow delta: temp_upper = %.2f", (float)number);
+            break;
+        case SHADOW_SETTING_PH_LOWER:
+            event_manager_set_ph_lower((float)number);
+            ESP_LOGI(TAG, "Shadow delta: ph_lower = %.2f", (float)number);
+            break;
+        case SHADOW_SETTING_PH_UPPER:
+            event_manager_set_ph_upper((float)number);
+            ESP_LOGI(TAG, "Shadow delta: ph_upper = %.2f", (float)number);
+            break;
+        }
+
+        if (!applied)
+        {
+            commands->present &= ~(1UL << setting);
+        }
+    }
+}
+
+static void shadow_sync_load(void)
+{
+    if (s_shadow_sync_loaded)
+    {
+        return;
+    }
+    s_shadow_sync_loaded = true;
+
+    size_t len = sizeof(s_shadow_sync);
+    if (nvs_load_blob(MQTT_NVS_NAMESPACE, "shadow_sync", &s_shadow_sync, &len) != ESP_OK || len != sizeof(s_shadow_sync))
+    {
+        s_shadow_sync.version = -1;
+        s_shadow_sync.digest = 0;
+    }
+}
+
+// Only writes NVS when something actually changed
+static void shadow_sync_save(int64_t version, uint32_t digest)
+{
+    shadow_sync_load();
+    if (version < 0)
+    {
+        version = s_shadow_sync.version;
+    }
+    if (version == s_shadow_sync.version && digest == s_shadow_sync.digest)
+    {
+        return;
+    }
+
+    s_shadow_sync.version = version;
+    s_shadow_sync.digest = digest;
+    esp_err_t err = nvs_save_blob(MQTT_NVS_NAMESPACE, "shadow_sync", &s_shadow_sync, sizeof(s_shadow_sync));
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to save shadow sync state: %s", esp_err_to_name(err));
+    }
+}
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint32_t shadow_digest(const shadow_commands_t *commands)
+{
+    uint32_t hash = fnv1a(FNV_OFFSET_BASIS, &commands->present, sizeof(commands->present));
+    for (int setting = 0; setting < SHADOW_SETTING_COUNT; setting++)
+    {
+        if (commands->present & (1UL << setting))
+        {
+            hash = fnv1a(hash, &commands->value[setting], sizeof(commands->value[setting]));
+        }
+    }
+    return hash;
+}
+
+// Applies the collected commands and reports them; returns their digest
+static uint32_t shadow_apply_and_report(void)
+{
+    uint32_t digest = shadow_digest(&s_shadow_commands);
+    shadow_apply(&s_shadow_commands);
+    if (s_shadow_commands.present != 0)
+    {
+        publish_shadow_update(&s_shadow_commands);
+    }
+    return digest;
+}
+
+static void process_shadow_delta(void)
+{
+    s_last_delta_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Processing shadow delta (length: %zu)", s_rx_total);
+
+    if (shadow_parser_end(&s_shadow_parser) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to parse shadow delta JSON");
+        return;
+    }
+
+    if (s_shadow_commands.command_count == 0)
+    {
+        ESP_LOGW(TAG, "No 'commands' object in shadow delta state");
+        return;
+    }
+
+    // A delta is always a new request, even if it repeats the last one (e.g. feed_force)
+    uint32_t digest = shadow_apply_and_report();
+    shadow_sync_save(s_shadow_parser.version, digest);
+}
+
+static void process_get_accepted(void)
+{
+    ESP_LOGI(TAG, "Processing shadow/get/accepted (length: %zu)", s_rx_total);
+
+    if (shadow_parser_end(&s_shadow_parser) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to parse shadow/get/accepted JSON");
+        s_shadow_synced = true;
+        return;
+    }
+
+    shadow_sync_load();
+    int64_t version = s_shadow_parser.version;
+    uint32_t digest = s_shadow_sync.digest;
+
+    if (version >= 0 && version == s_shadow_sync.version)
+    {
+        ESP_LOGI(TAG, "Shadow unchanged since version %lld, nothing to apply", (long long)version);
+    }
+    else if (s_shadow_commands.command_count > 0)
+    {
+        if (shadow_digest(&s_shadow_commands) == s_shadow_sync.digest)
+        {
+            ESP_LOGI(TAG, "Desired commands already applied, skipping");
+        }
+        else
+        {
+            // Pending desired commands are handled exactly like a delta
+            s_last_delta_us = esp_timer_get_time();
+            digest = shadow_apply_and_report();
+        }
+    }
+    shadow_sync_save(version, digest);
+    s_shadow_synced = true;
+}
+
+// The accepted echo of our own update carries the version it produced, which
+// is what the next wake's shadow get reports if nothing else changes
+static void process_update_accepted(void)
+{
+    if (shadow_parser_end(&s_shadow_parser) != ESP_OK || !s_shadow_update_pending)
+    {
+        return;
+    }
+    s_shadow_update_pending = false;
+    ESP_LOGI(TAG, "Shadow update accepted (version %lld)", (long long)s_shadow_parser.version);
+    shadow_sync_save(s_shadow_parser.version, s_shadow_sync.digest);
+}
+
+// Starts parsing a new shadow document
+static void shadow_receive_begin(shadow_doc_t doc, size_t total_len)
+{
+    static const char *const delta_path[] = {"state", "commands"};
+    static const char *const get_path[] = {"state", "desired", "commands"};
+
+    s_rx_doc = doc;
+    s_rx_total = total_len;
+    s_rx_remaining = total_len;
+    memset(&s_shadow_commands, 0, sizeof(s_shadow_commands));
+
+    switch (doc)
+    {
+    case SHADOW_DOC_DELTA:
+        shadow_parser_begin(&s_shadow_parser, delta_path, 2, shadow_collect, &s_shadow_commands);
+        break;
+    case SHADOW_DOC_UPDATE_ACCEPTED:
+        // Only the version is of interest
+        shadow_parser_begin(&s_shadow_parser, delta_path, 2, NULL, NULL);
+        break;
+    case SHADOW_DOC_GET_ACCEPTED:
+        shadow_parser_begin(&s_shadow_parser, get_path, 3, shadow_collect, &s_shadow_commands);
+        break;
+    default:
+        break;
+    }
+}
+
+static void shadow_receive_data(const char *data, size_t len)
+{
+    if (s_rx_doc == SHADOW_DOC_NONE)
+    {
+        return;
+    }
+
+    if (len > s_rx_remaining)
+    {
+        ESP_LOGW(TAG, "Skipping excess data in chunk (%zu bytes, expected max %zu)", len, s_rx_remaining);
+        len = s_rx_remaining;
+    }
+    // A syntax error is latched by the parser and reported at the end
+    shadow_parser_feed(&s_shadow_parser, data, len);
+    s_rx_remaining -= len;
+    if (s_rx_remaining > 0)
+    {
+        return;
+    }
+
+    shadow_doc_t doc = s_rx_doc;
+    s_rx_doc = SHADOW_DOC_NONE;
+    if (s_rx_total == 0)
+    {
+        return;
+    }
+
+    switch (doc)
+    {
+    case SHADOW_DOC_DELTA:
+        process_shadow_delta();
+        break;
+    case SHADOW_DOC_UPDATE_ACCEPTED:
+        process_update_accepted();
+        break;
+    case SHADOW_DOC_GET_ACCEPTED:
+        process_get_accepted();
+        break;
+    default:
+        break;
+    }
+}
+
+static void client_init(void);
+
+void mqtt_manager_start(void)
+{
+    if (g_client == NULL)
+    {
+        client_init();
+    }
+    if (g_client == NULL)
+    {
+        ESP_LOGE(TAG, "MQTT client not initialized");
+        return;
+    }
+
+    // Verify system time is set correctly before SSL handshake
+    time_t current_time = time(NULL);
+    struct tm timeinfo;
+    localtime_r(&current_time, &timeinfo);
+    char time_str[64];
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &timeinfo);
+    ESP_LOGI(TAG, "Current system time before MQTT start: %s (timestamp: %ld)",
+             time_str, (long)current_time);
+
+    // If time is not set (before 2021), it may cause certificate verification to fail
+    if (current_time < 1609459200) // 2021-01-01 00:00:00
+    {
+        ESP_LOGW(TAG, "System time appears incorrect (before 2021), SSL certificate verification may fail");
+    }
+
+    broker_select_uri();
+    s_connect_start_us = esp_timer_get_time();
+    s_connect_pending = true;
+    s_attempt_failed = false;
+    // Without a shadow there is no get round trip to wait for
+    s_shadow_synced = !broker_has_shadow();
+    s_last_delta_us = 0;
+
+    ESP_LOGI(TAG, "Starting MQTT client (%s)", s_broker_uri);
+    esp_mqtt_client_start(g_client);
+}
+
+bool mqtt_manager_is_idle(void)
+{
+    if (g_client == NULL || !s_shadow_synced)
+    {
+        return false;
+    }
+    if (s_last_delta_us != 0 && esp_timer_get_time() - s_last_delta_us < (int64_t)LINGER_DELTA_MS * 1000)
+    {
+        return false;
+    }
+    // QoS 1 publishes stay in the outbox until their PUBACK, including shadow
+    // updates sent in response to a delta
+    return pending_get_count() == 0 && esp_mqtt_client_get_outbox_size(g_client) == 0;
+}
+
+void mqtt_manager_stop(void)
+{
+    if (g_client != NULL)
+    {
+        size_t unacked = pending_get_count();
+        if (unacked > 0)
+        {
+            ESP_LOGW(TAG, "Stopping with %zu queued messages unacknowledged", unacked);
+        }
+
+        // A persistent session keeps its subscriptions for the next wake
+        if (!PERSISTENT_SESSION)
+        {
+            for (size_t i = 0; i < s_route_count; i++)
+            {
+                esp_mqtt_client_unsubscribe(g_client, s_routes[i].topic);
+            }
+        }
+        esp_mqtt_client_disconnect(g_client);
+        vTaskDelay(pdMS_TO_TICKS(500));
+        esp_mqtt_client_stop(g_client);
+    }
+}
+
+int mqtt_manager_get_temp_frequency(void)
+{
+    return temp_frequency;
+}
+
+int mqtt_manager_get_feed_frequency(void)
+{
+    return feed_frequency;
+}
+
+static void staging_init(void)
+{
+    if (s_staging_mutex == NULL)
+    {
+        s_staging_mutex = xSemaphoreCreateMutex();
+    }
+
+    // RTC memory is only valid after a deep sleep wake
+    if (s_staging.magic != STAGING_MAGIC || s_staging.head >= STAGING_CAPACITY || s_staging.count > STAGING_CAPACITY)
+    {
+        memset(&s_staging, 0, sizeof(s_staging));
+        s_staging.magic = STAGING_MAGIC;
+    }
+    else if (s_staging.count > 0)
+    {
+        ESP_LOGI(TAG, "%u readings staged in RTC memory from before sleep", s_staging.count);
+    }
+}
+
+// Moves staged readings into the flash journal. The ring is at most two
+// contiguous runs, so this is at most two bulk appends. Whatever fails to save
+// stays staged.
+static void staging_flush(void)
+{
+    if (s_staging_mutex == NULL || xSemaphoreTake(s_staging_mutex, portMAX_DELAY) != pdTRUE)
+    {
+        return;
+    }
+
+    size_t flushed = 0;
+    while (s_staging.count > 0)
+    {
+        size_t count = STAGING_SLOTS - s_staging.head;
+        if (count > s_staging.count)
+        {
+            count = s_staging.count;
+        }
+
+        size_t saved = 0;
+        esp_err_t err = fs_utils_save_mqtt_logs(&s_staging.records[s_staging.head], count, &saved);
+        s_staging.head = (s_staging.head + saved) % STAGING_SLOTS;
+        s_staging.count -= saved;
+        flushed += saved;
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to flush staged readings, %u left in RTC memory", s_staging.count);
+            break;
+        }
+    }
+
+    xSemaphoreGive(s_staging_mutex);
+
+    if (flushed > 0)
+    {
+        ESP_LOGI(TAG, "Flushed %zu staged readings to the offline queue", flushed);
+    }
+}
+
+// Stages a routine reading in RTC memory. Returns false if it should go to
+// flash directly instead, as alerts and feed results always do.
+static bool staging_add(const fs_utils_mqtt_log_entry_t *record)
+{
+    if (STAGING_CAPACITY == 0 || s_staging_mutex == NULL ||
+        fs_utils_mqtt_log_class_of(record) != FS_UTILS_MQTT_LOG_ROUTINE)
+    {
+        return false;
+    }
+
+    if (xSemaphoreTake(s_staging_mutex, portMAX_DELAY) != pdTRUE)
+    {
+        return false;
+    }
+
+    if (s_staging.count == STAGING_CAPACITY)
+    {
+        // Only reachable if flushing to flash keeps failing
+        s_staging.head = (s_staging.head + 1) % STAGING_SLOTS;
+        s_staging.count--;
+        s_staging.dropped++;
+        ESP_LOGW(TAG, "RTC staging full, dropped oldest reading");
+    }
+
+    s_staging.records[(s_staging.head + s_staging.count) % STAGING_SLOTS] = *record;
+    s_staging.count++;
+    bool flush = s_staging.count >= STAGING_FLUSH_AT;
+
+    xSemaphoreGive(s_staging_mutex);
+
+    ESP_LOGI(TAG, "Staged %s reading in RTC memory (%u/%d)", s_topic_policy[record->type].suffix, s_staging.count, STAGING_CAPACITY);
+    if (flush)
+    {
+        staging_flush();
+    }
+    return true;
+}
+
+static void init_record(fs_utils_mqtt_log_entry_t *record, fs_utils_record_type_t type)
+{
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    record->timestamp_ms = (int64_t)time(NULL) * 1000;
+}
+
+static void enqueue_record(const fs_utils_mqtt_log_entry_t *record)
+{
+    const topic_policy_t *policy = &s_topic_policy[record->type];
+
+    EventBits_t bits = event_manager_get_bits();
+    bool is_connected = (bits & EVENT_BIT_MQTT_STATUS) && (bits & EVENT_BIT_WIFI_STATUS);
+    if (is_connected)
+    {
+        char message[RECORD_JSON_SIZE];
+        format_record(message, sizeof(message), record);
+        ESP_LOGI(TAG, "Connected, publishing directly");
+        publish(policy->suffix, message, policy->qos, policy->retain);
+        return;
+    }
+
+    if (!policy->persist)
+    {
+        ESP_LOGI(TAG, "Not connected, dropping %s message", policy->suffix);
+        return;
+    }
+
+    if (staging_add(record))
+    {
+        return;
+    }
+
+    esp_err_t err = fs_utils_save_mqtt_log(record);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to enqueue message to topic %s: %s", policy->suffix, esp_err_to_name(err));
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Message enqueued to topic %s", policy->suffix);
+    }
+}
+
+void mqtt_manager_enqueue_temperature(float temperature)
+{
+    fs_utils_mqtt_log_entry_t record;
+    init_record(&record, FS_UTILS_RECORD_TEMP);
+    record.value = temperature;
+    enqueue_record(&record);
+}
+
+void mqtt_manager_enqueue_temperature_at(float temperature, int64_t timestamp_ms)
+{
+    fs_utils_mqtt_log_entry_t record;
+    init_record(&record, FS_UTILS_RECORD_TEMP);
+    record.timestamp_ms = timestamp_ms;
+    record.value = temperature;
+    enqueue_record(&record);
+}
+
+void mqtt_manager_enqueue_ph(float ph)
+{
+    fs_utils_mqtt_log_entry_t record;
+    init_record(&record, FS_UTILS_RECORD_PH);
+    record.value = ph;
+    enqueue_record(&record);
+}
+
+void mqtt_manager_enqueue_feed(bool success)
+{
+    fs_utils_mqtt_log_entry_t record;
+    init_record(&record, FS_UTILS_RECORD_FEED);
+    record.flags = success ? FS_UTILS_RECORD_FLAG_SUCCESS : 0;
+    enqueue_record(&record);
+}
+
+void mqtt_manager_enqueue_log(const char *event, const char *value)
+{
+    fs_utils_mqtt_log_entry_t record;
+    init_record(&record, FS_UTILS_RECORD_LOG);
+    if (fs_utils_make_log_record(&record, event, value) == ESP_OK)
+    {
+        enqueue_record(&record);
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Unknown log event %s, not queued", event);
     }
 
-    if (state_updated)
+    // Notify via BLE alert characteristic, unless this wake left BLE down
+    if (event_manager_is_ble_ready())
     {
-        publish_shadow_update(commands);
+        telemetry_service_notify_alert(event, value);
     }
+}
 
-    cJSON_Delete(json);
+void mqtt_manager_flush_staged(void)
+{
+    staging_flush();
 }
 
-static void process_shadow_accepted(const char *json_data, int len)
+void mqtt_manager_publish(void)
 {
-    char buf[512];
-    if (len >= sizeof(buf))
-        len = sizeof(buf) - 1;
-    memcpy(buf, json_data, len);
-    buf[len] = 0;
+    staging_flush();
+    publish_queued();
+}
 
-    cJSON *json = cJSON_Parse(buf);
-    if (json != NULL)
+static void shadow_delta_handler(const char *data, size_t len, size_t offset, size_t total_len)
+{
+    if (offset == 0)
     {
-        cJSON *state = cJSON_GetObjectItem(json, "state");
-        if (state != NULL)
-        {
-            cJSON *desired = cJSON_GetObjectItem(state, "desired");
-            if (desired != NULL)
-            {
-                ESP_LOGI(TAG, "Shadow accepted desired state");
-            }
-        }
-        cJSON_Delete(json);
+        shadow_receive_begin(SHADOW_DOC_DELTA, total_len);
     }
+    shadow_receive_data(data, len);
 }
 
-static void process_get_accepted(const char *json_data, int len)
+static void shadow_update_accepted_handler(const char *data, size_t len, size_t offset, size_t total_len)
 {
-    if (len <= 0)
+    if (offset == 0)
     {
-        return;
+        shadow_receive_begin(SHADOW_DOC_UPDATE_ACCEPTED, total_len);
     }
+    shadow_receive_data(data, len);
+}
 
-    ESP_LOGI(TAG, "Processing shadow/get/accepted (length: %d)", len);
+static void shadow_get_accepted_handler(const char *data, size_t len, size_t offset, size_t total_len)
+{
+    if (offset == 0)
+    {
+        shadow_receive_begin(SHADOW_DOC_GET_ACCEPTED, total_len);
+    }
+    shadow_receive_data(data, len);
+}
 
-    // Parse shadow state directly from json_data using ParseWithLength to handle large messages
-    cJSON *json = cJSON_ParseWithLength(json_data, len);
-    if (json != NULL)
+// A thing without a shadow document answers the get with a 404: there is
+// nothing to sync, and waiting for get/accepted would linger to the limit
+static void shadow_get_rejected_handler(const char *data, size_t len, size_t offset, size_t total_len)
+{
+    if (offset == 0)
     {
-        cJSON *state = cJSON_GetObjectItem(json, "state");
-        if (state != NULL)
+        char head[96];
+        size_t head_len = len < sizeof(head) - 1 ? len : sizeof(head) - 1;
+        memcpy(head, data, head_len);
+        head[head_len] = '\0';
+        const char *code = strstr(head, "\"code\":");
+        if (code != NULL && strtol(code + strlen("\"code\":"), NULL, 10) == 404)
         {
-            cJSON *desired = cJSON_GetObjectItem(state, "desired");
-            if (desired != NULL && !cJSON_IsNull(desired))
-            {
-                // Create a wrapper JSON with "state" containing the desired values
-                // This matches the format expected by process_shadow_delta
-                cJSON *wrapper = cJSON_CreateObject();
-                cJSON *state_wrapper = cJSON_CreateObject();
-
-                // Copy all items from desired to state_wrapper
-                cJSON *item = desired->child;
-                while (item != NULL)
-                {
-                    cJSON *copy = cJSON_Duplicate(item, 1);
-                    cJSON_AddItemToObject(state_wrapper, item->string, copy);
-                    item = item->next;
-                }
-
-                cJSON_AddItemToObject(wrapper, "state", state_wrapper);
-
-                // Convert to string and process
-                char *json_string = cJSON_Print(wrapper);
-                if (json_string != NULL)
-                {
-                    process_shadow_delta(json_string, strlen(json_string));
-                    free(json_string);
-                }
-
-                cJSON_Delete(wrapper);
-            }
+            ESP_LOGI(TAG, "No shadow document yet, nothing to sync");
+        }
+        else
+        {
+            ESP_LOGW(TAG, "shadow/get rejected: %s", head);
         }
-        cJSON_Delete(json);
     }
-    else
+    if (offset + len >= total_len)
     {
-        ESP_LOGW(TAG, "Failed to parse shadow/get/accepted JSON");
+        s_shadow_synced = true;
     }
 }
 
-void mqtt_manager_start(void)
+static const topic_route_t *topic_route_find(const char *topic, size_t len)
 {
-    if (g_client == NULL)
+    if (topic == NULL || len == 0)
     {
-        ESP_LOGE(TAG, "MQTT client not initialized");
-        return;
+        return NULL;
     }
 
-    // Verify system time is set correctly before SSL handshake
-    time_t current_time = time(NULL);
-    struct tm timeinfo;
-    localtime_r(&current_time, &timeinfo);
-    char time_str[64];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &timeinfo);
-    ESP_LOGI(TAG, "Current system time before MQTT start: %s (timestamp: %ld)",
-             time_str, (long)current_time);
-
-    // If time is not set (before 2021), it may cause certificate verification to fail
-    if (current_time < 1609459200) // 2021-01-01 00:00:00
+    uint32_t hash = fnv1a(FNV_OFFSET_BASIS, topic, len);
+    for (size_t i = 0; i < s_route_count; i++)
     {
-        ESP_LOGW(TAG, "System time appears incorrect (before 2021), SSL certificate verification may fail");
+        if (s_routes[i].len == len && s_routes[i].hash == hash && memcmp(s_routes[i].topic, topic, len) == 0)
+        {
+            return &s_routes[i];
+        }
     }
+    return NULL;
+}
 
-    ESP_LOGI(TAG, "Starting MQTT client");
-    esp_mqtt_client_start(g_client);
+static int topic_route_subscribe(const topic_route_t *route)
+{
+    int msg_id = esp_mqtt_client_subscribe(g_client, route->topic, route->qos);
+    if (msg_id < 0)
+    {
+        ESP_LOGW(TAG, "Failed to subscribe to %s", route->topic);
+    }
+    return msg_id;
 }
 
-void mqtt_manager_stop(void)
+esp_err_t mqtt_manager_add_topic(const char *topic, int qos, mqtt_manager_topic_handler_t handler)
 {
-    if (g_client != NULL)
+    size_t len = strlen(topic);
+    if (len == 0 || len >= TOPIC_MAX_LEN || handler == NULL)
     {
-        if (shadow_update_topic[0] != '\0')
-        {
-            static char topic_buf[256];
-            build_shadow_topic(topic_buf, sizeof(topic_buf), shadow_update_topic, "delta");
-            esp_mqtt_client_unsubscribe(g_client, topic_buf);
-            build_shadow_topic(topic_buf, sizeof(topic_buf), shadow_update_topic, "accepted");
-            esp_mqtt_client_unsubscribe(g_client, topic_buf);
-        }
-        if (shadow_get_topic[0] != '\0')
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Re-adding a topic only replaces its handler
+    topic_route_t *route = (topic_route_t *)topic_route_find(topic, len);
+    if (route == NULL)
+    {
+        if (s_route_count >= MAX_TOPIC_ROUTES)
         {
-            static char topic_buf[256];
-            build_shadow_topic(topic_buf, sizeof(topic_buf), shadow_get_topic, "accepted");
-            esp_mqtt_client_unsubscribe(g_client, topic_buf);
+            ESP_LOGE(TAG, "No room to route %s", topic);
+            return ESP_ERR_NO_MEM;
         }
-        esp_mqtt_client_disconnect(g_client);
-        vTaskDelay(pdMS_TO_TICKS(500));
-        esp_mqtt_client_stop(g_client);
+        route = &s_routes[s_route_count++];
+        memcpy(route->topic, topic, len + 1);
+        route->len = len;
+        route->hash = fnv1a(FNV_OFFSET_BASIS, topic, len);
     }
-}
+    route->qos = qos;
+    route->handler = handler;
 
-int mqtt_manager_get_temp_frequency(void)
-{
-    return temp_frequency;
+    if (g_client != NULL && (event_manager_get_bits() & EVENT_BIT_MQTT_STATUS))
+    {
+        topic_route_subscribe(route);
+    }
+    return ESP_OK;
 }
 
-int mqtt_manager_get_feed_frequency(void)
+// Drops every route under `prefix`, keeping the others in subscribe order
+static void topic_routes_remove_prefix(const char *prefix)
 {
-    return feed_frequency;
+    size_t prefix_len = strlen(prefix);
+    size_t kept = 0;
+    for (size_t i = 0; i < s_route_count; i++)
+    {
+        if (strncmp(s_routes[i].topic, prefix, prefix_len) == 0)
+        {
+            continue;
+        }
+        if (kept != i)
+        {
+            s_routes[kept] = s_routes[i];
+        }
+        kept++;
+    }
+    if (kept != s_route_count)
+    {
+        s_route_count = kept;
+        s_rx_route = NULL;
+    }
 }
 
-static void enqueue_message(const char *topic_suffix, const char *message)
+static void build_topics(void)
 {
-    char message_with_timestamp[512];
-    add_timestamp_to_json(message_with_timestamp, sizeof(message_with_timestamp), message);
-    ESP_LOGI(TAG, "Message with timestamp: %s", message_with_timestamp);
-
-    char target_topic[256];
-    snprintf(target_topic, sizeof(target_topic), "%s/%s", client_id, topic_suffix);
-
-    EventBits_t bits = event_manager_get_bits();
-    bool is_connected = (bits & EVENT_BIT_MQTT_STATUS) && (bits & EVENT_BIT_WIFI_STATUS);
-    if (is_connected)
+    if (client_id[0] == '\0')
     {
-        ESP_LOGI(TAG, "Connected, publishing directly");
-        publish(target_topic, message_with_timestamp);
+        ESP_LOGE(TAG, "Cannot build topics: client_id not set");
         return;
     }
 
-    esp_err_t err = fs_utils_save_mqtt_log(target_topic, 1, message_with_timestamp, NULL, 0);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to enqueue message to topic %s: %s", topic_suffix, esp_err_to_name(err));
-    }
-    else
+    // A re-provisioned device must not keep routing the previous thing's shadow
+    if (thing_name[0] != '\0')
     {
-        ESP_LOGI(TAG, "Message enqueued to topic %s", topic_suffix);
+        char prefix[TOPIC_MAX_LEN];
+        snprintf(prefix, sizeof(prefix), "$aws/things/%s/shadow/", thing_name);
+        topic_routes_remove_prefix(prefix);
     }
-}
-
-void mqtt_manager_enqueue_temperature(float temperature)
-{
-    char message[128];
-    snprintf(message, sizeof(message), "{\"event\": \"measurement\", \"value\": %f}", temperature);
-    enqueue_message("temp", message);
-}
 
-void mqtt_manager_enqueue_ph(float ph)
-{
-    char message[128];
-    snprintf(message, sizeof(message), "{\"event\": \"measurement\", \"value\": %f}", ph);
-    enqueue_message("ph", message);
-}
+    strncpy(thing_name, client_id, sizeof(thing_name) - 1);
+    thing_name[sizeof(thing_name) - 1] = '\0';
 
-void mqtt_manager_enqueue_feed(bool success)
-{
-    char message[128];
-    snprintf(message, sizeof(message), "{\"event\": \"action\", \"value\": %s}", success ? "true" : "false");
-    enqueue_message("feed", message);
-}
+    snprintf(shadow_get_topic, sizeof(shadow_get_topic),
+             "$aws/things/%s/shadow/get", thing_name);
+    snprintf(shadow_update_topic, sizeof(shadow_update_topic),
+             "$aws/things/%s/shadow/update", thing_name);
 
-void mqtt_manager_enqueue_log(const char *event, const char *value)
-{
-    char message[128];
-    snprintf(message, sizeof(message), "{\"event\": \"%s\", \"value\": \"%s\"}", event, value);
-    enqueue_message("log", message);
+    char topic[TOPIC_MAX_LEN];
+    snprintf(topic, sizeof(topic), "%s/delta", shadow_update_topic);
+    mqtt_manager_add_topic(topic, 1, shadow_delta_handler);
+    snprintf(topic, sizeof(topic), "%s/accepted", shadow_update_topic);
+    mqtt_manager_add_topic(topic, 1, shadow_update_accepted_handler);
+    snprintf(topic, sizeof(topic), "%s/rejected", shadow_get_topic);
+    mqtt_manager_add_topic(topic, 1, shadow_get_rejected_handler);
+    // Subscribed last: its SUBACK sends the shadow get
+    snprintf(topic, sizeof(topic), "%s/accepted", shadow_get_topic);
+    mqtt_manager_add_topic(topic, 1, shadow_get_accepted_handler);
 
-    // Notify via BLE alert characteristic
-    telemetry_service_notify_alert(event, value);
+    ESP_LOGI(TAG, "Topics built: thing_name=%s", thing_name);
 }
 
-void mqtt_manager_publish(void)
+// Publish empty payload to shadow/get to request current shadow state
+static void request_shadow(void)
 {
-    publish_queued();
+    ESP_LOGI(TAG, "Requesting shadow state via shadow/get");
+    esp_mqtt_client_publish(g_client, shadow_get_topic, "", 0, SHADOW_QOS, 0);
 }
 
 static void event_handler(void *handler_args,
@@ -716,208 +1931,82 @@ static void event_handler(void *handler_args,
     case MQTT_EVENT_CONNECTED:
     {
         ESP_LOGI(TAG, "MQTT connected");
+        broker_record_connect();
         event_manager_set_bits(EVENT_BIT_MQTT_STATUS);
 
-        if (shadow_update_topic[0] != '\0' && shadow_get_topic[0] != '\0')
+        if (PERSISTENT_SESSION && event->session_present)
         {
-            static char topic_buf[256];
-
-            // Subscribe to shadow/update/delta
-            build_shadow_topic(topic_buf, sizeof(topic_buf), shadow_update_topic, "delta");
-            esp_mqtt_client_subscribe(g_client, topic_buf, 1);
+            ESP_LOGI(TAG, "Resumed persistent session, subscriptions kept");
+            if (broker_has_shadow())
+            {
+                request_shadow();
+            }
+            break;
+        }
 
-            // Subscribe to shadow/update/accepted
-            build_shadow_topic(topic_buf, sizeof(topic_buf), shadow_update_topic, "accepted");
-            esp_mqtt_client_subscribe(g_client, topic_buf, 1);
+        // SUBACKs come back in order, so the last one means every route is live
+        // and the shadow get can go out
+        for (size_t i = 0; i < s_route_count; i++)
+        {
+            s_last_sub_msg_id = topic_route_subscribe(&s_routes[i]);
+        }
+        break;
+    }
 
-            // Subscribe to shadow/get/accepted
-            build_shadow_topic(topic_buf, sizeof(topic_buf), shadow_get_topic, "accepted");
-            esp_mqtt_client_subscribe(g_client, topic_buf, 1);
+    case MQTT_EVENT_BEFORE_CONNECT:
+        s_attempt_failed = false;
+        break;
 
-            // Publish empty payload to shadow/get to request current shadow state
-            vTaskDelay(pdMS_TO_TICKS(1000));
-            ESP_LOGI(TAG, "Requesting shadow state via shadow/get");
-            esp_mqtt_client_publish(g_client, shadow_get_topic, "", 0, 1, 0);
+    case MQTT_EVENT_SUBSCRIBED:
+        if (event->msg_id == s_last_sub_msg_id)
+        {
+            s_last_sub_msg_id = -1;
+            if (broker_has_shadow())
+            {
+                request_shadow();
+            }
         }
         break;
-    }
 
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT disconnected");
-        // Free chunk buffer if allocated
-        if (s_chunk_buffer != NULL)
-        {
-            free(s_chunk_buffer);
-            s_chunk_buffer = NULL;
-            s_chunk_buffer_size = 0;
-            s_chunk_buffer_len = 0;
-            s_chunk_total_len = 0;
-            s_chunk_topic[0] = '\0';
-        }
+        broker_fall_back();
+        pending_reset();
+        s_last_sub_msg_id = -1;
+        // Drop a partially received message
+        s_rx_route = NULL;
+        s_rx_doc = SHADOW_DOC_NONE;
+        s_shadow_update_pending = false;
         event_manager_clear_bits(EVENT_BIT_MQTT_STATUS);
         break;
 
     case MQTT_EVENT_DATA:
-    {
-        if (s_chunk_buffer != NULL)
+        // Large messages arrive in several events; only the first carries the topic
+        if (event->current_data_offset == 0)
         {
-            size_t max_to_copy = s_chunk_total_len - s_chunk_buffer_len; // Don't exceed expected total
-            size_t copy_len = (size_t)event->data_len < max_to_copy ? (size_t)event->data_len : max_to_copy;
-
-            if (copy_len > 0)
-            {
-                memcpy(s_chunk_buffer + s_chunk_buffer_len, event->data, copy_len);
-                s_chunk_buffer_len += copy_len;
-            }
-            else if (event->data_len > 0)
-            {
-                ESP_LOGW(TAG, "Skipping excess data in chunk (%zu bytes, already have %zu/%zu)",
-                         event->data_len, s_chunk_buffer_len, s_chunk_total_len);
-            }
-
-            // Check if all chunks received using stored total length
-            if (s_chunk_buffer_len >= s_chunk_total_len)
+            s_rx_route = topic_route_find(event->topic, event->topic_len);
+            if (s_rx_route == NULL && event->topic_len > 0)
             {
-                // Ensure null terminator is at the exact total length (not beyond)
-                if (s_chunk_buffer_len > s_chunk_total_len)
-                {
-                    ESP_LOGW(TAG, "Buffer length (%zu) exceeds expected total (%zu), truncating", s_chunk_buffer_len, s_chunk_total_len);
-                    s_chunk_buffer_len = s_chunk_total_len;
-                }
-                s_chunk_buffer[s_chunk_buffer_len] = '\0';
-
-                // Process complete message based on stored topic
-                if (strstr(s_chunk_topic, "/shadow/update/delta") != NULL)
-                {
-                    process_shadow_delta(s_chunk_buffer, s_chunk_buffer_len);
-                }
-                else if (strstr(s_chunk_topic, "/shadow/update/accepted") != NULL)
-                {
-                    process_shadow_accepted(s_chunk_buffer, s_chunk_buffer_len);
-                }
-                else if (strstr(s_chunk_topic, "/shadow/get/accepted") != NULL)
-                {
-                    process_get_accepted(s_chunk_buffer, s_chunk_buffer_len);
-                }
-
-                // Free buffer after processing
-                free(s_chunk_buffer);
-                s_chunk_buffer = NULL;
-                s_chunk_buffer_size = 0;
-                s_chunk_buffer_len = 0;
-                s_chunk_topic[0] = '\0';
+                ESP_LOGW(TAG, "Received message on unknown topic: %.*s", event->topic_len, event->topic);
+                break;
             }
         }
-        // New message (first chunk or non-chunked) - must have topic
-        else if (event->topic_len > 0 && event->topic != NULL)
+        if (s_rx_route == NULL)
         {
-            char topic_buf[256];
-            int topic_len = event->topic_len < sizeof(topic_buf) - 1 ? event->topic_len : sizeof(topic_buf) - 1;
-            memcpy(topic_buf, event->topic, topic_len);
-            topic_buf[topic_len] = '\0';
-
-            // Check if this is a chunked message
-            bool is_chunked = (event->total_data_len > 0) && (event->total_data_len > event->data_len);
-
-            if (is_chunked)
-            {
-                // First chunk - allocate buffer and store topic
-                s_chunk_total_len = event->total_data_len;
-                s_chunk_buffer_size = s_chunk_total_len + 1; // +1 for null terminator
-                s_chunk_buffer = (char *)malloc(s_chunk_buffer_size);
-                if (s_chunk_buffer == NULL)
-                {
-                    ESP_LOGE(TAG, "Failed to allocate chunk buffer (%zu bytes)", s_chunk_buffer_size);
-                    break;
-                }
-                s_chunk_buffer_len = 0;
-                strncpy(s_chunk_topic, topic_buf, sizeof(s_chunk_topic) - 1);
-                s_chunk_topic[sizeof(s_chunk_topic) - 1] = '\0';
-                ESP_LOGI(TAG, "Allocated chunk buffer: %zu bytes (total message: %zu), topic: %s",
-                         s_chunk_buffer_size, s_chunk_total_len, s_chunk_topic);
-
-                // Append first chunk to buffer - don't exceed expected total length
-                size_t max_to_copy = s_chunk_total_len - s_chunk_buffer_len; // Don't exceed expected total
-                size_t copy_len = (size_t)event->data_len < max_to_copy ? (size_t)event->data_len : max_to_copy;
-
-                if (copy_len > 0)
-                {
-                    memcpy(s_chunk_buffer + s_chunk_buffer_len, event->data, copy_len);
-                    s_chunk_buffer_len += copy_len;
-                    ESP_LOGD(TAG, "Accumulated first chunk: %zu/%zu bytes", s_chunk_buffer_len, s_chunk_total_len);
-                }
-                else if (event->data_len > 0)
-                {
-                    ESP_LOGW(TAG, "Skipping excess data in first chunk (%zu bytes, expected max %zu)",
-                             event->data_len, s_chunk_total_len);
-                }
-
-                if (s_chunk_buffer_len > s_chunk_total_len)
-                {
-                    ESP_LOGW(TAG, "Buffer overflow detected in first chunk, truncating to expected length");
-                    s_chunk_buffer_len = s_chunk_total_len;
-                }
-
-                // Check if message is complete in first chunk (shouldn't happen, but handle it)
-                if (s_chunk_buffer_len >= (size_t)event->total_data_len)
-                {
-                    s_chunk_buffer[s_chunk_buffer_len] = '\0';
-                    ESP_LOGI(TAG, "Complete message received in first chunk (%zu bytes)", s_chunk_buffer_len);
-
-                    // Process complete message
-                    if (strstr(topic_buf, "/shadow/update/delta") != NULL)
-                    {
-                        process_shadow_delta(s_chunk_buffer, s_chunk_buffer_len);
-                    }
-                    else if (strstr(topic_buf, "/shadow/update/accepted") != NULL)
-                    {
-                        process_shadow_accepted(s_chunk_buffer, s_chunk_buffer_len);
-                    }
-                    else if (strstr(topic_buf, "/shadow/get/accepted") != NULL)
-                    {
-                        process_get_accepted(s_chunk_buffer, s_chunk_buffer_len);
-                    }
-
-                    // Free buffer after processing
-                    free(s_chunk_buffer);
-                    s_chunk_buffer = NULL;
-                    s_chunk_buffer_size = 0;
-                    s_chunk_buffer_len = 0;
-                    s_chunk_total_len = 0;
-                    s_chunk_topic[0] = '\0';
-                }
-            }
-            else
-            {
-                // Non-chunked message - process directly
-                if (strstr(topic_buf, "/shadow/update/delta") != NULL)
-                {
-                    process_shadow_delta(event->data, event->data_len);
-                }
-                else if (strstr(topic_buf, "/shadow/update/accepted") != NULL)
-                {
-                    process_shadow_accepted(event->data, event->data_len);
-                }
-                else if (strstr(topic_buf, "/shadow/get/accepted") != NULL)
-                {
-                    process_get_accepted(event->data, event->data_len);
-                }
-                else
-                {
-                    ESP_LOGW(TAG, "Received message on unknown topic: %s", topic_buf);
-                }
-            }
+            ESP_LOGW(TAG, "Received MQTT message without topic and not part of chunked message, ignoring");
+            break;
         }
-        else
+        s_rx_route->handler(event->data, event->data_len, event->current_data_offset, event->total_data_len);
+        if (event->current_data_offset + event->data_len >= event->total_data_len)
         {
-            ESP_LOGW(TAG, "Received MQTT message without topic and not part of chunked message, ignoring");
+            s_rx_route = NULL;
         }
         break;
-    }
 
     case MQTT_EVENT_PUBLISHED:
     {
         ESP_LOGI(TAG, "Message published: msg_id=%d", event->msg_id);
+        pending_ack(event->msg_id);
         break;
     }
 
@@ -934,6 +2023,7 @@ static void event_handler(void *handler_args,
         {
             ESP_LOGE(TAG, "MQTT error: error_handle is NULL");
         }
+        broker_fall_back();
         event_manager_clear_bits(EVENT_BIT_MQTT_STATUS);
         break;
     }
@@ -993,14 +2083,19 @@ esp_err_t mqtt_manager_load_config(void)
 
     esp_mqtt_client_config_t mqtt_cfg = {0};
     mqtt_cfg.broker.address.uri = broker_url;
+    mqtt_cfg.network.timeout_ms = CLOUD_NETWORK_TIMEOUT_MS;
     mqtt_cfg.credentials.authentication.certificate = device_cert_buffer;
     mqtt_cfg.credentials.authentication.key = private_key_buffer;
     mqtt_cfg.credentials.client_id = client_id;
+    // The provisioned client ID is stable, so the broker can find the session again
+    mqtt_cfg.session.disable_clean_session = PERSISTENT_SESSION;
 
     if (strlen(root_ca_buffer) > 0)
     {
         mqtt_cfg.broker.verification.certificate = root_ca_buffer;
         mqtt_cfg.broker.verification.skip_cert_common_name_check = false;
+        // Keeps SNI and name verification on the endpoint when connecting by address
+        mqtt_cfg.broker.verification.common_name = AWS_IOT_ENDPOINT;
     }
     else
     {
@@ -1014,6 +2109,10 @@ esp_err_t mqtt_manager_load_config(void)
         ESP_LOGE(TAG, "Failed to initialize MQTT client");
         return ESP_FAIL;
     }
+    // Kept to switch back after trying the LAN broker
+    s_cloud_cfg = mqtt_cfg;
+    s_local_cfg_active = false;
+    s_provisioned = true;
 
     esp_mqtt_client_register_event(g_client, ESP_EVENT_ANY_ID, event_handler, NULL);
 
@@ -1021,7 +2120,9 @@ esp_err_t mqtt_manager_load_config(void)
     return ESP_OK;
 }
 
-void mqtt_manager_init(void)
+// The client, its certificates and topics are only needed to connect, so they
+// are loaded by the first mqtt_manager_start() rather than at boot
+static void client_init(void)
 {
     esp_err_t err = mqtt_manager_load_config();
     if (err == ESP_OK)
@@ -1043,4 +2144,172 @@ void mqtt_manager_init(void)
     g_client = esp_mqtt_client_init(&cfg);
     esp_mqtt_client_register_event(g_client, ESP_EVENT_ANY_ID, event_handler, NULL);
     ESP_LOGI(TAG, "MQTT client initialized with default configuration");
-}
\ No newline at end of file
+}
+
+// Only what queueing readings offline needs
+void mqtt_manager_init(void)
+{
+    if (s_pending_mutex == NULL)
+    {
+        s_pending_mutex = xSemaphoreCreateMutex();
+    }
+    staging_init();
+    broker_cache_init();
+}
+#ifdef CONFIG_MQTT_SHADOW_WRITER_BENCHMARK
+#define SHADOW_BENCH_ROUNDS 100
+
+// The cJSON construction the fixed-buffer writer replaced, kept for comparison
+static char *bench_cjson_update(const shadow_commands_t *commands)
+{
+    cJSON *update_json = cJSON_CreateObject();
+    cJSON *state_obj = cJSON_CreateObject();
+    cJSON *reported_obj = cJSON_CreateObject();
+    cJSON *desired_obj = cJSON_CreateObject();
+    cJSON *desired_commands_obj = cJSON_CreateObject();
+
+    for (int setting = 0; setting < SHADOW_SETTING_COUNT; setting++)
+    {
+        if (!(commands->present & (1UL << setting)))
+        {
+            continue;
+        }
+        if (s_shadow_settings[setting].type == SHADOW_VALUE_BOOL)
+        {
+            cJSON_AddBoolToObject(reported_obj, s_shadow_settings[setting].name, commands->value[setting] != 0);
+        }
+        else
+        {
+            cJSON_AddNumberToObject(reported_obj, s_shadow_settings[setting].name, commands->value[setting]);
+        }
+    }
+    for (size_t i = 0; i < commands->command_count; i++)
+    {
+        cJSON_AddNullToObject(desired_commands_obj, commands->commands[i]);
+    }
+
+    cJSON *queue_obj = cJSON_CreateObject();
+    for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
+    {
+        fs_utils_mqtt_log_stats_t stats;
+        if (fs_utils_get_mqtt_log_stats(log_class, &stats) != ESP_OK)
+        {
+            continue;
+        }
+        cJSON *class_obj = queue_obj;
+        if (log_class == FS_UTILS_MQTT_LOG_ALERT)
+        {
+            class_obj = cJSON_CreateObject();
+            cJSON_AddItemToObject(queue_obj, "alerts", class_obj);
+        }
+        cJSON_AddNumberToObject(class_obj, "depth", stats.depth);
+        cJSON_AddNumberToObject(class_obj, "capacity", stats.capacity);
+        cJSON_AddNumberToObject(class_obj, "bytes", stats.bytes);
+        cJSON_AddNumberToObject(class_obj, "dropped", stats.dropped);
+        cJSON_AddNumberToObject(class_obj, "compacted", stats.compacted);
+        cJSON_AddNumberToObject(class_obj, "oldest", (double)stats.oldest_timestamp_ms);
+        cJSON_AddNumberToObject(class_obj, "newest", (double)stats.newest_timestamp_ms);
+    }
+    cJSON_AddNumberToObject(queue_obj, "staged", s_staging.count);
+    cJSON_AddNumberToObject(queue_obj, "staged_dropped", s_staging.dropped);
+    cJSON_AddItemToObject(reported_obj, "queue", queue_obj);
+
+    cJSON *connect_obj = cJSON_CreateObject();
+    cJSON_AddStringToObject(connect_obj, "broker", s_broker_names[s_broker.last_broker]);
+    cJSON_AddStringToObject(connect_obj, "path", s_connect_path_names[s_broker.last_path]);
+    cJSON_AddNumberToObject(connect_obj, "last_ms", s_broker.last_ms);
+    for (int path = 0; path < CONNECT_PATH_COUNT; path++)
+    {
+        if (s_broker.connects[path] == 0)
+        {
+            continue;
+        }
+        cJSON *path_obj = cJSON_CreateObject();
+        cJSON_AddNumberToObject(path_obj, "count", s_broker.connects[path]);
+        cJSON_AddNumberToObject(path_obj, "avg_ms", s_broker.total_ms[path] / s_broker.connects[path]);
+        cJSON_AddItemToObject(connect_obj, s_connect_path_names[path], path_obj);
+    }
+    cJSON *brokers_obj = cJSON_CreateObject();
+    for (int id = 0; id < BROKER_COUNT; id++)
+    {
+        const broker_health_t *health = &s_broker.health[id];
+        if (!broker_configured(id))
+        {
+            continue;
+        }
+        cJSON *broker_obj = cJSON_CreateObject();
+        cJSON_AddNumberToObject(broker_obj, "count", health->connects);
+        cJSON_AddNumberToObject(broker_obj, "avg_ms", health->connects > 0 ? health->total_ms / health->connects : 0);
+        cJSON_AddNumberToObject(broker_obj, "failures", health->failures);
+        cJSON_AddItemToObject(brokers_obj, s_broker_names[id], broker_obj);
+    }
+    cJSON_AddItemToObject(connect_obj, "brokers", brokers_obj);
+    cJSON_AddItemToObject(reported_obj, "connect", connect_obj);
+
+    cJSON_AddItemToObject(desired_obj, "commands", desired_commands_obj);
+    cJSON_AddItemToObject(state_obj, "reported", reported_obj);
+    cJSON_AddItemToObject(state_obj, "desired", desired_obj);
+    cJSON_AddItemToObject(update_json, "state", state_obj);
+
+    char *json_string = cJSON_Print(update_json);
+    cJSON_Delete(update_json);
+    return json_string;
+}
+
+void mqtt_manager_benchmark_shadow_update(void)
+{
+    // A typical update: new intervals and thresholds from one command
+    shadow_commands_t commands = {.command_count = 1};
+    strcpy(commands.commands[0], "settings");
+    const double values[] = {
+        [SHADOW_SETTING_TEMP_FREQUENCY] = 600,
+        [SHADOW_SETTING_WAKE_FREQUENCY] = 3600,
+        [SHADOW_SETTING_TEMP_LOWER] = 22.5,
+        [SHADOW_SETTING_TEMP_UPPER] = 27.5,
+        [SHADOW_SETTING_PH_LOWER] = 6.5,
+        [SHADOW_SETTING_PH_UPPER] = 7.8,
+    };
+    for (int setting = 0; setting < SHADOW_SETTING_COUNT; setting++)
+    {
+        if (values[setting] != 0)
+        {
+            commands.value[setting] = values[setting];
+            commands.present |= 1UL << setting;
+        }
+    }
+
+    static char update_json[SHADOW_UPDATE_MAX_BYTES];
+    int writer_len = 0;
+    int64_t start_us = esp_timer_get_time();
+    for (int i = 0; i < SHADOW_BENCH_ROUNDS; i++)
+    {
+        writer_len = build_shadow_update(update_json, sizeof(update_json), &commands);
+    }
+    int64_t writer_us = (esp_timer_get_time() - start_us) / SHADOW_BENCH_ROUNDS;
+
+    size_t cjson_len = 0;
+    size_t heap_before = esp_get_free_heap_size();
+    size_t heap_min = heap_before;
+    start_us = esp_timer_get_time();
+    for (int i = 0; i < SHADOW_BENCH_ROUNDS; i++)
+    {
+        char *json_string = bench_cjson_update(&commands);
+        if (json_string == NULL)
+        {
+            ESP_LOGE(TAG, "Shadow writer benchmark: cJSON build failed");
+            return;
+        }
+        cjson_len = strlen(json_string);
+        size_t heap_now = esp_get_free_heap_size();
+        if (heap_now < heap_min)
+        {
+            heap_min = heap_now;
+        }
+        free(json_string);
+    }
+    int64_t cjson_us = (esp_timer_get_time() - start_us) / SHADOW_BENCH_ROUNDS;
+
+    ESP_LOGI(TAG, "Shadow writer benchmark: writer %d bytes %lld us, cJSON %zu bytes %lld us (+%zu bytes heap)",
+             writer_len, (long long)writer_us, cjson_len, (long long)cjson_us, heap_before - heap_min);
+}
+#endif
@@ -2,20 +2,41 @@
 #define MQTT_MANAGER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "esp_err.h"
 
+// Receives an incoming message in the chunks MQTT delivers it in: `data` holds
+// `len` bytes starting at `offset` of a `total_len` byte payload
+typedef void (*mqtt_manager_topic_handler_t)(const char *data, size_t len, size_t offset, size_t total_len);
+
 void mqtt_manager_init(void);
 esp_err_t mqtt_manager_load_config(void);
 void mqtt_manager_start(void);
 void mqtt_manager_stop(void);
+// Subscribes to `topic` on every connect and routes its messages to `handler`.
+// Meant to be called during init; a topic added while connected is subscribed
+// right away.
+esp_err_t mqtt_manager_add_topic(const char *topic, int qos, mqtt_manager_topic_handler_t handler);
 
 int mqtt_manager_get_temp_frequency(void);
 int mqtt_manager_get_feed_frequency(void);
 
 void mqtt_manager_enqueue_temperature(float temperature);
+// For a reading taken earlier, e.g. by the deep sleep wake stub
+void mqtt_manager_enqueue_temperature_at(float temperature, int64_t timestamp_ms);
 void mqtt_manager_enqueue_ph(float ph);
 void mqtt_manager_enqueue_feed(bool success);
 void mqtt_manager_enqueue_log(const char *event, const char *value);
 void mqtt_manager_publish(void);
+// True once every publish is acknowledged, the shadow get has been answered and
+// no shadow delta arrived recently, i.e. the connection can be closed
+bool mqtt_manager_is_idle(void);
+// Writes readings staged in RTC memory to the flash journal, e.g. before a reset
+void mqtt_manager_flush_staged(void);
+
+#ifdef CONFIG_MQTT_SHADOW_WRITER_BENCHMARK
+void mqtt_manager_benchmark_shadow_update(void);
+#endif
 
 #endif // MQTT_MANAGER_H
\ No newline at end of file
@@ -0,0 +1,436 @@
+#include "shadow_parser.h"
+#include "esp_log.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "shadow_parser";
+
+typedef enum
+{
+    SP_VALUE = 0,
+    SP_VALUE_OR_CLOSE, // After '['
+    SP_KEY_OR_CLOSE,   // After '{'
+    SP_KEY,            // After ',' in an object
+    SP_COLON,
+    SP_AFTER_VALUE,
+    SP_STRING,
+    SP_ESCAPE,
+    SP_UNICODE,
+    SP_SCALAR, // Number or true/false/null
+    SP_DONE,
+    SP_ERROR,
+} parser_state_t;
+
+static bool in_array(const shadow_parser_t *parser)
+{
+    return parser->depth > 0 && (parser->containers & (1UL << (parser->depth - 1)));
+}
+
+static void text_reset(shadow_parser_t *parser)
+{
+    parser->text_len = 0;
+    parser->text[0] = '\0';
+    parser->truncated = false;
+}
+
+static void text_append(shadow_parser_t *parser, char c)
+{
+    if (parser->text_len >= sizeof(parser->text) - 1)
+    {
+        parser->truncated = true;
+        return;
+    }
+    parser->text[parser->text_len++] = c;
+    parser->text[parser->text_len] = '\0';
+}
+
+static bool copy_name(char *dst, const shadow_parser_t *parser)
+{
+    if (parser->truncated || parser->text_len >= SHADOW_PARSER_NAME_MAX)
+    {
+        return false;
+    }
+    memcpy(dst, parser->text, parser->text_len + 1);
+    return true;
+}
+
+// Objects are numbered by depth: the document root is 1, the object reached
+// through path[0] is 2, and so on. Below the path come the commands object, the
+// command objects and finally their fields.
+static void on_key(shadow_parser_t *parser)
+{
+    parser->key_matches = false;
+    parser->key_is_version = parser->depth == 1 && strcmp(parser->text, "version") == 0;
+    if (parser->match != parser->depth || in_array(parser))
+    {
+        return;
+    }
+
+    if (parser->depth <= parser->path_len)
+    {
+        parser->key_matches = !parser->truncated && strcmp(parser->text, parser->path[parser->depth - 1]) == 0;
+    }
+    else if (parser->depth == parser->path_len + 1)
+    {
+        parser->key_matches = copy_name(parser->command, parser);
+    }
+    else if (parser->depth == parser->path_len + 2)
+    {
+        parser->key_matches = copy_name(parser->field, parser);
+    }
+}
+
+static void emit_field(shadow_parser_t *parser, shadow_field_t *field)
+{
+    if (parser->cb == NULL || !parser->key_matches || parser->match != parser->depth ||
+        parser->depth != parser->path_len + 2 || in_array(parser))
+    {
+        return;
+    }
+    field->command = parser->command;
+    field->field = parser->field;
+    parser->cb(field, parser->ctx);
+}
+
+static void after_value(shadow_parser_t *parser)
+{
+    parser->key_matches = false;
+    parser->key_is_version = false;
+    parser->state = parser->depth == 0 ? SP_DONE : SP_AFTER_VALUE;
+}
+
+static bool open_container(shadow_parser_t *parser, bool array)
+{
+    if (parser->depth >= SHADOW_PARSER_MAX_DEPTH || (parser->depth == 0 && array))
+    {
+        return false;
+    }
+
+    bool enter = !array && (parser->depth == 0 ||
+                            (parser->key_matches && parser->depth <= parser->path_len + 1));
+
+    parser->depth++;
+    if (array)
+    {
+        parser->containers |= 1UL << (parser->depth - 1);
+    }
+    else
+    {
+        parser->containers &= ~(1UL << (parser->depth - 1));
+    }
+    parser->key_matches = false;
+    parser->key_is_version = false;
+    parser->state = array ? SP_VALUE_OR_CLOSE : SP_KEY_OR_CLOSE;
+
+    if (enter)
+    {
+        parser->match = parser->depth;
+        if (parser->depth == parser->path_len + 2)
+        {
+            shadow_field_t field = {.type = SHADOW_VALUE_NULL};
+            field.command = parser->command;
+            field.field = NULL;
+            if (parser->cb != NULL)
+            {
+                parser->cb(&field, parser->ctx);
+            }
+        }
+    }
+    return true;
+}
+
+static bool close_container(shadow_parser_t *parser, bool array)
+{
+    if (parser->depth == 0 || in_array(parser) != array)
+    {
+        return false;
+    }
+    if (parser->match == parser->depth)
+    {
+        parser->match--;
+    }
+    parser->depth--;
+    after_value(parser);
+    return true;
+}
+
+static bool finish_scalar(shadow_parser_t *parser)
+{
+    if (parser->truncated)
+    {
+        return false;
+    }
+
+    shadow_field_t field = {0};
+    if (strcmp(parser->text, "true") == 0 || strcmp(parser->text, "false") == 0)
+    {
+        field.type = SHADOW_VALUE_BOOL;
+        field.boolean = parser->text[0] == 't';
+    }
+    else if (strcmp(parser->text, "null") == 0)
+    {
+        field.type = SHADOW_VALUE_NULL;
+    }
+    else
+    {
+        char *end = NULL;
+        if (parser->text[0] != '-' && !isdigit((unsigned char)parser->text[0]))
+        {
+            return false;
+        }
+        field.type = SHADOW_VALUE_NUMBER;
+        field.number = strtod(parser->text, &end);
+        if (end != parser->text + parser->text_len)
+        {
+            return false;
+        }
+        if (parser->key_is_version && parser->depth == 1)
+        {
+            parser->version = (int64_t)field.number;
+        }
+    }
+
+    emit_field(parser, &field);
+    after_value(parser);
+    return true;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_scalar_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '-' || c == '+' || c == '.';
+}
+
+static bool step(shadow_parser_t *parser, char c)
+{
+    switch (parser->state)
+    {
+    case SP_VALUE:
+    case SP_VALUE_OR_CLOSE:
+        if (is_space(c))
+        {
+            return true;
+        }
+        if (c == '{' || c == '[')
+        {
+            return open_container(parser, c == '[');
+        }
+        if (c == ']' && parser->state == SP_VALUE_OR_CLOSE)
+        {
+            return close_container(parser, true);
+        }
+        if (parser->depth == 0)
+        {
+            return false; // The document must be an object
+        }
+        text_reset(parser);
+        if (c == '"')
+        {
+            parser->string_is_key = false;
+            parser->state = SP_STRING;
+            return true;
+        }
+        if (c == '-' || isalnum((unsigned char)c))
+        {
+            text_append(parser, c);
+            parser->state = SP_SCALAR;
+            return true;
+        }
+        return false;
+
+    case SP_KEY_OR_CLOSE:
+    case SP_KEY:
+        if (is_space(c))
+        {
+            return true;
+        }
+        if (c == '}' && parser->state == SP_KEY_OR_CLOSE)
+        {
+            return close_container(parser, false);
+        }
+        if (c != '"')
+        {
+            return false;
+        }
+        text_reset(parser);
+        parser->string_is_key = true;
+        parser->state = SP_STRING;
+        return true;
+
+    case SP_COLON:
+        if (is_space(c))
+        {
+            return true;
+        }
+        if (c != ':')
+        {
+            return false;
+        }
+        parser->state = SP_VALUE;
+        return true;
+
+    case SP_AFTER_VALUE:
+        if (is_space(c))
+        {
+            return true;
+        }
+        if (c == ',')
+        {
+            parser->state = in_array(parser) ? SP_VALUE : SP_KEY;
+            return true;
+        }
+        if (c == '}' || c == ']')
+        {
+            return close_container(parser, c == ']');
+        }
+        return false;
+
+    case SP_STRING:
+        if (c == '"')
+        {
+            if (parser->string_is_key)
+            {
+                on_key(parser);
+                parser->state = SP_COLON;
+            }
+            else
+            {
+                shadow_field_t field = {.type = SHADOW_VALUE_STRING, .string = parser->text};
+                emit_field(parser, &field);
+                after_value(parser);
+            }
+            return true;
+        }
+        if (c == '\\')
+        {
+            parser->state = SP_ESCAPE;
+            return true;
+        }
+        if ((unsigned char)c < 0x20)
+        {
+            return false;
+        }
+        text_append(parser, c);
+        return true;
+
+    case SP_ESCAPE:
+        parser->state = SP_STRING;
+        switch (c)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            text_append(parser, c);
+            return true;
+        case 'b':
+            text_append(parser, '\b');
+            return true;
+        case 'f':
+            text_append(parser, '\f');
+            return true;
+        case 'n':
+            text_append(parser, '\n');
+            return true;
+        case 'r':
+            text_append(parser, '\r');
+            return true;
+        case 't':
+            text_append(parser, '\t');
+            return true;
+        case 'u':
+            parser->hex_left = 4;
+            parser->codepoint = 0;
+            parser->state = SP_UNICODE;
+            return true;
+        default:
+            return false;
+        }
+
+    case SP_UNICODE:
+        if (!isxdigit((unsigned char)c))
+        {
+            return false;
+        }
+        parser->codepoint = (parser->codepoint << 4) |
+                            (isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10));
+        if (--parser->hex_left == 0)
+        {
+            // Names we match are ASCII; anything else only needs to stay a placeholder
+            text_append(parser, parser->codepoint < 0x80 ? (char)parser->codepoint : '?');
+            parser->state = SP_STRING;
+        }
+        return true;
+
+    case SP_SCALAR:
+        if (is_scalar_char(c))
+        {
+            text_append(parser, c);
+            return true;
+        }
+        // The terminating character belongs to the enclosing container
+        return finish_scalar(parser) && step(parser, c);
+
+    case SP_DONE:
+        return is_space(c);
+
+    default:
+        return false;
+    }
+}
+
+void shadow_parser_begin(shadow_parser_t *parser, const char *const *path, size_t path_len,
+                         shadow_field_cb_t cb, void *ctx)
+{
+    memset(parser, 0, sizeof(*parser));
+    if (path_len > SHADOW_PARSER_MAX_PATH)
+    {
+        path_len = SHADOW_PARSER_MAX_PATH;
+    }
+    for (size_t i = 0; i < path_len; i++)
+    {
+        parser->path[i] = path[i];
+    }
+    parser->path_len = path_len;
+    parser->cb = cb;
+    parser->ctx = ctx;
+    parser->state = SP_VALUE;
+    parser->version = -1;
+}
+
+esp_err_t shadow_parser_feed(shadow_parser_t *parser, const char *data, size_t len)
+{
+    if (parser->state == SP_ERROR)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!step(parser, data[i]))
+        {
+            ESP_LOGW(TAG, "Malformed shadow JSON at offset %zu", parser->offset);
+            parser->state = SP_ERROR;
+            return ESP_ERR_INVALID_ARG;
+        }
+        parser->offset++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t shadow_parser_end(shadow_parser_t *parser)
+{
+    if (parser->state != SP_DONE)
+    {
+        if (parser->state != SP_ERROR)
+        {
+            ESP_LOGW(TAG, "Shadow JSON ended early after %zu bytes", parser->offset);
+        }
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
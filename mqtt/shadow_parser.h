@@ -0,0 +1,78 @@
+#ifndef SHADOW_PARSER_H
+#define SHADOW_PARSER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest key or string value kept by the parser; longer ones are truncated and
+// never match a path element
+#define SHADOW_PARSER_NAME_MAX 32
+#define SHADOW_PARSER_STRING_MAX 64
+// Nesting deeper than this is rejected
+#define SHADOW_PARSER_MAX_DEPTH 32
+#define SHADOW_PARSER_MAX_PATH 4
+
+typedef enum
+{
+    SHADOW_VALUE_NUMBER = 0,
+    SHADOW_VALUE_BOOL,
+    SHADOW_VALUE_STRING,
+    SHADOW_VALUE_NULL,
+} shadow_value_type_t;
+
+// One scalar member of a command object, e.g. commands.intervals.temp_frequency.
+// `field` is NULL for the notification that a command object has started.
+// The strings are only valid for the duration of the callback.
+typedef struct
+{
+    const char *command;
+    const char *field;
+    shadow_value_type_t type;
+    double number;
+    bool boolean;
+    const char *string;
+} shadow_field_t;
+
+typedef void (*shadow_field_cb_t)(const shadow_field_t *field, void *ctx);
+
+// Incremental JSON tokenizer for shadow documents. It is fed the payload in
+// whatever chunks MQTT delivers and reports the scalar fields of every command
+// object below `path` (e.g. {"state", "commands"}) without building a DOM, so a
+// document of any size costs the fixed size of this struct and a single pass.
+typedef struct
+{
+    const char *path[SHADOW_PARSER_MAX_PATH];
+    uint8_t path_len;
+    shadow_field_cb_t cb;
+    void *ctx;
+
+    uint8_t state;
+    uint8_t depth;
+    uint8_t match;            // Deepest open object whose whole key path is of interest
+    uint32_t containers;      // Bit per depth: set for arrays, clear for objects
+    bool string_is_key;
+    bool key_matches;         // Key just read leads into the path
+    bool truncated;           // `text` overflowed
+    bool key_is_version;      // Top-level "version" key just read
+    uint8_t hex_left;         // \uXXXX digits still expected
+    uint16_t codepoint;
+    size_t offset;            // Bytes consumed, for error reporting
+
+    char command[SHADOW_PARSER_NAME_MAX];
+    char field[SHADOW_PARSER_NAME_MAX];
+    char text[SHADOW_PARSER_STRING_MAX]; // Current key, string or number/literal
+    size_t text_len;
+
+    int64_t version; // Top-level "version" of the document, -1 if absent
+} shadow_parser_t;
+
+void shadow_parser_begin(shadow_parser_t *parser, const char *const *path, size_t path_len,
+                         shadow_field_cb_t cb, void *ctx);
+// Returns ESP_ERR_INVALID_ARG on malformed JSON; the rest of the document is then ignored
+esp_err_t shadow_parser_feed(shadow_parser_t *parser, const char *data, size_t len);
+// Returns ESP_OK only if a complete top-level object has been consumed
+esp_err_t shadow_parser_end(shadow_parser_t *parser);
+
+#endif // SHADOW_PARSER_H
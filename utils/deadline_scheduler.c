@@ -0,0 +1,178 @@
+#include "deadline_scheduler.h"
+#include <string.h>
+
+#define DEADLINE_SCHEDULER_MAGIC 0x444C5331
+
+static void place(deadline_scheduler_t *scheduler, uint8_t index, deadline_entry_t entry)
+{
+    scheduler->heap[index] = entry;
+    scheduler->pos[entry.job] = index;
+}
+
+static void sift_up(deadline_scheduler_t *scheduler, uint8_t index)
+{
+    deadline_entry_t entry = scheduler->heap[index];
+    while (index > 0)
+    {
+        uint8_t parent = (index - 1) / 2;
+        if (scheduler->heap[parent].deadline_ms <= entry.deadline_ms)
+        {
+            break;
+        }
+        place(scheduler, index, scheduler->heap[parent]);
+        index = parent;
+    }
+    place(scheduler, index, entry);
+}
+
+static void sift_down(deadline_scheduler_t *scheduler, uint8_t index)
+{
+    deadline_entry_t entry = scheduler->heap[index];
+    for (;;)
+    {
+        uint8_t child = 2 * index + 1;
+        if (child >= scheduler->count)
+        {
+            break;
+        }
+        if (child + 1 < scheduler->count &&
+            scheduler->heap[child + 1].deadline_ms < scheduler->heap[child].deadline_ms)
+        {
+            child++;
+        }
+        if (entry.deadline_ms <= scheduler->heap[child].deadline_ms)
+        {
+            break;
+        }
+        place(scheduler, index, scheduler->heap[child]);
+        index = child;
+    }
+    place(scheduler, index, entry);
+}
+
+// Takes the entry at `index` out of the heap and restores the heap property
+static void remove_at(deadline_scheduler_t *scheduler, uint8_t index)
+{
+    uint8_t job = scheduler->heap[index].job;
+    scheduler->count--;
+    if (index < scheduler->count)
+    {
+        deadline_entry_t last = scheduler->heap[scheduler->count];
+        place(scheduler, index, last);
+        // The moved entry may belong above or below its new slot
+        sift_down(scheduler, index);
+        sift_up(scheduler, scheduler->pos[last.job]);
+    }
+    scheduler->pos[job] = DEADLINE_SCHEDULER_NONE;
+}
+
+void deadline_scheduler_init(deadline_scheduler_t *scheduler)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    memset(scheduler->pos, DEADLINE_SCHEDULER_NONE, sizeof(scheduler->pos));
+    scheduler->magic = DEADLINE_SCHEDULER_MAGIC;
+}
+
+bool deadline_scheduler_valid(const deadline_scheduler_t *scheduler)
+{
+    if (scheduler->magic != DEADLINE_SCHEDULER_MAGIC || scheduler->count > DEADLINE_SCHEDULER_MAX_JOBS)
+    {
+        return false;
+    }
+
+    uint8_t scheduled = 0;
+    for (uint8_t job = 0; job < DEADLINE_SCHEDULER_MAX_JOBS; job++)
+    {
+        uint8_t index = scheduler->pos[job];
+        if (index == DEADLINE_SCHEDULER_NONE)
+        {
+            continue;
+        }
+        if (index >= scheduler->count || scheduler->heap[index].job != job)
+        {
+            return false;
+        }
+        if (index > 0 && scheduler->heap[(index - 1) / 2].deadline_ms > scheduler->heap[index].deadline_ms)
+        {
+            return false;
+        }
+        scheduled++;
+    }
+    return scheduled == scheduler->count;
+}
+
+void deadline_scheduler_set(deadline_scheduler_t *scheduler, uint8_t job, int64_t deadline_ms)
+{
+    if (job >= DEADLINE_SCHEDULER_MAX_JOBS)
+    {
+        return;
+    }
+
+    uint8_t index = scheduler->pos[job];
+    if (index == DEADLINE_SCHEDULER_NONE)
+    {
+        index = scheduler->count++;
+        place(scheduler, index, (deadline_entry_t){.deadline_ms = deadline_ms, .job = job});
+        sift_up(scheduler, index);
+        return;
+    }
+
+    int64_t previous_ms = scheduler->heap[index].deadline_ms;
+    scheduler->heap[index].deadline_ms = deadline_ms;
+    if (deadline_ms < previous_ms)
+    {
+        sift_up(scheduler, index);
+    }
+    else
+    {
+        sift_down(scheduler, index);
+    }
+}
+
+void deadline_scheduler_cancel(deadline_scheduler_t *scheduler, uint8_t job)
+{
+    if (job < DEADLINE_SCHEDULER_MAX_JOBS && scheduler->pos[job] != DEADLINE_SCHEDULER_NONE)
+    {
+        remove_at(scheduler, scheduler->pos[job]);
+    }
+}
+
+int64_t deadline_scheduler_get(const deadline_scheduler_t *scheduler, uint8_t job)
+{
+    if (job >= DEADLINE_SCHEDULER_MAX_JOBS || scheduler->pos[job] == DEADLINE_SCHEDULER_NONE)
+    {
+        return -1;
+    }
+    return scheduler->heap[scheduler->pos[job]].deadline_ms;
+}
+
+bool deadline_scheduler_peek(const deadline_scheduler_t *scheduler, uint8_t *job, int64_t *deadline_ms)
+{
+    if (scheduler->count == 0)
+    {
+        return false;
+    }
+    *job = scheduler->heap[0].job;
+    *deadline_ms = scheduler->heap[0].deadline_ms;
+    return true;
+}
+
+bool deadline_scheduler_pop_due(deadline_scheduler_t *scheduler, int64_t now_ms, uint8_t *job)
+{
+    if (scheduler->count == 0 || scheduler->heap[0].deadline_ms > now_ms)
+    {
+        return false;
+    }
+    *job = scheduler->heap[0].job;
+    remove_at(scheduler, 0);
+    return true;
+}
+
+void deadline_scheduler_shift(deadline_scheduler_t *scheduler, int64_t delta_ms)
+{
+    // The same offset everywhere keeps the heap order
+    for (uint8_t i = 0; i < scheduler->count; i++)
+    {
+        scheduler->heap[i].deadline_ms += delta_ms;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef DEADLINE_SCHEDULER_H
+#define DEADLINE_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Job IDs are 0 .. DEADLINE_SCHEDULER_MAX_JOBS - 1
+#define DEADLINE_SCHEDULER_MAX_JOBS 8
+
+typedef struct
+{
+    int64_t deadline_ms; // Absolute wall-clock time
+    uint8_t job;
+} deadline_entry_t;
+
+// Binary min-heap of absolute deadlines, at most one per job. The earliest
+// deadline is available in O(1); setting, moving, cancelling and popping a
+// deadline are O(log n). Nothing points outside the struct, so it can be kept
+// in RTC memory as-is and survives deep sleep as a single record. Not thread
+// safe; the caller serializes access.
+typedef struct
+{
+    uint32_t magic;
+    uint8_t count;
+    uint8_t pos[DEADLINE_SCHEDULER_MAX_JOBS]; // Heap index per job, DEADLINE_SCHEDULER_NONE if unscheduled
+    deadline_entry_t heap[DEADLINE_SCHEDULER_MAX_JOBS];
+} deadline_scheduler_t;
+
+#define DEADLINE_SCHEDULER_NONE 0xFF
+
+// Starts an empty schedule
+void deadline_scheduler_init(deadline_scheduler_t *scheduler);
+// False if the record was never initialized or is inconsistent (e.g. RTC
+// memory after a cold boot)
+bool deadline_scheduler_valid(const deadline_scheduler_t *scheduler);
+// Schedules `job`, replacing any pending deadline it has
+void deadline_scheduler_set(deadline_scheduler_t *scheduler, uint8_t job, int64_t deadline_ms);
+void deadline_scheduler_cancel(deadline_scheduler_t *scheduler, uint8_t job);
+// Pending deadline of `job`, or -1 if it is not scheduled
+int64_t deadline_scheduler_get(const deadline_scheduler_t *scheduler, uint8_t job);
+// Earliest deadline; false if nothing is scheduled
+bool deadline_scheduler_peek(const deadline_scheduler_t *scheduler, uint8_t *job, int64_t *deadline_ms);
+// Removes the earliest job if its deadline is at or before `now_ms`
+bool deadline_scheduler_pop_due(deadline_scheduler_t *scheduler, int64_t now_ms, uint8_t *job);
+// Moves every deadline by `delta_ms`, e.g. after the wall clock was stepped
+void deadline_scheduler_shift(deadline_scheduler_t *scheduler, int64_t delta_ms);
+
+#endif // DEADLINE_SCHEDULER_H
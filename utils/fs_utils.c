@@ -10,7 +10,11 @@
 #include <dirent.h>
 #include <cJSON.h>
 #include <time.h>
-#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
 #include <unistd.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
@@ -20,6 +24,9 @@ static const char *TAG = "fs_utils";
 static bool fs_mounted = false;
 static SemaphoreHandle_t s_spiffs_mutex = NULL;
 
+static void mqtt_log_migrate_legacy(void);
+static void mqtt_log_recover(fs_utils_mqtt_log_class_t log_class);
+
 esp_err_t fs_utils_init(void)
 {
     if (fs_mounted)
@@ -55,54 +62,985 @@ esp_err_t fs_utils_init(void)
     ret = esp_spiffs_info(conf.partition_label, &total, &used);
     if (ret != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
+        ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+    }
+
+    fs_mounted = true;
+
+    // Create SPIFFS mutex
+    if (s_spiffs_mutex == NULL)
+    {
+        s_spiffs_mutex = xSemaphoreCreateMutex();
+        if (s_spiffs_mutex == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to create SPIFFS mutex");
+            return ESP_FAIL;
+        }
+        ESP_LOGI(TAG, "SPIFFS mutex initialized");
+    }
+
+    mqtt_log_migrate_legacy();
+    for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
+    {
+        mqtt_log_recover(log_class);
+
+        // Primes the header cache, so later depth queries never open the journal
+        fs_utils_mqtt_log_stats_t stats;
+        if (fs_utils_get_mqtt_log_stats(log_class, &stats) == ESP_OK)
+        {
+            ESP_LOGI(TAG, "MQTT %s journal: %lu queued, %lu dropped, %lu compacted",
+                     log_class == FS_UTILS_MQTT_LOG_ALERT ? "alert" : "routine", (unsigned long)stats.depth,
+                     (unsigned long)stats.dropped, (unsigned long)stats.compacted);
+        }
+    }
+
+    ESP_LOGI(TAG, "SPIFFS initialized successfully");
+    return ESP_OK;
+}
+
+// MQTT log journal
+//
+// Messages queued while offline are kept in fixed-size rings of records,
+// preallocated behind a small header, one journal per priority class: alerts and
+// feed results, drained first, and routine samples. Enqueueing writes one record slot
+// plus the header, so the cost does not depend on how many messages are queued.
+// Before the ring fills up, the oldest records are compacted (see
+// mqtt_log_compact); only when that frees nothing is the oldest record
+// overwritten.
+//
+// Records are fixed-size binary telemetry (fs_utils_mqtt_log_entry_t), not JSON.
+// Version 1 journals stored the JSON payload text and are discarded on upgrade,
+// as are older binary layouts.
+//
+// The header also carries the queue statistics, and each journal's header is
+// cached in RAM, so depth and stats queries never touch the filesystem.
+//
+// Crash consistency: every record carries a CRC32, and the header is kept in two
+// slots written alternately, each with a generation counter and its own CRC. A
+// torn header write leaves the previous slot intact. A record is written before
+// the header that publishes it, so a record whose header update was lost is
+// found and adopted by the recovery scan at boot.
+#define MQTT_LOG_MAGIC 0x4A514D41 // "AMQJ"
+#define MQTT_LOG_VERSION 5
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t capacity;
+    uint32_t head;               // Slot the next record will be written to
+    uint32_t tail;               // Slot of the oldest queued record
+    uint32_t count;              // Number of queued records
+    uint32_t sequence;           // Sequence number assigned to the next record
+    uint32_t dropped;            // Records lost before they were sent
+    uint32_t compacted;          // Samples merged away into summaries
+    uint32_t generation;         // Incremented on every write; picks the newer slot
+    int64_t oldest_timestamp_ms; // Timestamp of the record in the tail slot, 0 if empty
+    int64_t newest_timestamp_ms; // Timestamp of the last record appended
+    uint32_t crc;                // CRC32 of every field above
+} mqtt_log_header_t;
+
+// On-flash form of fs_utils_mqtt_log_entry_t
+typedef struct
+{
+    int64_t timestamp_ms;
+    uint32_t sequence;
+    float value;
+    int16_t min_centi; // Summary min and max in hundredths, which covers temperature and pH
+    int16_t max_centi;
+    uint32_t span_s;
+    uint16_t code;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t crc; // CRC32 of every field above
+} mqtt_log_record_t;
+
+typedef struct
+{
+    const char *path;
+    uint16_t capacity;
+    mqtt_log_header_t header; // Copy of the header, kept in step with every write to it
+    bool cached;
+} mqtt_log_journal_t;
+
+static mqtt_log_journal_t s_journals[FS_UTILS_MQTT_LOG_CLASS_COUNT] = {
+    [FS_UTILS_MQTT_LOG_ALERT] = {.path = FS_MQTT_ALERT_LOG_FILE, .capacity = MAX_ALERT_LOG_MESSAGES},
+    [FS_UTILS_MQTT_LOG_ROUTINE] = {.path = FS_MQTT_LOG_FILE, .capacity = MAX_LOG_MESSAGES},
+};
+
+// Log event and value vocabularies. Codes are indexes into these tables, so
+// entries may only ever be appended.
+static const char *const s_log_events[] = {
+    "temp_below",
+    "temp_above",
+    "ph_below",
+    "ph_above",
+    "hardware_error",
+    "firmware_update",
+};
+
+static const char *const s_log_values[] = {
+    "temperature_read_failed",
+    "ph_read_failed",
+    "feed_failed",
+    "success",
+};
+
+#define LOG_EVENT_COUNT (sizeof(s_log_events) / sizeof(s_log_events[0]))
+#define LOG_VALUE_COUNT (sizeof(s_log_values) / sizeof(s_log_values[0]))
+
+static long mqtt_log_record_offset(uint32_t slot)
+{
+    return 2L * (long)sizeof(mqtt_log_header_t) + (long)slot * (long)sizeof(mqtt_log_record_t);
+}
+
+static uint32_t mqtt_log_header_crc(const mqtt_log_header_t *header)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)header, offsetof(mqtt_log_header_t, crc));
+}
+
+static uint32_t mqtt_log_record_crc(const mqtt_log_record_t *record)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)record, offsetof(mqtt_log_record_t, crc));
+}
+
+static bool mqtt_log_record_valid(const mqtt_log_record_t *record)
+{
+    return record->crc == mqtt_log_record_crc(record) && record->type < FS_UTILS_RECORD_TYPE_COUNT;
+}
+
+static bool mqtt_log_header_valid(const mqtt_log_header_t *header, uint16_t capacity)
+{
+    return header->magic == MQTT_LOG_MAGIC && header->version == MQTT_LOG_VERSION &&
+           header->crc == mqtt_log_header_crc(header) &&
+           header->capacity == capacity && header->head < header->capacity &&
+           header->tail < header->capacity && header->count <= header->capacity;
+}
+
+static int16_t mqtt_log_to_centi(float value)
+{
+    float centi = roundf(value * 100.0f);
+    if (centi > INT16_MAX)
+    {
+        return INT16_MAX;
+    }
+    if (centi < INT16_MIN)
+    {
+        return INT16_MIN;
+    }
+    return (int16_t)centi;
+}
+
+static void mqtt_log_record_from_entry(mqtt_log_record_t *record, const fs_utils_mqtt_log_entry_t *entry)
+{
+    memset(record, 0, sizeof(*record));
+    record->timestamp_ms = entry->timestamp_ms;
+    record->sequence = entry->sequence;
+    record->value = entry->value;
+    if (entry->flags & FS_UTILS_RECORD_FLAG_SUMMARY)
+    {
+        record->min_centi = mqtt_log_to_centi(entry->min);
+        record->max_centi = mqtt_log_to_centi(entry->max);
+        record->span_s = entry->span_s;
+    }
+    record->code = entry->code;
+    record->type = entry->type;
+    record->flags = entry->flags;
+    record->crc = mqtt_log_record_crc(record);
+}
+
+static void mqtt_log_entry_from_record(fs_utils_mqtt_log_entry_t *entry, const mqtt_log_record_t *record)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->timestamp_ms = record->timestamp_ms;
+    entry->sequence = record->sequence;
+    entry->value = record->value;
+    if (record->flags & FS_UTILS_RECORD_FLAG_SUMMARY)
+    {
+        entry->min = record->min_centi / 100.0f;
+        entry->max = record->max_centi / 100.0f;
+        entry->span_s = record->span_s;
+    }
+    entry->code = record->code;
+    entry->type = record->type;
+    entry->flags = record->flags;
+}
+
+// Reads both header slots and returns the newest valid one
+static esp_err_t mqtt_log_read_header(FILE *file, uint16_t capacity, mqtt_log_header_t *header)
+{
+    mqtt_log_header_t slots[2];
+    bool valid[2] = {false, false};
+    for (int i = 0; i < 2; i++)
+    {
+        if (fseek(file, (long)(i * sizeof(mqtt_log_header_t)), SEEK_SET) == 0 &&
+            fread(&slots[i], sizeof(slots[i]), 1, file) == 1)
+        {
+            valid[i] = mqtt_log_header_valid(&slots[i], capacity);
+        }
+    }
+
+    if (!valid[0] && !valid[1])
+    {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    int newest = !valid[0] ? 1 : !valid[1] ? 0
+                             : ((int32_t)(slots[1].generation - slots[0].generation) > 0 ? 1 : 0);
+    *header = slots[newest];
+    return ESP_OK;
+}
+
+// Writes the header into the slot not holding the current copy
+static esp_err_t mqtt_log_write_header(FILE *file, mqtt_log_header_t *header)
+{
+    header->generation++;
+    header->crc = mqtt_log_header_crc(header);
+
+    long offset = (long)((header->generation & 1) * sizeof(mqtt_log_header_t));
+    if (fseek(file, offset, SEEK_SET) != 0 || fwrite(header, sizeof(*header), 1, file) != 1)
+    {
+        return ESP_FAIL;
+    }
+    fflush(file);
+    return ESP_OK;
+}
+
+// Caller must hold the SPIFFS mutex.
+static void mqtt_log_cache_header(mqtt_log_journal_t *journal, const mqtt_log_header_t *header)
+{
+    journal->header = *header;
+    journal->cached = true;
+}
+
+static esp_err_t mqtt_log_create(const mqtt_log_journal_t *journal)
+{
+    FILE *file = fopen(journal->path, "wb");
+    if (file == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create MQTT log journal: %s", journal->path);
+        return ESP_FAIL;
+    }
+
+    // Preallocate both header slots and every record slot so appends never have
+    // to grow the file. Zeroed slots fail their CRC, so they read as empty.
+    esp_err_t err = ESP_OK;
+    mqtt_log_header_t blank_header = {0};
+    mqtt_log_record_t blank_record = {0};
+    for (int i = 0; err == ESP_OK && i < 2; i++)
+    {
+        if (fwrite(&blank_header, sizeof(blank_header), 1, file) != 1)
+        {
+            err = ESP_FAIL;
+        }
+    }
+    for (uint32_t i = 0; err == ESP_OK && i < journal->capacity; i++)
+    {
+        if (fwrite(&blank_record, sizeof(blank_record), 1, file) != 1)
+        {
+            err = ESP_FAIL;
+        }
+    }
+
+    // The header goes last, so a crash while creating leaves no valid journal
+    mqtt_log_header_t header = {
+        .magic = MQTT_LOG_MAGIC,
+        .version = MQTT_LOG_VERSION,
+        .capacity = journal->capacity,
+    };
+    if (err == ESP_OK)
+    {
+        err = mqtt_log_write_header(file, &header);
+    }
+    fclose(file);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to preallocate MQTT log journal: %s", journal->path);
+        remove(journal->path);
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Created MQTT log journal: %s (%u slots, %zu bytes)", journal->path, journal->capacity,
+             (size_t)mqtt_log_record_offset(journal->capacity));
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_log_read_record(FILE *file, uint32_t slot, mqtt_log_record_t *record)
+{
+    if (fseek(file, mqtt_log_record_offset(slot), SEEK_SET) != 0 ||
+        fread(record, sizeof(*record), 1, file) != 1)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Rebuilds a lost header from the records themselves: the newest intact record
+// and every slot behind it whose sequence still lines up. Damaged slots inside
+// that run are kept as holes for the cursor to skip. Records that had already
+// been sent may come back and be sent again.
+static void mqtt_log_rebuild_header(FILE *file, uint16_t capacity, mqtt_log_header_t *header)
+{
+    memset(header, 0, sizeof(*header));
+    header->magic = MQTT_LOG_MAGIC;
+    header->version = MQTT_LOG_VERSION;
+    header->capacity = capacity;
+
+    mqtt_log_record_t record;
+    bool found = false;
+    uint32_t newest_slot = 0;
+    for (uint32_t slot = 0; slot < header->capacity; slot++)
+    {
+        if (mqtt_log_read_record(file, slot, &record) == ESP_OK && mqtt_log_record_valid(&record) &&
+            (!found || (int32_t)(record.sequence - header->sequence) >= 0))
+        {
+            found = true;
+            newest_slot = slot;
+            header->sequence = record.sequence + 1;
+            header->newest_timestamp_ms = record.timestamp_ms;
+        }
+    }
+
+    if (!found)
+    {
+        return;
+    }
+
+    header->head = (newest_slot + 1) % header->capacity;
+    header->tail = newest_slot;
+    header->count = 1;
+    for (uint32_t back = 1; back < header->capacity; back++)
+    {
+        uint32_t slot = (newest_slot + header->capacity - back) % header->capacity;
+        if (mqtt_log_read_record(file, slot, &record) != ESP_OK)
+        {
+            break;
+        }
+        if (!mqtt_log_record_valid(&record))
+        {
+            continue;
+        }
+        if (record.sequence != header->sequence - 1 - back)
+        {
+            break;
+        }
+        header->tail = slot;
+        header->count = back + 1;
+    }
+
+    if (mqtt_log_read_record(file, header->tail, &record) == ESP_OK)
+    {
+        header->oldest_timestamp_ms = record.timestamp_ms;
+    }
+}
+
+// Opens the journal for reading and writing. If both header slots are unreadable
+// the header is rebuilt from the records; a missing or foreign file is recreated.
+// Caller must hold the SPIFFS mutex.
+static FILE *mqtt_log_open(mqtt_log_journal_t *journal, mqtt_log_header_t *header)
+{
+    FILE *file = fopen(journal->path, "r+b");
+    if (file != NULL)
+    {
+        esp_err_t err = mqtt_log_read_header(file, journal->capacity, header);
+        if (err != ESP_OK && fseek(file, 0, SEEK_END) == 0 &&
+            ftell(file) == mqtt_log_record_offset(journal->capacity))
+        {
+            // Same layout, so the records are still usable
+            ESP_LOGW(TAG, "MQTT log journal header unreadable, rebuilding from records: %s", journal->path);
+            mqtt_log_rebuild_header(file, journal->capacity, header);
+            err = mqtt_log_write_header(file, header);
+            ESP_LOGW(TAG, "Recovered %lu MQTT log entries", (unsigned long)header->count);
+        }
+        if (err == ESP_OK)
+        {
+            mqtt_log_cache_header(journal, header);
+            return file;
+        }
+        fclose(file);
+        ESP_LOGW(TAG, "MQTT log journal invalid (%s), recreating", esp_err_to_name(err));
+    }
+
+    if (mqtt_log_create(journal) != ESP_OK)
+    {
+        return NULL;
+    }
+
+    file = fopen(journal->path, "r+b");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    if (mqtt_log_read_header(file, journal->capacity, header) != ESP_OK)
+    {
+        fclose(file);
+        return NULL;
+    }
+    mqtt_log_cache_header(journal, header);
+    return file;
+}
+
+static uint32_t mqtt_log_oldest_sequence(const mqtt_log_header_t *header)
+{
+    return header->sequence - header->count;
+}
+
+// Updates oldest_timestamp_ms from the record now in the tail slot
+static void mqtt_log_refresh_oldest(FILE *file, mqtt_log_header_t *header)
+{
+    if (header->count == 0)
+    {
+        header->oldest_timestamp_ms = 0;
+        return;
+    }
+
+    mqtt_log_record_t record;
+    if (mqtt_log_read_record(file, header->tail, &record) == ESP_OK)
+    {
+        header->oldest_timestamp_ms = record.timestamp_ms;
+    }
+}
+
+// Advances the in-memory header over a record just written to the head slot,
+// overwriting the oldest record when the ring is full
+static void mqtt_log_advance(FILE *file, mqtt_log_header_t *header, const mqtt_log_record_t *record)
+{
+    bool overwrote = (header->count == header->capacity);
+    if (overwrote)
+    {
+        header->tail = (header->tail + 1) % header->capacity;
+        header->dropped++;
+        ESP_LOGW(TAG, "MQTT log full, dropped oldest entry");
+    }
+    else
+    {
+        header->count++;
+    }
+    header->head = (header->head + 1) % header->capacity;
+    header->sequence++;
+
+    header->newest_timestamp_ms = record->timestamp_ms;
+    if (header->count == 1)
+    {
+        header->oldest_timestamp_ms = record->timestamp_ms;
+    }
+    else if (overwrote)
+    {
+        mqtt_log_refresh_oldest(file, header);
+    }
+}
+
+static bool mqtt_log_is_sample(uint8_t type)
+{
+    return type == FS_UTILS_RECORD_TEMP || type == FS_UTILS_RECORD_PH;
+}
+
+#if CONFIG_MQTT_LOG_COMPACT_WINDOW > 0
+#define MQTT_LOG_COMPACT_WINDOW CONFIG_MQTT_LOG_COMPACT_WINDOW
+
+// Running summary of the temperature or pH samples being compacted
+typedef struct
+{
+    uint32_t samples;
+    double sum;
+    float min;
+    float max;
+    int64_t start_ms;
+    int64_t end_ms;
+} mqtt_log_bucket_t;
+
+static void mqtt_log_bucket_add(mqtt_log_bucket_t *bucket, const mqtt_log_record_t *record)
+{
+    bool summary = (record->flags & FS_UTILS_RECORD_FLAG_SUMMARY) != 0;
+    uint32_t samples = summary ? record->code : 1;
+    float min = summary ? record->min_centi / 100.0f : record->value;
+    float max = summary ? record->max_centi / 100.0f : record->value;
+    int64_t end_ms = record->timestamp_ms + (summary ? (int64_t)record->span_s * 1000 : 0);
+
+    if (bucket->samples == 0)
+    {
+        bucket->min = min;
+        bucket->max = max;
+        bucket->start_ms = record->timestamp_ms;
+        bucket->end_ms = end_ms;
+    }
+    else
+    {
+        bucket->min = min < bucket->min ? min : bucket->min;
+        bucket->max = max > bucket->max ? max : bucket->max;
+        bucket->start_ms = record->timestamp_ms < bucket->start_ms ? record->timestamp_ms : bucket->start_ms;
+        bucket->end_ms = end_ms > bucket->end_ms ? end_ms : bucket->end_ms;
+    }
+    bucket->samples += samples;
+    bucket->sum += (double)record->value * samples;
+}
+
+static void mqtt_log_record_from_bucket(mqtt_log_record_t *record, uint8_t type, const mqtt_log_bucket_t *bucket)
+{
+    memset(record, 0, sizeof(*record));
+    record->timestamp_ms = bucket->start_ms;
+    record->value = (float)(bucket->sum / bucket->samples);
+    record->min_centi = mqtt_log_to_centi(bucket->min);
+    record->max_centi = mqtt_log_to_centi(bucket->max);
+    record->span_s = (uint32_t)((bucket->end_ms - bucket->start_ms) / 1000);
+    // The count saturates; the mean of a saturated summary weighs later merges less
+    record->code = bucket->samples > UINT16_MAX ? UINT16_MAX : (uint16_t)bucket->samples;
+    record->type = type;
+    record->flags = FS_UTILS_RECORD_FLAG_SUMMARY;
+}
+
+// Compacts the oldest MQTT_LOG_COMPACT_WINDOW records. Raw temperature and pH
+// samples are merged into one summary per type (mean, min, max, count and time
+// span); log and feed records are carried over unchanged, so alerts and feeding
+// events are never lost to compaction. If the window has nothing left to merge
+// but earlier summaries, those are merged with each other instead, so the oldest
+// data keeps losing resolution rather than being dropped.
+//
+// The results, summaries first, replace the last records of the window in
+// place and keep those slots' sequence numbers, so the queue stays in time
+// order. The slots in front of them are released by the caller's header write,
+// which moves the tail. Until then the old header still describes the whole
+// window. Slots are rewritten from the head end: a carried record only ever
+// moves towards the head, so its copy is written before its original slot is
+// reused, and a crash part-way can send log and feed records twice but never
+// loses them. Raw samples in rewritten slots are only covered again once the
+// summaries, written last, are in place. Damaged records in the window are
+// discarded.
+static void mqtt_log_compact(FILE *file, mqtt_log_header_t *header)
+{
+    // Only used under the SPIFFS mutex
+    static mqtt_log_record_t window[MQTT_LOG_COMPACT_WINDOW];
+
+    uint32_t size = header->count < MQTT_LOG_COMPACT_WINDOW ? header->count : MQTT_LOG_COMPACT_WINDOW;
+    uint32_t oldest = mqtt_log_oldest_sequence(header);
+    uint32_t raw[FS_UTILS_RECORD_TYPE_COUNT] = {0};
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if (mqtt_log_read_record(file, (header->tail + i) % header->capacity, &window[i]) != ESP_OK)
+        {
+            return;
+        }
+        if (mqtt_log_record_valid(&window[i]) && window[i].sequence == oldest + i &&
+            mqtt_log_is_sample(window[i].type) && !(window[i].flags & FS_UTILS_RECORD_FLAG_SUMMARY))
+        {
+            raw[window[i].type]++;
+        }
+    }
+    bool merge_summaries = raw[FS_UTILS_RECORD_TEMP] < 2 && raw[FS_UTILS_RECORD_PH] < 2;
+
+    mqtt_log_bucket_t buckets[FS_UTILS_RECORD_TYPE_COUNT] = {0};
+    uint32_t summaries = 0;
+    uint32_t carried = 0;
+    uint32_t corrupt = 0;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        const mqtt_log_record_t *record = &window[i];
+        if (!mqtt_log_record_valid(record) || record->sequence != oldest + i)
+        {
+            corrupt++;
+        }
+        else if (mqtt_log_is_sample(record->type) &&
+                 (merge_summaries || !(record->flags & FS_UTILS_RECORD_FLAG_SUMMARY)))
+        {
+            mqtt_log_bucket_add(&buckets[record->type], record);
+        }
+        else
+        {
+            // In place: `carried` never passes i
+            window[carried++] = *record;
+        }
+    }
+    for (uint8_t type = 0; type < FS_UTILS_RECORD_TYPE_COUNT; type++)
+    {
+        if (buckets[type].samples > 0)
+        {
+            summaries++;
+        }
+    }
+
+    uint32_t kept = summaries + carried;
+    if (kept >= size)
+    {
+        return; // Nothing gained
+    }
+
+    // Summaries start at the oldest sample of the window, so they go in front
+    memmove(&window[summaries], &window[0], carried * sizeof(window[0]));
+    uint32_t index = 0;
+    for (uint8_t type = 0; type < FS_UTILS_RECORD_TYPE_COUNT; type++)
+    {
+        if (buckets[type].samples > 0)
+        {
+            mqtt_log_record_from_bucket(&window[index++], type, &buckets[type]);
+        }
+    }
+
+    uint32_t released = size - kept;
+    for (uint32_t i = kept; i-- > 0;)
+    {
+        uint32_t position = released + i;
+        window[i].sequence = oldest + position;
+        window[i].crc = mqtt_log_record_crc(&window[i]);
+        if (fseek(file, mqtt_log_record_offset((header->tail + position) % header->capacity), SEEK_SET) != 0 ||
+            fwrite(&window[i], sizeof(window[i]), 1, file) != 1)
+        {
+            // The header is untouched, so the window is still queued as it was
+            fflush(file);
+            return;
+        }
+    }
+    // The results must reach flash before the header that releases the window
+    fflush(file);
+
+    header->tail = (header->tail + released) % header->capacity;
+    header->count -= released;
+    header->dropped += corrupt;
+    header->compacted += size - corrupt - kept;
+    mqtt_log_refresh_oldest(file, header);
+    ESP_LOGI(TAG, "Compacted %lu oldest MQTT log entries into %lu%s", (unsigned long)size,
+             (unsigned long)kept, merge_summaries ? " (merged summaries)" : "");
+}
+#endif
+
+// Writes one record into the head slot and advances the in-memory header. The
+// caller persists the header, so a bulk append costs a single header write.
+static esp_err_t mqtt_log_append_record(FILE *file, mqtt_log_header_t *header, const fs_utils_mqtt_log_entry_t *entry)
+{
+#if CONFIG_MQTT_LOG_COMPACT_WINDOW > 0
+    // Compact before the ring has to overwrite its oldest record. Only the
+    // routine journal holds samples, so only a new sample triggers it.
+    if (mqtt_log_is_sample(entry->type) && header->capacity - header->count <= MQTT_LOG_COMPACT_WINDOW)
+    {
+        mqtt_log_compact(file, header);
+    }
+#endif
+
+    mqtt_log_record_t record;
+    fs_utils_mqtt_log_entry_t stamped = *entry;
+    stamped.sequence = header->sequence;
+    mqtt_log_record_from_entry(&record, &stamped);
+
+    if (fseek(file, mqtt_log_record_offset(header->head), SEEK_SET) != 0 ||
+        fwrite(&record, sizeof(record), 1, file) != 1)
+    {
+        return ESP_FAIL;
+    }
+    // The record must reach flash before the header that points past it
+    fflush(file);
+
+    mqtt_log_advance(file, header, &record);
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_log_append(FILE *file, mqtt_log_header_t *header, const fs_utils_mqtt_log_entry_t *entry)
+{
+    esp_err_t err = mqtt_log_append_record(file, header, entry);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    return mqtt_log_write_header(file, header);
+}
+
+// Boot-time consistency pass over the main journal. Adopts records that were
+// written but whose header update was lost, then counts queued records that fail
+// their CRC; the cursor skips those when draining.
+static void mqtt_log_recover(fs_utils_mqtt_log_class_t log_class)
+{
+    if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) != pdTRUE)
+    {
+        return;
+    }
+
+    mqtt_log_journal_t *journal = &s_journals[log_class];
+    mqtt_log_header_t header;
+    FILE *file = mqtt_log_open(journal, &header);
+    if (file == NULL)
+    {
+        xSemaphoreGive(s_spiffs_mutex);
+        return;
+    }
+
+    mqtt_log_record_t record;
+    uint32_t adopted = 0;
+    while (adopted < header.capacity &&
+           mqtt_log_read_record(file, header.head, &record) == ESP_OK &&
+           mqtt_log_record_valid(&record) && record.sequence == header.sequence)
+    {
+        mqtt_log_advance(file, &header, &record);
+        adopted++;
+    }
+
+    uint32_t corrupt = 0;
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        uint32_t expected = header.sequence - header.count + i;
+        if (mqtt_log_read_record(file, (header.tail + i) % header.capacity, &record) != ESP_OK ||
+            !mqtt_log_record_valid(&record) || record.sequence != expected)
+        {
+            corrupt++;
+        }
+    }
+
+    if (adopted > 0 && mqtt_log_write_header(file, &header) == ESP_OK)
+    {
+        mqtt_log_cache_header(journal, &header);
+    }
+    fclose(file);
+    xSemaphoreGive(s_spiffs_mutex);
+
+    if (adopted > 0 || corrupt > 0)
+    {
+        ESP_LOGW(TAG, "MQTT log recovery (%s): adopted %lu unpublished entries, %lu of %lu queued entries corrupt",
+                 journal->path, (unsigned long)adopted, (unsigned long)corrupt, (unsigned long)header.count);
+    }
+}
+
+esp_err_t fs_utils_make_log_record(fs_utils_mqtt_log_entry_t *entry, const char *event, const char *value)
+{
+    if (entry == NULL || event == NULL || value == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t event_id = 0;
+    while (event_id < LOG_EVENT_COUNT && strcmp(s_log_events[event_id], event) != 0)
+    {
+        event_id++;
+    }
+    if (event_id == LOG_EVENT_COUNT)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    entry->type = FS_UTILS_RECORD_LOG;
+    entry->flags = 0;
+    entry->value = 0.0f;
+    entry->code = (uint16_t)(event_id << 8);
+
+    size_t value_id = 0;
+    while (value_id < LOG_VALUE_COUNT && strcmp(s_log_values[value_id], value) != 0)
+    {
+        value_id++;
+    }
+    if (value_id < LOG_VALUE_COUNT)
+    {
+        entry->code |= (uint16_t)value_id;
+    }
+    else
+    {
+        entry->flags |= FS_UTILS_RECORD_FLAG_HAS_VALUE;
+        entry->value = strtof(value, NULL);
+    }
+    return ESP_OK;
+}
+
+const char *fs_utils_log_event_name(const fs_utils_mqtt_log_entry_t *entry)
+{
+    size_t event_id = entry->code >> 8;
+    return event_id < LOG_EVENT_COUNT ? s_log_events[event_id] : "unknown";
+}
+
+const char *fs_utils_log_value_name(const fs_utils_mqtt_log_entry_t *entry)
+{
+    size_t value_id = entry->code & 0xFF;
+    return value_id < LOG_VALUE_COUNT ? s_log_values[value_id] : "unknown";
+}
+
+// Converts one entry of the legacy JSON log ({topic, qos, payload}) to a record
+static bool mqtt_log_record_from_legacy(fs_utils_mqtt_log_entry_t *record, const cJSON *entry)
+{
+    cJSON *topic_item = cJSON_GetObjectItem(entry, "topic");
+    cJSON *payload_item = cJSON_GetObjectItem(entry, "payload");
+    if (!cJSON_IsString(topic_item) || !cJSON_IsObject(payload_item))
+    {
+        return false;
+    }
+
+    const char *suffix = strrchr(topic_item->valuestring, '/');
+    suffix = suffix != NULL ? suffix + 1 : topic_item->valuestring;
+    cJSON *event_item = cJSON_GetObjectItem(payload_item, "event");
+    cJSON *value_item = cJSON_GetObjectItem(payload_item, "value");
+    cJSON *timestamp_item = cJSON_GetObjectItem(payload_item, "timestamp");
+
+    memset(record, 0, sizeof(*record));
+    record->timestamp_ms = cJSON_IsNumber(timestamp_item) ? (int64_t)timestamp_item->valuedouble
+                                                          : (int64_t)time(NULL) * 1000;
+
+    if (strcmp(suffix, "temp") == 0 || strcmp(suffix, "ph") == 0)
+    {
+        if (!cJSON_IsNumber(value_item))
+        {
+            return false;
+        }
+        record->type = strcmp(suffix, "temp") == 0 ? FS_UTILS_RECORD_TEMP : FS_UTILS_RECORD_PH;
+        record->value = (float)value_item->valuedouble;
+        return true;
+    }
+    if (strcmp(suffix, "feed") == 0)
+    {
+        record->type = FS_UTILS_RECORD_FEED;
+        record->flags = cJSON_IsTrue(value_item) ? FS_UTILS_RECORD_FLAG_SUCCESS : 0;
+        return true;
+    }
+    if (strcmp(suffix, "log") == 0 && cJSON_IsString(event_item) && cJSON_IsString(value_item))
+    {
+        return fs_utils_make_log_record(record, event_item->valuestring, value_item->valuestring) == ESP_OK;
+    }
+    return false;
+}
+
+// Imports entries from the JSON log used by earlier firmware, then removes it
+static void mqtt_log_migrate_legacy(void)
+{
+    FILE *legacy = fopen(FS_MQTT_LEGACY_LOG_FILE, "r");
+    if (legacy == NULL)
+    {
+        return;
+    }
+
+    fseek(legacy, 0, SEEK_END);
+    long file_size = ftell(legacy);
+    fseek(legacy, 0, SEEK_SET);
+
+    char *buffer = file_size > 0 ? malloc(file_size + 1) : NULL;
+    size_t bytes_read = 0;
+    if (buffer != NULL)
+    {
+        bytes_read = fread(buffer, 1, file_size, legacy);
+        buffer[bytes_read] = '\0';
+    }
+    fclose(legacy);
+
+    cJSON *log_array = buffer != NULL ? cJSON_Parse(buffer) : NULL;
+    free(buffer);
+
+    int migrated = 0;
+    if (log_array != NULL && cJSON_IsArray(log_array))
+    {
+        mqtt_log_header_t headers[FS_UTILS_MQTT_LOG_CLASS_COUNT];
+        FILE *files[FS_UTILS_MQTT_LOG_CLASS_COUNT];
+        for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
+        {
+            files[log_class] = mqtt_log_open(&s_journals[log_class], &headers[log_class]);
+        }
+
+        cJSON *entry = NULL;
+        cJSON_ArrayForEach(entry, log_array)
+        {
+            fs_utils_mqtt_log_entry_t record;
+            if (!mqtt_log_record_from_legacy(&record, entry))
+            {
+                continue;
+            }
+
+            fs_utils_mqtt_log_class_t log_class = fs_utils_mqtt_log_class_of(&record);
+            if (files[log_class] != NULL &&
+                mqtt_log_append(files[log_class], &headers[log_class], &record) == ESP_OK)
+            {
+                migrated++;
+            }
+        }
+
+        for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
+        {
+            if (files[log_class] != NULL)
+            {
+                fclose(files[log_class]);
+                mqtt_log_cache_header(&s_journals[log_class], &headers[log_class]);
+            }
+        }
+    }
+    cJSON_Delete(log_array);
+
+    remove(FS_MQTT_LEGACY_LOG_FILE);
+    ESP_LOGI(TAG, "Migrated %d entries from legacy MQTT log", migrated);
+}
+
+fs_utils_mqtt_log_class_t fs_utils_mqtt_log_class_of(const fs_utils_mqtt_log_entry_t *entry)
+{
+    return mqtt_log_is_sample(entry->type) ? FS_UTILS_MQTT_LOG_ROUTINE : FS_UTILS_MQTT_LOG_ALERT;
+}
+
+esp_err_t fs_utils_save_mqtt_log(const fs_utils_mqtt_log_entry_t *entry)
+{
+    if (!fs_mounted)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (entry == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (s_spiffs_mutex == NULL)
+    {
+        ESP_LOGE(TAG, "SPIFFS mutex not initialized");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) != pdTRUE)
+    {
+        ESP_LOGE(TAG, "Failed to acquire SPIFFS mutex");
+        return ESP_FAIL;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+
+    mqtt_log_journal_t *journal = &s_journals[fs_utils_mqtt_log_class_of(entry)];
+    mqtt_log_header_t header;
+    FILE *file = mqtt_log_open(journal, &header);
+    if (file == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open MQTT log journal");
+        xSemaphoreGive(s_spiffs_mutex);
+        return ESP_FAIL;
     }
-    else
+
+    esp_err_t err = mqtt_log_append(file, &header, entry);
+    fclose(file);
+    if (err == ESP_OK)
     {
-        ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+        mqtt_log_cache_header(journal, &header);
     }
 
-    fs_mounted = true;
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    xSemaphoreGive(s_spiffs_mutex);
 
-    // Create SPIFFS mutex
-    if (s_spiffs_mutex == NULL)
+    if (err != ESP_OK)
     {
-        s_spiffs_mutex = xSemaphoreCreateMutex();
-        if (s_spiffs_mutex == NULL)
-        {
-            ESP_LOGE(TAG, "Failed to create SPIFFS mutex");
-            return ESP_FAIL;
-        }
-        ESP_LOGI(TAG, "SPIFFS mutex initialized");
+        ESP_LOGE(TAG, "Failed to append MQTT log entry: type=%u", entry->type);
+        return err;
     }
 
-    ESP_LOGI(TAG, "SPIFFS initialized successfully");
+    ESP_LOGI(TAG, "Saved MQTT log entry: type=%u, seq=%lu, depth=%lu, took %lld us",
+             entry->type, (unsigned long)(header.sequence - 1), (unsigned long)header.count, (long long)elapsed_us);
     return ESP_OK;
 }
 
-static void generate_id(char *id, size_t id_size)
+esp_err_t fs_utils_save_mqtt_logs(const fs_utils_mqtt_log_entry_t *entries, size_t count, size_t *saved)
 {
-    uint32_t random_bytes[4];
-    for (int i = 0; i < 4; i++)
+    if (saved != NULL)
     {
-        random_bytes[i] = esp_random();
+        *saved = 0;
     }
-    snprintf(id, id_size, "%08lx-%04lx-%04lx-%04lx-%08lx%04lx",
-             (unsigned long)random_bytes[0],
-             (unsigned long)((random_bytes[1] >> 16) & 0xFFFF),
-             (unsigned long)(random_bytes[1] & 0xFFFF),
-             (unsigned long)((random_bytes[2] >> 16) & 0xFFFF),
-             (unsigned long)(random_bytes[2] & 0xFFFF),
-             (unsigned long)(random_bytes[3] & 0xFFFF));
-}
 
-esp_err_t fs_utils_save_mqtt_log(const char *topic, int qos, const char *payload, char *log_id, size_t log_id_size)
-{
     if (!fs_mounted)
     {
         return ESP_ERR_INVALID_STATE;
     }
 
+    if (entries == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
     if (s_spiffs_mutex == NULL)
     {
         ESP_LOGE(TAG, "SPIFFS mutex not initialized");
@@ -115,100 +1053,89 @@ esp_err_t fs_utils_save_mqtt_log(const char *topic, int qos, const char *payload
         return ESP_FAIL;
     }
 
-    // Load existing logs
-    cJSON *log_array = cJSON_CreateArray();
-    FILE *file = fopen(FS_MQTT_LOG_FILE, "r");
-    if (file != NULL)
-    {
-        fseek(file, 0, SEEK_END);
-        long file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
+    int64_t start_us = esp_timer_get_time();
 
-        if (file_size > 0)
+    // Each journal is opened on its first entry and gets one header write
+    mqtt_log_header_t headers[FS_UTILS_MQTT_LOG_CLASS_COUNT];
+    FILE *files[FS_UTILS_MQTT_LOG_CLASS_COUNT] = {NULL};
+    esp_err_t err = ESP_OK;
+    size_t appended = 0;
+    for (; appended < count; appended++)
+    {
+        fs_utils_mqtt_log_class_t log_class = fs_utils_mqtt_log_class_of(&entries[appended]);
+        if (files[log_class] == NULL)
         {
-            char *buffer = malloc(file_size + 1);
-            if (buffer != NULL)
+            files[log_class] = mqtt_log_open(&s_journals[log_class], &headers[log_class]);
+            if (files[log_class] == NULL)
             {
-                fread(buffer, 1, file_size, file);
-                buffer[file_size] = '\0';
-                cJSON *existing = cJSON_Parse(buffer);
-                if (existing != NULL && cJSON_IsArray(existing))
-                {
-                    cJSON_Delete(log_array);
-                    log_array = existing;
-                }
-                else if (existing != NULL)
-                {
-                    cJSON_Delete(existing);
-                }
-                free(buffer);
+                ESP_LOGE(TAG, "Failed to open MQTT log journal");
+                err = ESP_FAIL;
+                break;
             }
         }
-        fclose(file);
-    }
-
-    cJSON *payload_json = cJSON_Parse(payload);
-    if (payload_json == NULL)
-    {
-        ESP_LOGE(TAG, "Failed to parse payload JSON");
-        payload_json = cJSON_CreateString(payload);
-    }
-
-    cJSON *entry = cJSON_CreateObject();
-    // ID removed - logs are cleared on boot anyway
-
-    cJSON_AddStringToObject(entry, "topic", topic);
-    cJSON_AddNumberToObject(entry, "qos", qos);
-    cJSON_AddItemToObject(entry, "payload", payload_json);
 
-    cJSON_AddItemToArray(log_array, entry);
-
-    int array_size = cJSON_GetArraySize(log_array);
-    if (array_size > MAX_LOG_MESSAGES)
-    {
-        int to_remove = array_size - MAX_LOG_MESSAGES;
-        for (int i = 0; i < to_remove; i++)
+        err = mqtt_log_append_record(files[log_class], &headers[log_class], &entries[appended]);
+        if (err != ESP_OK)
         {
-            cJSON_DeleteItemFromArray(log_array, 0);
+            break;
         }
     }
 
-    // Save to file
-    file = fopen(FS_MQTT_LOG_FILE, "w");
-    if (file == NULL)
+    // Records past the header's head are ignored, so a failed header write
+    // leaves the whole batch reported unsaved. Entries that did reach the
+    // other journal may then be queued twice.
+    uint32_t depth = 0;
+    for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
     {
-        ESP_LOGE(TAG, "Failed to open log file for writing");
-        cJSON_Delete(log_array);
-        if (payload_json != NULL)
+        if (files[log_class] == NULL)
         {
-            cJSON_Delete(payload_json);
+            continue;
         }
-        xSemaphoreGive(s_spiffs_mutex);
-        return ESP_FAIL;
+        if (mqtt_log_write_header(files[log_class], &headers[log_class]) == ESP_OK)
+        {
+            mqtt_log_cache_header(&s_journals[log_class], &headers[log_class]);
+            depth += headers[log_class].count;
+        }
+        else
+        {
+            err = ESP_FAIL;
+            appended = 0;
+        }
+        fclose(files[log_class]);
     }
 
-    char *json_string = cJSON_Print(log_array);
-    if (json_string != NULL)
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    xSemaphoreGive(s_spiffs_mutex);
+
+    if (saved != NULL)
     {
-        fprintf(file, "%s", json_string);
-        fflush(file); // Ensure data is written to filesystem before closing
-        free(json_string);
+        *saved = appended;
     }
-    fclose(file);
 
-    // payload_json is now owned by the entry, don't delete it here
-    cJSON_Delete(log_array);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to append MQTT log entries, saved %zu of %zu", appended, count);
+        return err;
+    }
 
-    ESP_LOGI(TAG, "Saved MQTT log entry: topic=%s", topic);
-    xSemaphoreGive(s_spiffs_mutex);
+    ESP_LOGI(TAG, "Saved %zu MQTT log entries, depth=%lu, took %lld us",
+             appended, (unsigned long)depth, (long long)elapsed_us);
     return ESP_OK;
 }
 
-esp_err_t fs_utils_load_mqtt_logs(char **topics, int **qos, char **payloads, time_t **timestamps, char ***log_ids, size_t *count)
+// Maps a sequence number to its slot. Only valid for records still in the ring.
+static uint32_t mqtt_log_slot_of(const mqtt_log_header_t *header, uint32_t sequence)
+{
+    uint32_t back = header->sequence - sequence;
+    return (header->head + header->capacity - back) % header->capacity;
+}
+
+esp_err_t fs_utils_mqtt_log_open(fs_utils_mqtt_log_cursor_t *cursor, fs_utils_mqtt_log_class_t log_class)
 {
-    size_t free_heap_before = esp_get_free_heap_size();
-    size_t largest_block_before = heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
-    ESP_LOGI(TAG, "Loading MQTT logs - free heap: %zu bytes, largest block: %zu bytes", free_heap_before, largest_block_before);
+    if (cursor == NULL || log_class >= FS_UTILS_MQTT_LOG_CLASS_COUNT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
 
     if (!fs_mounted)
     {
@@ -228,435 +1155,370 @@ esp_err_t fs_utils_load_mqtt_logs(char **topics, int **qos, char **payloads, tim
         return ESP_FAIL;
     }
 
-    *count = 0;
-    FILE *file = fopen(FS_MQTT_LOG_FILE, "r");
+    memset(cursor, 0, sizeof(*cursor));
+
+    mqtt_log_header_t header;
+    FILE *file = mqtt_log_open(&s_journals[log_class], &header);
     if (file == NULL)
     {
-        ESP_LOGI(TAG, "MQTT log file not found");
         xSemaphoreGive(s_spiffs_mutex);
-        return ESP_ERR_NOT_FOUND;
+        return ESP_FAIL;
     }
 
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    ESP_LOGI(TAG, "MQTT log file size: %ld bytes", file_size);
-
-    if (file_size == 0)
+    if (header.count == 0)
     {
-        ESP_LOGI(TAG, "MQTT log file is empty");
         fclose(file);
         xSemaphoreGive(s_spiffs_mutex);
         return ESP_ERR_NOT_FOUND;
     }
 
-    size_t free_heap_before_buffer = esp_get_free_heap_size();
-    ESP_LOGI(TAG, "Allocating buffer for file content: %ld bytes (free heap: %zu)", file_size + 1, free_heap_before_buffer);
+    cursor->file = file;
+    cursor->log_class = log_class;
+    cursor->next_sequence = mqtt_log_oldest_sequence(&header);
+    cursor->committed_sequence = cursor->next_sequence;
+    cursor->remaining = header.count;
+
+    xSemaphoreGive(s_spiffs_mutex);
+    return ESP_OK;
+}
 
-    char *buffer = malloc(file_size + 1);
-    if (buffer == NULL)
+esp_err_t fs_utils_mqtt_log_next(fs_utils_mqtt_log_cursor_t *cursor, fs_utils_mqtt_log_entry_t *entry)
+{
+    if (cursor == NULL || cursor->file == NULL || entry == NULL)
     {
-        ESP_LOGE(TAG, "Failed to allocate buffer: %ld bytes (free heap: %zu)", file_size + 1, free_heap_before_buffer);
-        fclose(file);
-        xSemaphoreGive(s_spiffs_mutex);
-        return ESP_ERR_NO_MEM;
+        return ESP_ERR_INVALID_ARG;
     }
 
-    size_t bytes_read = fread(buffer, 1, file_size, file);
-    fclose(file);
-
-    if (bytes_read != (size_t)file_size)
+    if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) != pdTRUE)
     {
-        ESP_LOGW(TAG, "Failed to read complete file: expected %ld bytes, read %zu bytes", file_size, bytes_read);
-        free(buffer);
-        xSemaphoreGive(s_spiffs_mutex);
-        return ESP_ERR_INVALID_RESPONSE;
+        ESP_LOGE(TAG, "Failed to acquire SPIFFS mutex");
+        return ESP_FAIL;
     }
 
-    buffer[file_size] = '\0';
-
-    ESP_LOGI(TAG, "Parsing JSON from buffer (%ld bytes)", file_size);
-    cJSON *log_array = cJSON_Parse(buffer);
-    const char *error_ptr = cJSON_GetErrorPtr();
-
-    if (log_array == NULL)
+    // Check the header every step: records may be appended, or the oldest ones
+    // overwritten, while the queue is being drained. The cached copy is current.
+    const mqtt_log_journal_t *journal = &s_journals[cursor->log_class];
+    mqtt_log_header_t header = journal->header;
+    esp_err_t err = journal->cached ? ESP_OK : mqtt_log_read_header(cursor->file, journal->capacity, &header);
+    if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to parse JSON from log file. Error at: %s", error_ptr ? error_ptr : "unknown");
-        // Log first 200 chars of buffer for debugging
-        size_t log_len = file_size > 200 ? 200 : file_size;
-        char log_buf[201];
-        memcpy(log_buf, buffer, log_len);
-        log_buf[log_len] = '\0';
-        ESP_LOGE(TAG, "File content (first %zu chars): %s", log_len, log_buf);
-        ESP_LOGW(TAG, "Clearing corrupted log file and starting fresh");
-        free(buffer);
         xSemaphoreGive(s_spiffs_mutex);
-        // Clear the corrupted file (will acquire mutex internally)
-        fs_utils_clear_mqtt_logs();
-        return ESP_ERR_INVALID_RESPONSE;
+        return err;
     }
 
-    if (!cJSON_IsArray(log_array))
+    uint32_t oldest = mqtt_log_oldest_sequence(&header);
+    if ((int32_t)(cursor->next_sequence - oldest) < 0)
     {
-        ESP_LOGE(TAG, "Parsed JSON is not an array");
-        cJSON_Delete(log_array);
-        free(buffer);
-        ESP_LOGW(TAG, "Clearing corrupted log file and starting fresh");
-        xSemaphoreGive(s_spiffs_mutex);
-        // Clear the corrupted file (will acquire mutex internally)
-        fs_utils_clear_mqtt_logs();
-        return ESP_ERR_INVALID_RESPONSE;
+        ESP_LOGW(TAG, "Cursor fell behind the MQTT log, skipped %lu overwritten or compacted entries",
+                 (unsigned long)(oldest - cursor->next_sequence));
+        cursor->next_sequence = oldest;
     }
 
-    free(buffer);
-    size_t free_heap_after_buffer = esp_get_free_heap_size();
-    ESP_LOGI(TAG, "Buffer freed, free heap: %zu bytes", free_heap_after_buffer);
-
-    int array_size = cJSON_GetArraySize(log_array);
-    ESP_LOGI(TAG, "Found %d log entries in JSON array", array_size);
+    // Damaged records are skipped rather than blocking the rest of the queue;
+    // they are removed with the next commit past them
+    mqtt_log_record_t record;
+    while (cursor->next_sequence != header.sequence)
+    {
+        err = mqtt_log_read_record(cursor->file, mqtt_log_slot_of(&header, cursor->next_sequence), &record);
+        if (err == ESP_OK && mqtt_log_record_valid(&record) && record.sequence == cursor->next_sequence)
+        {
+            break;
+        }
+        ESP_LOGW(TAG, "Skipping corrupt MQTT log entry seq=%lu", (unsigned long)cursor->next_sequence);
+        cursor->next_sequence++;
+    }
+    xSemaphoreGive(s_spiffs_mutex);
 
-    if (array_size == 0)
+    if (cursor->next_sequence == header.sequence)
     {
-        ESP_LOGI(TAG, "No log entries found");
-        cJSON_Delete(log_array);
-        xSemaphoreGive(s_spiffs_mutex);
+        cursor->remaining = 0;
         return ESP_ERR_NOT_FOUND;
     }
 
-    // Limit to maximum 10 entries at a time to prevent memory issues
-    // #define MAX_ENTRIES_TO_LOAD 10
-    //     if (array_size > MAX_ENTRIES_TO_LOAD)
-    //     {
-    //         ESP_LOGW(TAG, "Limiting entries from %d to %d to prevent memory issues", array_size, MAX_ENTRIES_TO_LOAD);
-    //         array_size = MAX_ENTRIES_TO_LOAD;
-    //     }
-
-#define TOPIC_SIZE FS_UTILS_TOPIC_SIZE
-#define PAYLOAD_SIZE FS_UTILS_PAYLOAD_SIZE
-
-    // Calculate memory needed
-    size_t topics_size = array_size * TOPIC_SIZE;
-    size_t qos_size = array_size * sizeof(int);
-    size_t payloads_size = array_size * PAYLOAD_SIZE;
-    size_t timestamps_size = array_size * sizeof(time_t);
-    size_t total_needed = topics_size + qos_size + payloads_size + timestamps_size;
+    mqtt_log_entry_from_record(entry, &record);
 
-    size_t free_heap_before_alloc = esp_get_free_heap_size();
-    ESP_LOGI(TAG, "Allocating arrays for %d entries:", array_size);
-    ESP_LOGI(TAG, "  - topics: %zu bytes (%d * %d)", topics_size, array_size, TOPIC_SIZE);
-    ESP_LOGI(TAG, "  - qos: %zu bytes (%d * %zu)", qos_size, array_size, sizeof(int));
-    ESP_LOGI(TAG, "  - payloads: %zu bytes (%d * %d)", payloads_size, array_size, PAYLOAD_SIZE);
-    ESP_LOGI(TAG, "  - timestamps: %zu bytes (%d * %zu)", timestamps_size, array_size, sizeof(time_t));
-    ESP_LOGI(TAG, "  - Total needed: %zu bytes", total_needed);
-    ESP_LOGI(TAG, "  - Free heap before allocation: %zu bytes", free_heap_before_alloc);
-
-    // Allocate arrays (ID removed - not needed since logs are cleared on boot)
-    *topics = malloc(topics_size);
-    if (*topics == NULL)
-    {
-        ESP_LOGE(TAG, "Failed to allocate topics array: %zu bytes", topics_size);
-    }
-    else
-    {
-        ESP_LOGI(TAG, "Allocated topics array: %zu bytes", topics_size);
-    }
+    cursor->next_sequence++;
+    cursor->remaining = header.sequence - cursor->next_sequence;
+    return ESP_OK;
+}
 
-    *qos = malloc(qos_size);
-    if (*qos == NULL)
-    {
-        ESP_LOGE(TAG, "Failed to allocate qos array: %zu bytes", qos_size);
-    }
-    else
+// Removes every queued entry with a sequence number below the given one.
+// Caller must hold the SPIFFS mutex.
+static esp_err_t mqtt_log_commit_until(mqtt_log_journal_t *journal, uint32_t sequence)
+{
+    mqtt_log_header_t header;
+    FILE *file = mqtt_log_open(journal, &header);
+    if (file == NULL)
     {
-        ESP_LOGI(TAG, "Allocated qos array: %zu bytes", qos_size);
+        return ESP_FAIL;
     }
 
-    *payloads = malloc(payloads_size);
-    if (*payloads == NULL)
+    esp_err_t err = ESP_OK;
+    uint32_t oldest = mqtt_log_oldest_sequence(&header);
+    if ((int32_t)(sequence - header.sequence) > 0)
     {
-        ESP_LOGE(TAG, "Failed to allocate payloads array: %zu bytes", payloads_size);
+        sequence = header.sequence;
     }
-    else
+    if ((int32_t)(sequence - oldest) > 0)
     {
-        ESP_LOGI(TAG, "Allocated payloads array: %zu bytes", payloads_size);
+        uint32_t drop = sequence - oldest;
+        header.tail = (header.tail + drop) % header.capacity;
+        header.count -= drop;
+        mqtt_log_refresh_oldest(file, &header);
+        err = mqtt_log_write_header(file, &header);
+        if (err == ESP_OK)
+        {
+            mqtt_log_cache_header(journal, &header);
+        }
+        ESP_LOGI(TAG, "Committed %lu MQTT log entries, %lu left", (unsigned long)drop, (unsigned long)header.count);
     }
+    fclose(file);
+    return err;
+}
 
-    *timestamps = malloc(timestamps_size);
-    if (*timestamps == NULL)
-    {
-        ESP_LOGE(TAG, "Failed to allocate timestamps array: %zu bytes", timestamps_size);
-    }
-    else
+esp_err_t fs_utils_mqtt_log_commit_until(fs_utils_mqtt_log_class_t log_class, uint32_t sequence)
+{
+    if (log_class >= FS_UTILS_MQTT_LOG_CLASS_COUNT)
     {
-        ESP_LOGI(TAG, "Allocated timestamps array: %zu bytes", timestamps_size);
+        return ESP_ERR_INVALID_ARG;
     }
 
-    *log_ids = NULL; // Not used anymore
-
-    if (*topics == NULL || *qos == NULL || *payloads == NULL || *timestamps == NULL)
+    if (!fs_mounted || s_spiffs_mutex == NULL)
     {
-        ESP_LOGE(TAG, "One or more allocations failed - cleaning up");
-        free(*topics);
-        free(*qos);
-        free(*payloads);
-        free(*timestamps);
-        cJSON_Delete(log_array);
-        xSemaphoreGive(s_spiffs_mutex);
-        size_t free_heap_after_fail = esp_get_free_heap_size();
-        ESP_LOGE(TAG, "Free heap after cleanup: %zu bytes", free_heap_after_fail);
-        return ESP_ERR_NO_MEM;
+        return ESP_ERR_INVALID_STATE;
     }
 
-    size_t free_heap_after_alloc = esp_get_free_heap_size();
-    ESP_LOGI(TAG, "All arrays allocated successfully. Free heap after allocation: %zu bytes (used: %zu bytes)",
-             free_heap_after_alloc, free_heap_before_alloc - free_heap_after_alloc);
-
-    // Parse entries
-    ESP_LOGI(TAG, "Parsing %d log entries", array_size);
-    for (int i = 0; i < array_size; i++)
+    if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) != pdTRUE)
     {
-        cJSON *entry = cJSON_GetArrayItem(log_array, i);
-        if (entry == NULL)
-        {
-            ESP_LOGW(TAG, "Entry %d is NULL, skipping", i);
-            continue;
-        }
-
-        cJSON *ts_item = cJSON_GetObjectItem(entry, "ts");
-        cJSON *topic_item = cJSON_GetObjectItem(entry, "topic");
-        cJSON *qos_item = cJSON_GetObjectItem(entry, "qos");
-        cJSON *payload_item = cJSON_GetObjectItem(entry, "payload");
-        // ID field removed - not needed since logs are cleared on boot
-
-        if (topic_item != NULL && cJSON_IsString(topic_item))
-        {
-            strncpy(*topics + i * TOPIC_SIZE, topic_item->valuestring, TOPIC_SIZE - 1);
-            (*topics)[i * TOPIC_SIZE + TOPIC_SIZE - 1] = '\0';
-        }
-        if (qos_item != NULL && cJSON_IsNumber(qos_item))
-        {
-            (*qos)[i] = qos_item->valueint;
-        }
-        if (ts_item != NULL && cJSON_IsNumber(ts_item))
-        {
-            (*timestamps)[i] = (time_t)ts_item->valuedouble;
-        }
-        if (payload_item != NULL)
-        {
-            // Payload is stored directly as JSON, just print it
-            char *payload_str = cJSON_Print(payload_item);
-            if (payload_str != NULL)
-            {
-                size_t payload_len = strlen(payload_str);
-                if (payload_len >= PAYLOAD_SIZE)
-                {
-                    ESP_LOGW(TAG, "Entry %d payload too long (%zu bytes), truncating to %d", i, payload_len, PAYLOAD_SIZE - 1);
-                }
-                strncpy(*payloads + i * PAYLOAD_SIZE, payload_str, PAYLOAD_SIZE - 1);
-                (*payloads)[i * PAYLOAD_SIZE + PAYLOAD_SIZE - 1] = '\0';
-                free(payload_str);
-            }
-            else
-            {
-                ESP_LOGW(TAG, "Failed to print payload for entry %d", i);
-            }
-        }
+        ESP_LOGE(TAG, "Failed to acquire SPIFFS mutex");
+        return ESP_FAIL;
     }
 
-    *count = array_size;
-    cJSON_Delete(log_array);
+    esp_err_t err = mqtt_log_commit_until(&s_journals[log_class], sequence);
     xSemaphoreGive(s_spiffs_mutex);
-
-    size_t free_heap_final = esp_get_free_heap_size();
-    ESP_LOGI(TAG, "Successfully loaded %zu MQTT log entries. Free heap: %zu bytes (started with %zu, used %zu)",
-             *count, free_heap_final, free_heap_before, free_heap_before - free_heap_final);
-    return ESP_OK;
+    return err;
 }
 
-esp_err_t fs_utils_remove_mqtt_log(const char *id)
+esp_err_t fs_utils_mqtt_log_commit(fs_utils_mqtt_log_cursor_t *cursor)
 {
-    if (!fs_mounted || id == NULL)
+    if (cursor == NULL || cursor->file == NULL)
     {
         return ESP_ERR_INVALID_ARG;
     }
 
-    if (s_spiffs_mutex == NULL)
-    {
-        ESP_LOGE(TAG, "SPIFFS mutex not initialized");
-        return ESP_ERR_INVALID_STATE;
-    }
-
     if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) != pdTRUE)
     {
         ESP_LOGE(TAG, "Failed to acquire SPIFFS mutex");
         return ESP_FAIL;
     }
 
-    FILE *file = fopen(FS_MQTT_LOG_FILE, "r");
-    if (file == NULL)
+    esp_err_t err = mqtt_log_commit_until(&s_journals[cursor->log_class], cursor->next_sequence);
+    if (err == ESP_OK)
     {
-        return ESP_ERR_NOT_FOUND;
+        cursor->committed_sequence = cursor->next_sequence;
     }
 
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    xSemaphoreGive(s_spiffs_mutex);
+    return err;
+}
 
-    if (file_size == 0)
+void fs_utils_mqtt_log_close(fs_utils_mqtt_log_cursor_t *cursor)
+{
+    if (cursor == NULL || cursor->file == NULL)
     {
-        fclose(file);
-        return ESP_ERR_NOT_FOUND;
+        return;
     }
 
-    char *buffer = malloc(file_size + 1);
-    if (buffer == NULL)
+    if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) == pdTRUE)
     {
-        fclose(file);
-        return ESP_ERR_NO_MEM;
+        fclose(cursor->file);
+        xSemaphoreGive(s_spiffs_mutex);
     }
+    cursor->file = NULL;
+}
 
-    fread(buffer, 1, file_size, file);
-    buffer[file_size] = '\0';
-    fclose(file);
+esp_err_t fs_utils_clear_mqtt_logs(void)
+{
+    if (!fs_mounted)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
 
-    cJSON *log_array = cJSON_Parse(buffer);
-    free(buffer);
+    if (s_spiffs_mutex == NULL)
+    {
+        ESP_LOGE(TAG, "SPIFFS mutex not initialized");
+        return ESP_ERR_INVALID_STATE;
+    }
 
-    if (log_array == NULL || !cJSON_IsArray(log_array))
+    if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) != pdTRUE)
     {
-        if (log_array != NULL)
-        {
-            cJSON_Delete(log_array);
-        }
-        return ESP_ERR_INVALID_RESPONSE;
+        ESP_LOGE(TAG, "Failed to acquire SPIFFS mutex");
+        return ESP_FAIL;
     }
 
-    // Find and remove entry with matching ID
-    int array_size = cJSON_GetArraySize(log_array);
-    bool found = false;
-    for (int i = 0; i < array_size; i++)
+    // Keep the preallocated files and sequence counters, just drop every queued record
+    esp_err_t err = ESP_OK;
+    for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
     {
-        cJSON *entry = cJSON_GetArrayItem(log_array, i);
-        if (entry == NULL)
+        mqtt_log_header_t header;
+        FILE *file = mqtt_log_open(&s_journals[log_class], &header);
+        if (file == NULL)
         {
+            err = ESP_FAIL;
             continue;
         }
 
-        cJSON *id_item = cJSON_GetObjectItem(entry, "id");
-        if (id_item != NULL && cJSON_IsString(id_item) && strcmp(id_item->valuestring, id) == 0)
+        header.tail = header.head;
+        header.count = 0;
+        header.oldest_timestamp_ms = 0;
+        if (mqtt_log_write_header(file, &header) == ESP_OK)
         {
-            cJSON_DeleteItemFromArray(log_array, i);
-            found = true;
-            ESP_LOGI(TAG, "Removed log entry with id: %s", id);
-            break;
+            mqtt_log_cache_header(&s_journals[log_class], &header);
+        }
+        else
+        {
+            err = ESP_FAIL;
         }
+        fclose(file);
     }
 
-    if (!found)
+    xSemaphoreGive(s_spiffs_mutex);
+    return err;
+}
+
+// Loads a journal header into the cache if it is not there yet.
+// Caller must hold the SPIFFS mutex.
+static esp_err_t mqtt_log_load_header(mqtt_log_journal_t *journal)
+{
+    if (journal->cached)
     {
-        ESP_LOGW(TAG, "Log entry with id '%s' not found in file (array_size=%d)", id, array_size);
+        return ESP_OK;
     }
 
-    // Save back to file
-    file = fopen(FS_MQTT_LOG_FILE, "w");
+    mqtt_log_header_t header;
+    FILE *file = mqtt_log_open(journal, &header);
     if (file == NULL)
     {
-        cJSON_Delete(log_array);
-        xSemaphoreGive(s_spiffs_mutex);
         return ESP_FAIL;
     }
-
-    char *json_string = cJSON_Print(log_array);
-    if (json_string != NULL)
-    {
-        fprintf(file, "%s", json_string);
-        free(json_string);
-    }
     fclose(file);
-
-    cJSON_Delete(log_array);
-    xSemaphoreGive(s_spiffs_mutex);
     return ESP_OK;
 }
 
-esp_err_t fs_utils_clear_mqtt_logs(void)
+size_t fs_utils_get_mqtt_log_count(void)
 {
-    if (!fs_mounted)
+    size_t count = 0;
+    for (int log_class = 0; log_class < FS_UTILS_MQTT_LOG_CLASS_COUNT; log_class++)
     {
-        return ESP_ERR_INVALID_STATE;
+        fs_utils_mqtt_log_stats_t stats;
+        if (fs_utils_get_mqtt_log_stats(log_class, &stats) == ESP_OK)
+        {
+            count += stats.depth;
+        }
     }
-
-    remove(FS_MQTT_LOG_FILE);
-    return ESP_OK;
+    return count;
 }
 
-size_t fs_utils_get_mqtt_log_count(void)
+esp_err_t fs_utils_get_mqtt_log_stats(fs_utils_mqtt_log_class_t log_class, fs_utils_mqtt_log_stats_t *stats)
 {
+    if (stats == NULL || log_class >= FS_UTILS_MQTT_LOG_CLASS_COUNT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
     if (!fs_mounted)
     {
-        return 0;
+        return ESP_ERR_INVALID_STATE;
     }
 
     if (s_spiffs_mutex == NULL)
     {
         ESP_LOGE(TAG, "SPIFFS mutex not initialized");
-        return 0;
+        return ESP_ERR_INVALID_STATE;
     }
 
     if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) != pdTRUE)
     {
         ESP_LOGE(TAG, "Failed to acquire SPIFFS mutex");
-        return 0;
+        return ESP_FAIL;
     }
 
-    FILE *file = fopen(FS_MQTT_LOG_FILE, "r");
-    if (file == NULL)
+    mqtt_log_journal_t *journal = &s_journals[log_class];
+    esp_err_t err = mqtt_log_load_header(journal);
+    if (err == ESP_OK)
     {
-        xSemaphoreGive(s_spiffs_mutex);
-        return 0;
+        stats->depth = journal->header.count;
+        stats->capacity = journal->header.capacity;
+        stats->bytes = journal->header.count * sizeof(mqtt_log_record_t);
+        stats->dropped = journal->header.dropped;
+        stats->compacted = journal->header.compacted;
+        stats->oldest_timestamp_ms = journal->header.oldest_timestamp_ms;
+        stats->newest_timestamp_ms = journal->header.newest_timestamp_ms;
     }
 
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    xSemaphoreGive(s_spiffs_mutex);
+    return err;
+}
 
-    if (file_size == 0)
+#ifdef CONFIG_FS_UTILS_MQTT_LOG_BENCHMARK
+void fs_utils_benchmark_mqtt_log(void)
+{
+    if (!fs_mounted || s_spiffs_mutex == NULL)
     {
-        fclose(file);
-        xSemaphoreGive(s_spiffs_mutex);
-        return 0;
+        return;
+    }
+
+    if (xSemaphoreTake(s_spiffs_mutex, portMAX_DELAY) != pdTRUE)
+    {
+        return;
     }
 
-    char *buffer = malloc(file_size + 1);
-    if (buffer == NULL)
+    // Runs against a scratch journal so the real queue is left untouched
+    static mqtt_log_journal_t bench = {.path = FS_MQTT_LOG_BENCH_FILE, .capacity = MAX_LOG_MESSAGES};
+    remove(bench.path);
+    bench.cached = false;
+    mqtt_log_header_t header;
+    FILE *file = mqtt_log_open(&bench, &header);
+    if (file == NULL)
     {
-        fclose(file);
         xSemaphoreGive(s_spiffs_mutex);
-        return 0;
+        return;
     }
 
-    fread(buffer, 1, file_size, file);
-    buffer[file_size] = '\0';
-    fclose(file);
-
-    cJSON *log_array = cJSON_Parse(buffer);
-    free(buffer);
-
-    if (log_array == NULL || !cJSON_IsArray(log_array))
+    // A log record never triggers compaction, so only the append itself is timed
+    fs_utils_mqtt_log_entry_t record = {
+        .timestamp_ms = 1766151831000LL,
+        .type = FS_UTILS_RECORD_LOG,
+    };
+    int64_t total_us = 0;
+    int64_t max_us = 0;
+    for (int i = 1; i <= MAX_LOG_MESSAGES; i++)
     {
-        if (log_array != NULL)
+        int64_t start_us = esp_timer_get_time();
+        mqtt_log_append(file, &header, &record);
+        int64_t elapsed_us = esp_timer_get_time() - start_us;
+
+        total_us += elapsed_us;
+        if (elapsed_us > max_us)
         {
-            cJSON_Delete(log_array);
+            max_us = elapsed_us;
+        }
+        if (i == 1 || i % 100 == 0)
+        {
+            ESP_LOGI(TAG, "MQTT log benchmark: depth=%lu append=%lld us", (unsigned long)header.count,
+                     (long long)elapsed_us);
         }
-        xSemaphoreGive(s_spiffs_mutex);
-        return 0;
     }
+    ESP_LOGI(TAG, "MQTT log benchmark: %d appends, avg=%lld us, max=%lld us",
+             MAX_LOG_MESSAGES, (long long)(total_us / MAX_LOG_MESSAGES), (long long)max_us);
 
-    size_t count = cJSON_GetArraySize(log_array);
-    cJSON_Delete(log_array);
+    fclose(file);
+    remove(bench.path);
     xSemaphoreGive(s_spiffs_mutex);
-    return count;
 }
+#endif
 
 // Provisioning file functions
 esp_err_t fs_utils_save_root_ca(const char *root_ca_pem, size_t len)
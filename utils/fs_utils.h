@@ -2,12 +2,17 @@
 #define FS_UTILS_H
 
 #include "esp_err.h"
+#include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
 // Filesystem paths
 // Note: SPIFFS is a flat filesystem, no subdirectories supported
 #define FS_BASE_PATH "/spiffs"
-#define FS_MQTT_LOG_FILE "/spiffs/mqtt_log.json"
+#define FS_MQTT_LOG_FILE "/spiffs/mqtt_log.bin"
+#define FS_MQTT_ALERT_LOG_FILE "/spiffs/mqtt_alerts.bin"
+#define FS_MQTT_LEGACY_LOG_FILE "/spiffs/mqtt_log.json"
+#define FS_MQTT_LOG_BENCH_FILE "/spiffs/mqtt_bench.bin"
 
 // Provisioning file paths (flat structure for SPIFFS)
 #define FS_ROOT_CA_FILE "/spiffs/root_ca.pem"
@@ -15,25 +20,107 @@
 #define FS_PRIVATE_KEY_FILE "/spiffs/private_key.pem"
 #define FS_CLIENT_ID_FILE "/spiffs/client_id.txt"
 
-// Maximum messages in log file
-#define MAX_LOG_MESSAGES 100
+// Maximum messages in log file (number of preallocated journal slots)
+#define MAX_LOG_MESSAGES 1000
+#define MAX_ALERT_LOG_MESSAGES 200
 
-// Buffer sizes for loaded log entries
-// Topics: MAC address (12 chars, no colons) + "/" + suffix ("temp"/"ph"/"feed"/"log")
-//   Max: 12 + 1 + 4 = 17 characters, using 20 for safety
-#define FS_UTILS_TOPIC_SIZE 20
-// Payloads: JSON with event, value, and timestamp - max ~112 chars, using 128 for safety
-#define FS_UTILS_PAYLOAD_SIZE 128
+// What a queued record holds; also decides the topic it is published to
+typedef enum
+{
+    FS_UTILS_RECORD_TEMP = 0,
+    FS_UTILS_RECORD_PH,
+    FS_UTILS_RECORD_FEED,
+    FS_UTILS_RECORD_LOG,
+    FS_UTILS_RECORD_TYPE_COUNT,
+} fs_utils_record_type_t;
+
+// Offline queue priority classes, each kept in its own journal. Alerts and feed
+// results drain first on reconnect and are never displaced by routine samples;
+// routine samples are compacted or dropped when their journal runs out of room.
+typedef enum
+{
+    FS_UTILS_MQTT_LOG_ALERT = 0, // Log and feed records
+    FS_UTILS_MQTT_LOG_ROUTINE,   // Temperature and pH samples
+    FS_UTILS_MQTT_LOG_CLASS_COUNT,
+} fs_utils_mqtt_log_class_t;
+
+#define FS_UTILS_RECORD_FLAG_SUCCESS 0x01   // Feed record: feeding succeeded
+#define FS_UTILS_RECORD_FLAG_HAS_VALUE 0x02 // Log record: value is a number rather than a code
+#define FS_UTILS_RECORD_FLAG_SUMMARY 0x04   // Temp/pH record: compacted mean of `code` samples
+
+// One queued telemetry record, as returned by the log cursor. The journal stores
+// it with a CRC; it is only turned into its JSON wire format when published.
+typedef struct
+{
+    int64_t timestamp_ms; // Unix time in milliseconds; start of the span for a summary
+    uint32_t sequence;    // Assigned by the journal
+    float value;          // Temperature or pH reading (mean for a summary), or a log record's number
+    float min;            // Summary only: lowest and highest sample
+    float max;
+    uint32_t span_s;      // Summary only: seconds from the first to the last sample
+    uint16_t code;        // Log record: event id in the high byte, value id in the low byte.
+                          // Summary: number of samples merged.
+    uint8_t type;         // fs_utils_record_type_t
+    uint8_t flags;        // FS_UTILS_RECORD_FLAG_*
+} fs_utils_mqtt_log_entry_t;
+
+// Offline queue statistics, read from the journal header without any file access
+typedef struct
+{
+    uint32_t depth;              // Queued records
+    uint32_t capacity;           // Journal slots
+    uint32_t bytes;              // Record bytes held by queued entries
+    uint32_t dropped;            // Records lost before they were sent
+    uint32_t compacted;          // Samples merged away into summaries
+    int64_t oldest_timestamp_ms; // 0 if the queue is empty
+    int64_t newest_timestamp_ms; // Last record ever appended
+} fs_utils_mqtt_log_stats_t;
+
+// Streaming read position in the MQTT log. Holds one open file handle and no
+// record data, so draining the queue needs a single entry buffer.
+typedef struct
+{
+    FILE *file;
+    uint8_t log_class;           // fs_utils_mqtt_log_class_t being drained
+    uint32_t next_sequence;      // Sequence of the entry the next call returns
+    uint32_t committed_sequence; // Entries before this one have been removed
+    uint32_t remaining;          // Entries not yet returned, as of the last call
+} fs_utils_mqtt_log_cursor_t;
 
 // Initialize SPIFFS filesystem
 esp_err_t fs_utils_init(void);
 
-// MQTT log functions
-esp_err_t fs_utils_save_mqtt_log(const char *topic, int qos, const char *payload, char *log_id, size_t log_id_size);
-esp_err_t fs_utils_load_mqtt_logs(char **topics, int **qos, char **payloads, time_t **timestamps, char ***log_ids, size_t *count);
-esp_err_t fs_utils_remove_mqtt_log(const char *id);
+// MQTT log functions. Entries are queued in the journal of their class.
+fs_utils_mqtt_log_class_t fs_utils_mqtt_log_class_of(const fs_utils_mqtt_log_entry_t *entry);
+esp_err_t fs_utils_save_mqtt_log(const fs_utils_mqtt_log_entry_t *entry);
+// Appends several entries with one open and header write per journal. Each
+// entry's timestamp is kept; sequences are assigned by the journal.
+esp_err_t fs_utils_save_mqtt_logs(const fs_utils_mqtt_log_entry_t *entries, size_t count, size_t *saved);
 esp_err_t fs_utils_clear_mqtt_logs(void);
+// Entries queued across every class
 size_t fs_utils_get_mqtt_log_count(void);
+esp_err_t fs_utils_get_mqtt_log_stats(fs_utils_mqtt_log_class_t log_class, fs_utils_mqtt_log_stats_t *stats);
+#ifdef CONFIG_FS_UTILS_MQTT_LOG_BENCHMARK
+void fs_utils_benchmark_mqtt_log(void);
+#endif
+
+// MQTT log cursor over one class: open, read entries oldest first with next, then
+// commit to remove every entry returned so far. Entries that are not committed
+// stay queued. Sequence numbers are per class.
+esp_err_t fs_utils_mqtt_log_open(fs_utils_mqtt_log_cursor_t *cursor, fs_utils_mqtt_log_class_t log_class);
+esp_err_t fs_utils_mqtt_log_next(fs_utils_mqtt_log_cursor_t *cursor, fs_utils_mqtt_log_entry_t *entry);
+esp_err_t fs_utils_mqtt_log_commit(fs_utils_mqtt_log_cursor_t *cursor);
+void fs_utils_mqtt_log_close(fs_utils_mqtt_log_cursor_t *cursor);
+// Removes every queued entry with a sequence number below the given one, e.g.
+// once the broker has acknowledged them. Does not need an open cursor.
+esp_err_t fs_utils_mqtt_log_commit_until(fs_utils_mqtt_log_class_t log_class, uint32_t sequence);
+
+// Log records keep their event and value as codes. Fills in a log record for the
+// given strings; ESP_ERR_NOT_FOUND if the event is unknown. A value that is not
+// one of the known strings is stored as a number.
+esp_err_t fs_utils_make_log_record(fs_utils_mqtt_log_entry_t *entry, const char *event, const char *value);
+const char *fs_utils_log_event_name(const fs_utils_mqtt_log_entry_t *entry);
+const char *fs_utils_log_value_name(const fs_utils_mqtt_log_entry_t *entry);
 
 // Provisioning file functions
 esp_err_t fs_utils_save_root_ca(const char *root_ca_pem, size_t len);
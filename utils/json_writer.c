@@ -0,0 +1,205 @@
+#include "json_writer.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static void put(json_writer_t *writer, const char *data, size_t len)
+{
+    if (writer->overflow)
+    {
+        return;
+    }
+    // Keep room for the terminator
+    if (writer->len + len >= writer->size)
+    {
+        writer->overflow = true;
+        return;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+    writer->buf[writer->len] = '\0';
+}
+
+static void put_char(json_writer_t *writer, char c)
+{
+    put(writer, &c, 1);
+}
+
+static void put_string(json_writer_t *writer, const char *value)
+{
+    put_char(writer, '"');
+    const char *run = value;
+    for (const char *p = value; *p != '\0'; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c != '"' && c != '\\' && c >= 0x20)
+        {
+            continue;
+        }
+
+        put(writer, run, p - run);
+        run = p + 1;
+
+        char escape[8];
+        switch (c)
+        {
+        case '"':
+            put(writer, "\\\"", 2);
+            break;
+        case '\\':
+            put(writer, "\\\\", 2);
+            break;
+        case '\n':
+            put(writer, "\\n", 2);
+            break;
+        case '\r':
+            put(writer, "\\r", 2);
+            break;
+        case '\t':
+            put(writer, "\\t", 2);
+            break;
+        default:
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            put(writer, escape, 6);
+            break;
+        }
+    }
+    put(writer, run, strlen(run));
+    put_char(writer, '"');
+}
+
+// Separator and member name ahead of every value
+static void begin_value(json_writer_t *writer, const char *key)
+{
+    if (writer->depth > 0)
+    {
+        uint32_t bit = 1UL << (writer->depth - 1);
+        if (writer->first & bit)
+        {
+            writer->first &= ~bit;
+        }
+        else
+        {
+            put_char(writer, ',');
+        }
+    }
+    if (key != NULL)
+    {
+        put_string(writer, key);
+        put_char(writer, ':');
+    }
+}
+
+static void begin_container(json_writer_t *writer, const char *key, char open)
+{
+    begin_value(writer, key);
+    if (writer->depth >= JSON_WRITER_MAX_DEPTH)
+    {
+        writer->overflow = true;
+        return;
+    }
+    put_char(writer, open);
+    writer->depth++;
+    writer->first |= 1UL << (writer->depth - 1);
+}
+
+static void end_container(json_writer_t *writer, char close)
+{
+    if (writer->depth == 0)
+    {
+        writer->overflow = true;
+        return;
+    }
+    writer->depth--;
+    put_char(writer, close);
+}
+
+void json_writer_init(json_writer_t *writer, char *buf, size_t size)
+{
+    writer->buf = buf;
+    writer->size = size;
+    writer->len = 0;
+    writer->first = 0;
+    writer->depth = 0;
+    writer->overflow = size == 0;
+    if (size > 0)
+    {
+        buf[0] = '\0';
+    }
+}
+
+void json_writer_begin_object(json_writer_t *writer, const char *key)
+{
+    begin_container(writer, key, '{');
+}
+
+void json_writer_end_object(json_writer_t *writer)
+{
+    end_container(writer, '}');
+}
+
+void json_writer_begin_array(json_writer_t *writer, const char *key)
+{
+    begin_container(writer, key, '[');
+}
+
+void json_writer_end_array(json_writer_t *writer)
+{
+    end_container(writer, ']');
+}
+
+void json_writer_string(json_writer_t *writer, const char *key, const char *value)
+{
+    begin_value(writer, key);
+    put_string(writer, value);
+}
+
+void json_writer_int(json_writer_t *writer, const char *key, int64_t value)
+{
+    char number[24];
+    int len = snprintf(number, sizeof(number), "%lld", (long long)value);
+    begin_value(writer, key);
+    put(writer, number, len);
+}
+
+void json_writer_number(json_writer_t *writer, const char *key, double value, int digits)
+{
+    if (!isfinite(value))
+    {
+        json_writer_null(writer, key);
+        return;
+    }
+
+    char number[32];
+    int len = snprintf(number, sizeof(number), "%.*g", digits, value);
+    begin_value(writer, key);
+    put(writer, number, len);
+}
+
+void json_writer_bool(json_writer_t *writer, const char *key, bool value)
+{
+    begin_value(writer, key);
+    if (value)
+    {
+        put(writer, "true", 4);
+    }
+    else
+    {
+        put(writer, "false", 5);
+    }
+}
+
+void json_writer_null(json_writer_t *writer, const char *key)
+{
+    begin_value(writer, key);
+    put(writer, "null", 4);
+}
+
+int json_writer_finish(json_writer_t *writer)
+{
+    if (writer->overflow || writer->depth != 0)
+    {
+        return -1;
+    }
+    return (int)writer->len;
+}
@@ -0,0 +1,46 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Nesting deeper than this is treated as an overflow
+#define JSON_WRITER_MAX_DEPTH 16
+
+// Significant digits for json_writer_number(). Deliberately below the 9 / 17
+// needed to round-trip the binary value: these are the digits the type holds
+// reliably, so 0.1f prints as 0.1 rather than 0.100000001 and payloads stay short.
+#define JSON_WRITER_FLOAT_DIGITS 7
+#define JSON_WRITER_DOUBLE_DIGITS 15
+
+// Compact JSON serializer into a caller-supplied buffer. Nothing is allocated;
+// once the buffer is full further output is dropped and json_writer_finish()
+// reports the overflow. `key` is the member name inside an object and NULL for
+// array elements and the top-level value.
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t len;
+    uint32_t first; // Bit per depth: container has no members yet
+    uint8_t depth;
+    bool overflow;
+} json_writer_t;
+
+void json_writer_init(json_writer_t *writer, char *buf, size_t size);
+void json_writer_begin_object(json_writer_t *writer, const char *key);
+void json_writer_end_object(json_writer_t *writer);
+void json_writer_begin_array(json_writer_t *writer, const char *key);
+void json_writer_end_array(json_writer_t *writer);
+void json_writer_string(json_writer_t *writer, const char *key, const char *value);
+void json_writer_int(json_writer_t *writer, const char *key, int64_t value);
+// NaN and infinities are written as null
+void json_writer_number(json_writer_t *writer, const char *key, double value, int digits);
+void json_writer_bool(json_writer_t *writer, const char *key, bool value);
+void json_writer_null(json_writer_t *writer, const char *key);
+// Returns the payload length, or -1 if it did not fit. The buffer is always
+// NUL-terminated.
+int json_writer_finish(json_writer_t *writer);
+
+#endif // JSON_WRITER_H